@@ -3,11 +3,16 @@
 
 #include "main.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <optional>
 #include <utility>
 #include <vector>
 
@@ -25,6 +30,8 @@
 #include "../src/inference.h"
 #include "../src/initialize.h"
 #include "../src/nft_collection.h"
+#include "../src/run.h"
+#include "../src/runstate_store.h"
 #include "../src/upload.h"
 #include "../src/users.h"
 
@@ -75,6 +82,23 @@ int main() {
 
   bool silent_on_trap = true;
 
+  // -----------------------------------------------------------------------------
+  // The fast expf of run.c (compile with -DFAST_EXPF), against the libm reference
+  {
+    double max_rel_error = 0.0;
+    for (float x = -87.0f; x <= 88.0f; x += 0.001f) {
+      double ref = std::exp(double(x));
+      max_rel_error =
+          std::max(max_rel_error, std::abs(expf_fast(x) - ref) / ref);
+    }
+    std::cout << "expf_fast: max relative error = " << max_rel_error << "\n";
+    if (max_rel_error > std::numeric_limits<float>::epsilon() ||
+        expf_fast(0.0f) != 1.0f || expf_fast(-1000.0f) > 1.2e-38f) {
+      std::cout << "ERROR: expf_fast is not accurate enough\n";
+      return 1;
+    }
+  }
+
   // The model & tokenizer to use
   int model_to_use = 1; // 1=260K, 2=15M, 3=42M, 4=110M (TinyStories)
 
@@ -199,6 +223,21 @@ int main() {
                   "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
                   silent_on_trap, my_principal);
 
+  // '("int4": text)'
+  // -> '(variant { Err = "ERROR: unknown kv cache type = int4" : text})'
+  mockIC.run_test(
+      "set_kv_cache_type to int4", set_kv_cache_type,
+      "4449444c00017104696e7434",
+      "4449444c026b01b0ad8fcd0c716b01c5fed2010001010000234552524f523a20756e6b6e6f776e206b762063616368652074797065203d20696e7434",
+      silent_on_trap, my_principal);
+
+  // '("fp32": text)'
+  // -> '(variant { Ok = record { status_code = 200 : nat16} })'
+  mockIC.run_test("set_kv_cache_type to fp32", set_kv_cache_type,
+                  "4449444c0001710466703332",
+                  "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                  silent_on_trap, my_principal);
+
   // -----------------------------------------------------------------------------
   // The canister health & readiness checks
   // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
@@ -233,6 +272,17 @@ int main() {
                   "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
                   silent_on_trap, my_principal);
 
+  // No draft model for speculative decoding
+  // '()' -> '(variant { Err = record { Other = "Access Denied"} })'
+  mockIC.run_test(
+      "reset_draft_model Err", reset_draft_model, "4449444c0000",
+      "4449444c026b01b0ad8fcd0c716b01c5fed20100010100000d4163636573732044656e696564",
+      silent_on_trap, anonymous_principal);
+  // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+  mockIC.run_test("reset_draft_model", reset_draft_model, "4449444c0000",
+                  "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                  silent_on_trap, my_principal);
+
   // ==========================================================================
   std::cout << "\n+++++++++++++++++++++++++++++++++++++++++++++++++++++\n";
   std::cout << "Sending bytes of " << model_path << "\n";
@@ -362,11 +412,13 @@ int main() {
       n_kv_heads = 5 : int;
       vocab_size = 512 : int;
       seq_len = 8 : int;
+      weight_format = "fp32";
+      group_size = 0 : int;
     },
   )'
   */
     expected_response =
-        "4449444c016c07c8fab0027cb087c0d9017cd58488bc027cb3fdc984037cf3e0d4d6057cf5cfd3fc057c82c3e4f60f7c0100c000048004ac0105800408";
+        "4449444c016c09c8fab0027cb087c0d9017cd58488bc027cb3fdc984037cf3e0d4d6057cf5cfd3fc057cde9c93f9097181ca8b980e7c82c3e4f60f7c0100c000048004ac0105800404667033320008";
   } else if (model_to_use == 2) {
     /*
   '()' -> 
@@ -379,11 +431,13 @@ int main() {
       n_kv_heads = 6 : int;
       vocab_size = 32_000 : int;
       seq_len = 256 : int;
+      weight_format = "fp32";
+      group_size = 0 : int;
     },
   )'
   */
     expected_response =
-        "4449444c016c07c8fab0027cb087c0d9017cd58488bc027cb3fdc984037cf3e0d4d6057cf5cfd3fc057c82c3e4f60f7c0100a0020680fa01800606800206";
+        "4449444c016c09c8fab0027cb087c0d9017cd58488bc027cb3fdc984037cf3e0d4d6057cf5cfd3fc057cde9c93f9097181ca8b980e7c82c3e4f60f7c0100a0020680fa01800606800204667033320006";
   } else if (model_to_use == 3) {
     /*
   '()' -> 
@@ -396,11 +450,13 @@ int main() {
       n_kv_heads = 8 : int;
       vocab_size = 32_000 : int;
       seq_len = 1024 : int;
+      weight_format = "fp32";
+      group_size = 0 : int;
     },
   )'
   */
     expected_response =
-        "4449444c016c07c8fab0027cb087c0d9017cd58488bc027cb3fdc984037cf3e0d4d6057cf5cfd3fc057c82c3e4f60f7c010080040880fa01e00a08800808";
+        "4449444c016c09c8fab0027cb087c0d9017cd58488bc027cb3fdc984037cf3e0d4d6057cf5cfd3fc057cde9c93f9097181ca8b980e7c82c3e4f60f7c010080040880fa01e00a08800804667033320008";
   } else if (model_to_use == 4) {
     /*
   '()' -> 
@@ -413,11 +469,13 @@ int main() {
       n_kv_heads = 12 : int;
       vocab_size = 32_000 : int;
       seq_len = 1024 : int;
+      weight_format = "fp32";
+      group_size = 0 : int;
     },
   )'
   */
     expected_response =
-        "4449444c016c07c8fab0027cb087c0d9017cd58488bc027cb3fdc984037cf3e0d4d6057cf5cfd3fc057c82c3e4f60f7c010080060c80fa0180100c80080c";
+        "4449444c016c09c8fab0027cb087c0d9017cd58488bc027cb3fdc984037cf3e0d4d6057cf5cfd3fc057cde9c93f9097181ca8b980e7c82c3e4f60f7c010080060c80fa0180100c80080466703332000c";
   }
   mockIC.run_test("get_model_config", get_model_config, "4449444c0000",
                   expected_response, silent_on_trap, my_principal);
@@ -567,6 +625,68 @@ int main() {
     std::cout << story;
   }
 
+  // -----------------------------------------------------------------------------------------
+  // A new chat with attention sinks, generating beyond seq_len = 512 of the 260K model
+  if (model_to_use == 1) {
+    // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+    mockIC.run_test("new_chat", new_chat, "4449444c0000",
+                    "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                    silent_on_trap, your_principal);
+
+    // The prompt, then 600 tokens in one call, then 100 more in a second call
+    // With temperature=0.0: greedy argmax sampling -> the story will be the same every time
+    std::array<std::string, 3> prompt = {"Lilly went to the beach", "", ""};
+    std::array<uint64_t, 3> steps = {0, 600, 100};
+    float temperature = 0.0;
+    float topp = 0.9;
+    uint64_t rng_seed = 0;
+    std::optional<uint64_t> attention_sinks = 4;
+
+    std::string generated_tokens = "";
+    uint64_t num_tokens = 0;
+    std::string story = "";
+    for (int i = 0; i < 3; i++) {
+      CandidTypeRecord r_in;
+      r_in.append("prompt", CandidTypeText(prompt[i]));
+      r_in.append("steps", CandidTypeNat64(steps[i]));
+      r_in.append("temperature", CandidTypeFloat32(temperature));
+      r_in.append("topp", CandidTypeFloat32(topp));
+      r_in.append("rng_seed", CandidTypeNat64(uint64_t(rng_seed)));
+      r_in.append("attention_sinks", CandidTypeOptNat64(attention_sinks));
+      candid_in = CandidSerialize(r_in).as_hex_string();
+
+      std::string candid_out;
+      mockIC.run_test("inference attention_sinks", inference, candid_in, "",
+                      silent_on_trap, your_principal, &candid_out);
+
+      CandidTypeRecord inference_record;
+      inference_record.append("inference", CandidTypeText{&generated_tokens});
+      inference_record.append("num_tokens", CandidTypeNat64{&num_tokens});
+      std::string err_text;
+      CandidTypeVariant v_out;
+      v_out.append("Ok", inference_record);
+      v_out.append("Err",
+                   CandidTypeVariant{"Other", CandidTypeText(&err_text)});
+
+      CandidArgs A;
+      A.append(v_out);
+      CandidDeserialize(candid_out, A);
+      if (err_text.size() > 0) {
+        std::cout << "Err returned by inference function:\n" << err_text
+                  << "\n";
+        exit(1);
+      }
+      // Without attention sinks, the story would stop at position 511
+      if (i > 0 && (num_tokens != steps[i] || generated_tokens.empty())) {
+        std::cout << "inference with attention_sinks generated " << num_tokens
+                  << " instead of " << steps[i] << " tokens\n";
+        exit(1);
+      }
+      story += generated_tokens;
+    }
+    std::cout << story;
+  }
+
   // -----------------------------------------------------------------------------------------
   // A new chat
   // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
@@ -590,6 +710,237 @@ int main() {
       "4449444c016c05b4e8c2e40373bbb885e80473a7f7b9a00878c5c8cea60878a4a3e1aa0b710100000000000000803f6400000000000000000000000000000000",
       expected_response, silent_on_trap, my_principal);
 
+  // -----------------------------------------------------------------------------------------
+  // A new chat, with prompt lookup: the same greedy story as without it
+  // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+  mockIC.run_test("new_chat", new_chat, "4449444c0000",
+                  "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                  silent_on_trap, my_principal);
+  // '(record {prompt = "" : text; steps = 100 : nat64; temperature = 0.0 : float32; topp = 1.0 : float32; rng_seed = 0 : nat64; ngram_lookup = opt (8 : nat64);})'
+  // -> the response of "inference 1"
+  {
+    std::optional<uint64_t> ngram_lookup = 8;
+    CandidTypeRecord r_in;
+    r_in.append("prompt", CandidTypeText(std::string("")));
+    r_in.append("steps", CandidTypeNat64(uint64_t(100)));
+    r_in.append("temperature", CandidTypeFloat32(0.0));
+    r_in.append("topp", CandidTypeFloat32(1.0));
+    r_in.append("rng_seed", CandidTypeNat64(uint64_t(0)));
+    r_in.append("ngram_lookup", CandidTypeOptNat64(ngram_lookup));
+    candid_in = CandidSerialize(r_in).as_hex_string();
+    mockIC.run_test("inference 1 ngram_lookup", inference, candid_in,
+                    expected_response, silent_on_trap, my_principal);
+  }
+
+  // The proposed tokens of prompt lookup are counted in the user metadata
+  // '("expmt-...-lae")' -> '(variant { Ok = record { chats_start_time = vec {...}; chats_total_steps = vec {...}; chats_lookup_accepted = vec {...}; chats_lookup_rejected = vec {...};} })'
+  {
+    candid_in = CandidSerialize(CandidTypeText(my_principal)).as_hex_string();
+    std::string candid_out;
+    mockIC.run_test("get_user_metadata ngram_lookup", get_user_metadata,
+                    candid_in, "", silent_on_trap, my_principal, &candid_out);
+
+    std::vector<uint64_t> chats_start_time;
+    std::vector<uint64_t> chats_total_steps;
+    std::vector<uint64_t> chats_lookup_accepted;
+    std::vector<uint64_t> chats_lookup_rejected;
+    CandidTypeRecord user_metadata_record;
+    user_metadata_record.append("chats_start_time",
+                                CandidTypeVecNat64{&chats_start_time});
+    user_metadata_record.append("chats_total_steps",
+                                CandidTypeVecNat64{&chats_total_steps});
+    user_metadata_record.append("chats_lookup_accepted",
+                                CandidTypeVecNat64{&chats_lookup_accepted});
+    user_metadata_record.append("chats_lookup_rejected",
+                                CandidTypeVecNat64{&chats_lookup_rejected});
+    std::string err_text;
+    CandidTypeVariant v_out;
+    v_out.append("Ok", user_metadata_record);
+    v_out.append("Err", CandidTypeVariant{"Other", CandidTypeText(&err_text)});
+
+    CandidArgs A;
+    A.append(v_out);
+    CandidDeserialize(candid_out, A);
+    if (err_text.size() > 0) {
+      std::cout << "Err returned by get_user_metadata function:\n" << err_text
+                << "\n";
+      exit(1);
+    }
+    // The last chat is the one with prompt lookup, the one before it without
+    size_t n_chats = chats_start_time.size();
+    if (n_chats < 2 || chats_lookup_accepted.size() != n_chats ||
+        chats_lookup_rejected.size() != n_chats ||
+        chats_lookup_accepted[n_chats - 1] == 0 ||
+        chats_lookup_accepted[n_chats - 2] +
+                chats_lookup_rejected[n_chats - 2] >
+            0) {
+      std::cout << "get_user_metadata did not return the counts of prompt "
+                << "lookup of the chats\n";
+      exit(1);
+    }
+  }
+
+  // -----------------------------------------------------------------------------------------
+  // The text of the story of "inference 1", for the tests below
+  std::string story_1;
+  if (model_to_use == 1) {
+    std::string err_text;
+    uint64_t num_tokens = 0;
+    CandidTypeRecord inference_record;
+    inference_record.append("inference", CandidTypeText{&story_1});
+    inference_record.append("num_tokens", CandidTypeNat64{&num_tokens});
+    CandidTypeVariant v_out;
+    v_out.append("Ok", inference_record);
+    v_out.append("Err", CandidTypeVariant{"Other", CandidTypeText(&err_text)});
+    CandidArgs A;
+    A.append(v_out);
+    CandidDeserialize(expected_response, A);
+  }
+
+  // A greedy story of 100 steps by a new chat, in n_calls calls. Between the
+  // calls, initialize takes the runstate out of memory, so the next call reads
+  // it back from the store, or recomputes it.
+  auto greedy_story = [&](const std::string &test_name, int n_calls) {
+    // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+    mockIC.run_test("new_chat", new_chat, "4449444c0000",
+                    "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                    silent_on_trap, my_principal);
+
+    std::string story = "";
+    for (int i = 0; i < n_calls; i++) {
+      if (i > 0) {
+        // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+        mockIC.run_test("initialize", initialize, "4449444c0000",
+                        "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                        silent_on_trap, my_principal);
+      }
+      CandidTypeRecord r_in;
+      r_in.append("prompt", CandidTypeText(std::string("")));
+      r_in.append("steps", CandidTypeNat64(uint64_t(100 / n_calls)));
+      r_in.append("temperature", CandidTypeFloat32(0.0));
+      r_in.append("topp", CandidTypeFloat32(1.0));
+      r_in.append("rng_seed", CandidTypeNat64(uint64_t(0)));
+      candid_in = CandidSerialize(r_in).as_hex_string();
+
+      std::string candid_out;
+      mockIC.run_test(test_name, inference, candid_in, "", silent_on_trap,
+                      my_principal, &candid_out);
+
+      std::string generated_tokens = "";
+      uint64_t num_tokens = 0;
+      CandidTypeRecord inference_record;
+      inference_record.append("inference", CandidTypeText{&generated_tokens});
+      inference_record.append("num_tokens", CandidTypeNat64{&num_tokens});
+      std::string err_text;
+      CandidTypeVariant v_out;
+      v_out.append("Ok", inference_record);
+      v_out.append("Err",
+                   CandidTypeVariant{"Other", CandidTypeText(&err_text)});
+
+      CandidArgs A;
+      A.append(v_out);
+      CandidDeserialize(candid_out, A);
+      if (err_text.size() > 0) {
+        std::cout << "Err returned by inference function:\n" << err_text
+                  << "\n";
+        exit(1);
+      }
+      story += generated_tokens;
+    }
+    return story;
+  };
+
+  // -----------------------------------------------------------------------------------------
+  // Recompute instead of store: the story of "inference 1" in two calls is the
+  // same when its kv cache is recomputed from the tokens, as when it is read
+  // back
+  if (model_to_use == 1) {
+    // The runstate is stored
+    if (greedy_story("inference stored", 2) != story_1) {
+      std::cout << "inference stored did not generate the story of inference 1\n";
+      exit(1);
+    }
+
+    // A ratio at which every kv cache is cheaper to recompute
+    // '(1_000_000_000 : nat64)' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+    candid_in = CandidSerialize(CandidTypeNat64(uint64_t(1000000000)))
+                    .as_hex_string();
+    mockIC.run_test("set_recompute_flops_per_io_byte",
+                    set_recompute_flops_per_io_byte, candid_in,
+                    "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                    silent_on_trap, my_principal);
+
+    // The runstate is recomputed
+    if (greedy_story("inference recomputed", 2) != story_1) {
+      std::cout << "inference recomputed did not generate the story of inference 1\n";
+      exit(1);
+    }
+
+    // Only the tokens were kept, not the kv cache rows
+    // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+    mockIC.run_test("initialize", initialize, "4449444c0000",
+                    "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                    silent_on_trap, my_principal);
+    if (p_runstate_store && p_runstate_store->contains(my_principal)) {
+      std::cout << "set_recompute_flops_per_io_byte did not recompute the "
+                << "runstate instead of storing it\n";
+      exit(1);
+    }
+
+    // Back to the default, always store
+    // '(0 : nat64)' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+    candid_in = CandidSerialize(CandidTypeNat64(uint64_t(0))).as_hex_string();
+    mockIC.run_test("set_recompute_flops_per_io_byte",
+                    set_recompute_flops_per_io_byte, candid_in,
+                    "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                    silent_on_trap, my_principal);
+  }
+
+  // -----------------------------------------------------------------------------------------
+  // Speculative decoding with a draft model: the 260K model as its own draft,
+  // with the same vocab_size & seq_len, generates the story of "inference 1",
+  // also when the second call reads the kv cache of the draft back
+  if (model_to_use == 1) {
+    for (auto &indices : chunk_file(model_bytes, x_chunk)) {
+      std::vector<uint8_t> chunk(model_bytes.begin() + indices.first,
+                                 model_bytes.begin() + indices.second);
+      candid_in = CandidSerialize(CandidTypeVecNat8{chunk}).as_hex_string();
+      // candid_in -> '(variant { Ok = record { status_code = 200 : nat16} })'
+      mockIC.run_test("upload_draft_model_bytes_chunk",
+                      upload_draft_model_bytes_chunk, candid_in,
+                      "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                      silent_on_trap, my_principal);
+    }
+    // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+    mockIC.run_test("initialize", initialize, "4449444c0000",
+                    "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                    silent_on_trap, my_principal);
+    if (!draft_model_ready) {
+      std::cout << "initialize did not build the draft model\n";
+      exit(1);
+    }
+
+    if (greedy_story("inference draft", 2) != story_1) {
+      std::cout << "inference draft did not generate the story of inference 1\n";
+      exit(1);
+    }
+    const Chat &chat = p_chats->umap[my_principal];
+    if (chat.draft_pos != chat.pos) {
+      std::cout << "the draft model is not in sync with the story\n";
+      exit(1);
+    }
+
+    // Without the draft model again, for the tests below
+    // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+    mockIC.run_test("reset_draft_model", reset_draft_model, "4449444c0000",
+                    "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                    silent_on_trap, my_principal);
+    // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+    mockIC.run_test("initialize", initialize, "4449444c0000",
+                    "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                    silent_on_trap, my_principal);
+  }
+
   // -----------------------------------------------------------------------------------------
   // A new chat, pretend it being called from Motoko, using float64
   // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
@@ -1091,6 +1442,97 @@ int main() {
       "4449444c056c05efd6e40271e1edeb4a71a2f5ed880401c6a4a1980602b0f1b99806046d7b6d036c02007101716e7a01000a2f6170692f6e66742f3103474554027b7d1404686f73742378787878782d78787878782d78787878782d78787878782d6361692e696370302e696f09782d7265616c2d69700d78782e78782e7878782e7878780f782d666f727761726465642d666f720d78782e78782e7878782e78787811782d666f727761726465642d70726f746f0568747470730c782d726571756573742d69642431356161643061362d653432322d323665352d383939322d6333666534373766666564641b782d6963782d726571756972652d63657274696669636174696f6e013106707261676d61086e6f2d63616368650d63616368652d636f6e74726f6c086e6f2d6361636865097365632d63682d756138224e6f745f41204272616e64223b763d2238222c20224368726f6d69756d223b763d22313230222c20224272617665223b763d2231323022107365632d63682d75612d6d6f62696c65023f300a757365722d6167656e74654d6f7a696c6c612f352e3020285831313b204c696e7578207838365f363429204170706c655765624b69742f3533372e333620284b48544d4c2c206c696b65204765636b6f29204368726f6d652f3132302e302e302e30205361666172692f3533372e3336127365632d63682d75612d706c6174666f726d07224c696e75782206616363657074032a2f2a077365632d6770630131066f726967696e046e756c6c0e7365632d66657463682d736974650a63726f73732d736974650e7365632d66657463682d6d6f646504636f72730e7365632d66657463682d6465737405656d7074790f6163636570742d656e636f64696e671b677a69702c206465666c6174652c2062722c206964656e746974790f6163636570742d6c616e67756167650e656e2d55532c656e3b713d302e39010200",
       expected_response, silent_on_trap, my_principal);
 
+  // ------------------------------------------------------------------------
+  // Continue the stories of token-A and token-B together, in one batch
+
+  // '(record { token_ids = vec {"token-A"; "token-B"}; prompts = vec {""; ""}; steps = vec {10 : nat64; 10 : nat64}; temperatures = vec {0.0 : float32; 0.0 : float32}; topps = vec {1.0 : float32; 1.0 : float32}; rng_seeds = vec {0 : nat64; 0 : nat64};})'
+  expected_response = "-to-do-";
+  if (model_to_use == 1) {
+    // -> '(variant { Ok = record { num_tokens = vec {10; 10}; inferences = vec {"...story A..."; "...story B..."};} })'
+    expected_response =
+        "4449444c046c02f3feb4990601fa8881cc0b026d786d716b01bc8a0100010300020a000000000000000a00000000000000020b436861726c69652e0a22491861742e0a2243616e204920706c6179207769746820796f75";
+  } else if (model_to_use == 2) {
+  } else if (model_to_use == 3) {
+  } else if (model_to_use == 4) {
+  }
+  // Verify it returns Err when caller is not whitelisted
+  // -> '(variant { Err = variant { Other = "Access Denied - You are not authorized to call this function." } })'
+  mockIC.run_test(
+      "nft_story_continue_batch Err test", nft_story_continue_batch,
+      "4449444c046c06d8afbda10103a7f7b9a008028eb1f0a20b02b2f9d8d70b01bff3b3900c03cfbcbcbf0f016d716d786d730100020000803f0000803f020a000000000000000a0000000000000002000000000000000000000000000000000207746f6b656e2d4107746f6b656e2d42020000000000000000020000",
+      "4449444c026b01b0ad8fcd0c716b01c5fed20100010100003d4163636573732044656e696564202d20596f7520617265206e6f7420617574686f72697a656420746f2063616c6c20746869732066756e6374696f6e2e",
+      silent_on_trap, your_principal);
+  // Verify it returns Err when the vectors do not have the same length (steps = vec {10 : nat64})
+  // -> '(variant { Err = variant { Other = "All vectors of the batch must have the same length." } })'
+  mockIC.run_test(
+      "nft_story_continue_batch Err test lengths", nft_story_continue_batch,
+      "4449444c046c06d8afbda10103a7f7b9a008028eb1f0a20b02b2f9d8d70b01bff3b3900c03cfbcbcbf0f016d716d786d730100020000803f0000803f010a0000000000000002000000000000000000000000000000000207746f6b656e2d4107746f6b656e2d42020000000000000000020000",
+      "4449444c026b01b0ad8fcd0c716b01c5fed201000101000033416c6c20766563746f7273206f6620746865206261746368206d7573742068617665207468652073616d65206c656e6774682e",
+      silent_on_trap, my_principal);
+  mockIC.run_test(
+      "nft_story_continue_batch", nft_story_continue_batch,
+      "4449444c046c06d8afbda10103a7f7b9a008028eb1f0a20b02b2f9d8d70b01bff3b3900c03cfbcbcbf0f016d716d786d730100020000803f0000803f020a000000000000000a0000000000000002000000000000000000000000000000000207746f6b656e2d4107746f6b656e2d42020000000000000000020000",
+      expected_response, silent_on_trap, my_principal);
+
+  // Continue the batch twice more: every call must read back the kv cache
+  // rows that the previous call wrote, see save_kv_cache
+  {
+    std::vector<std::string> token_ids = {"token-A", "token-B"};
+    std::vector<std::string> prompts = {"", ""};
+    std::vector<uint64_t> steps = {10, 10};
+    std::vector<float> temperatures = {0.0, 0.0};
+    std::vector<float> topps = {1.0, 1.0};
+    std::vector<uint64_t> rng_seeds = {0, 0};
+
+    std::array<std::string, 2> story = {"", ""};
+    for (int i = 0; i < 2; i++) {
+      CandidTypeRecord r_in;
+      r_in.append("token_ids", CandidTypeVecText(token_ids));
+      r_in.append("prompts", CandidTypeVecText(prompts));
+      r_in.append("steps", CandidTypeVecNat64(steps));
+      r_in.append("temperatures", CandidTypeVecFloat32(temperatures));
+      r_in.append("topps", CandidTypeVecFloat32(topps));
+      r_in.append("rng_seeds", CandidTypeVecNat64(rng_seeds));
+      candid_in = CandidSerialize(r_in).as_hex_string();
+
+      std::string candid_out;
+      mockIC.run_test("nft_story_continue_batch again",
+                      nft_story_continue_batch, candid_in, "", silent_on_trap,
+                      my_principal, &candid_out);
+
+      std::vector<uint64_t> num_tokens;
+      std::vector<std::string> inferences;
+      CandidTypeRecord inference_batch_record;
+      inference_batch_record.append("num_tokens",
+                                    CandidTypeVecNat64{&num_tokens});
+      inference_batch_record.append("inferences",
+                                    CandidTypeVecText{&inferences});
+      std::string err_text;
+      CandidTypeVariant v_out;
+      v_out.append("Ok", inference_batch_record);
+      v_out.append("Err",
+                   CandidTypeVariant{"Other", CandidTypeText(&err_text)});
+
+      CandidArgs A;
+      A.append(v_out);
+      CandidDeserialize(candid_out, A);
+      if (err_text.size() > 0 || inferences.size() != 2) {
+        std::cout << "Err returned by nft_story_continue_batch function:\n"
+                  << err_text << "\n";
+        exit(1);
+      }
+      for (int j = 0; j < 2; j++) {
+        if (num_tokens[j] == 0 || inferences[j].empty()) {
+          std::cout << "nft_story_continue_batch did not continue the story "
+                    << "of " << token_ids[j] << "\n";
+          exit(1);
+        }
+        story[j] += inferences[j];
+        std::cout << story[j] << "\n";
+      }
+    }
+  }
+
   // #########################################################################################
   // -----------------------------------------------------------------------------------------
   // Users data
@@ -1133,6 +1575,150 @@ int main() {
                   "4449444c000171093269626f372d646961", "", silent_on_trap,
                   my_principal);
 
+  // -----------------------------------------------------------------------------------------
+  // The 260K model in the other weight formats, written by
+  // scripts.quantize_model next to stories260K.bin (see the test-all-llms
+  // target of the Makefile). Each is uploaded & initialized, and generates a
+  // greedy story in two calls.
+  auto read_file = [](const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      std::cout << "Couldn't open file " << path << ", write it with "
+                << "scripts.quantize_model, see the Makefile\n";
+      exit(1);
+    }
+    return std::vector<uint8_t>((std::istreambuf_iterator<char>(file)),
+                                std::istreambuf_iterator<char>());
+  };
+  auto upload_model = [&](const std::vector<uint8_t> &bytes) {
+    // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+    mockIC.run_test("reset_model", reset_model, "4449444c0000",
+                    "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                    silent_on_trap, my_principal);
+    for (auto &indices : chunk_file(bytes, x_chunk)) {
+      std::vector<uint8_t> chunk(bytes.begin() + indices.first,
+                                 bytes.begin() + indices.second);
+      candid_in = CandidSerialize(CandidTypeVecNat8{chunk}).as_hex_string();
+      // candid_in -> '(variant { Ok = record { status_code = 200 : nat16} })'
+      mockIC.run_test("upload_model_bytes_chunk", upload_model_bytes_chunk,
+                      candid_in,
+                      "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                      silent_on_trap, my_principal);
+    }
+  };
+  if (model_to_use == 1) {
+    struct WeightFormatTest {
+      std::string path;
+      std::string model_config; // the response of get_model_config
+      std::string story;        // the greedy story of 100 steps
+    };
+    std::vector<WeightFormatTest> weight_format_tests = {
+        // fp16 & bf16 generate the greedy story of fp32
+        // '()' -> '(record { dim = 64 : int; ...; weight_format = "fp16"; group_size = 0 : int; })'
+        {"stories260K/stories260K_fp16.bin",
+         "4449444c016c09c8fab0027cb087c0d9017cd58488bc027cb3fdc984037cf3e0d4d6057cf5cfd3fc057cde9c93f9097181ca8b980e7c82c3e4f60f7c0100c000048004ac0105800404667031360008",
+         story_1},
+        // '()' -> '(record { dim = 64 : int; ...; weight_format = "bf16"; group_size = 0 : int; })'
+        {"stories260K/stories260K_bf16.bin",
+         "4449444c016c09c8fab0027cb087c0d9017cd58488bc027cb3fdc984037cf3e0d4d6057cf5cfd3fc057cde9c93f9097181ca8b980e7c82c3e4f60f7c0100c000048004ac0105800404626631360008",
+         story_1},
+        // Q8_0, with the group_size of 4 that divides dim & hidden_dim
+        // '()' -> '(record { dim = 64 : int; ...; weight_format = "q8_0"; group_size = 4 : int; })'
+        {"stories260K/stories260K_q80.bin",
+         "4449444c016c09c8fab0027cb087c0d9017cd58488bc027cb3fdc984037cf3e0d4d6057cf5cfd3fc057cde9c93f9097181ca8b980e7c82c3e4f60f7c0100c000048004ac010580040471385f300408",
+         story_1},
+        // Q4_1, with the same group_size
+        // '()' -> '(record { dim = 64 : int; ...; weight_format = "q4_1"; group_size = 4 : int; })'
+        {"stories260K/stories260K_q41.bin",
+         "4449444c016c09c8fab0027cb087c0d9017cd58488bc027cb3fdc984037cf3e0d4d6057cf5cfd3fc057cde9c93f9097181ca8b980e7c82c3e4f60f7c0100c000048004ac010580040471345f310408",
+         "Once upon a time, there was a little girl named Lily. She loved to "
+         "play outside in the park. One day, she saw a big, red ball. She "
+         "wanted to play with it, but it was too high.\nLily's mommy told her "
+         "that she was going to be careful and not touch it. Lily was sad "
+         "beca"},
+    };
+    for (const WeightFormatTest &t : weight_format_tests) {
+      upload_model(read_file(t.path));
+      // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+      mockIC.run_test("initialize", initialize, "4449444c0000",
+                      "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                      silent_on_trap, my_principal);
+      mockIC.run_test("get_model_config", get_model_config, "4449444c0000",
+                      t.model_config, silent_on_trap, my_principal);
+      if (greedy_story("inference " + t.path, 2) != t.story) {
+        std::cout << t.path << " did not generate the expected story\n";
+        exit(1);
+      }
+    }
+
+    // A Q4_1 group_size must divide dim & hidden_dim, and be even: 3 is
+    // neither, 8 does not divide hidden_dim. It follows the magic number, the
+    // version, the config & the shared_classifier flag in the header.
+    std::vector<std::pair<int, std::string>> bad_group_sizes = {
+        // '()' -> '(variant { Err = variant { Other = "ERROR: read_checkpoint group_size 3 must divide dim (64) and hidden_dim (172) and must be even" } })'
+        {3,
+         "4449444c026b01b0ad8fcd0c716b01c5fed20100010100005e4552524f523a20726561645f636865636b706f696e742067726f75705f73697a652033206d757374206469766964652064696d202836342920616e642068696464656e5f64696d20283137322920616e64206d757374206265206576656e"},
+        // '()' -> '(variant { Err = variant { Other = "ERROR: read_checkpoint group_size 8 must divide dim (64) and hidden_dim (172) and must be even" } })'
+        {8,
+         "4449444c026b01b0ad8fcd0c716b01c5fed20100010100005e4552524f523a20726561645f636865636b706f696e742067726f75705f73697a652038206d757374206469766964652064696d202836342920616e642068696464656e5f64696d20283137322920616e64206d757374206265206576656e"},
+    };
+    for (const auto &[group_size, err] : bad_group_sizes) {
+      std::vector<uint8_t> bytes = read_file("stories260K/stories260K_q41.bin");
+      std::memcpy(bytes.data() + 4 + 4 + 7 * 4 + 1, &group_size, sizeof(int));
+      upload_model(bytes);
+      mockIC.run_test("initialize group_size " + std::to_string(group_size),
+                      initialize, "4449444c0000", err, silent_on_trap,
+                      my_principal);
+    }
+
+    // The fp32 model again, for the tests below
+    upload_model(model_bytes);
+    // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+    mockIC.run_test("initialize", initialize, "4449444c0000",
+                    "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                    silent_on_trap, my_principal);
+  }
+
+  // -----------------------------------------------------------------------------------------
+  // The kv cache stored as fp16 & int8. The type can only be set before the
+  // first chat or story, so the chats of the tests above are dropped first, as
+  // in a new canister. Each type generates a greedy story in one call, and in
+  // two calls, where the second call reads back the rows saved in that type.
+  if (model_to_use == 1) {
+    for (std::string kv_type : {"fp16", "int8"}) {
+      p_chats->umap.clear();
+
+      // '("fp16": text)' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+      candid_in = CandidSerialize(CandidTypeText(kv_type)).as_hex_string();
+      mockIC.run_test("set_kv_cache_type to " + kv_type, set_kv_cache_type,
+                      candid_in,
+                      "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                      silent_on_trap, my_principal);
+      // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
+      mockIC.run_test("initialize", initialize, "4449444c0000",
+                      "4449444c026c019aa1b2f90c7a6b01bc8a0100010100c800",
+                      silent_on_trap, my_principal);
+      if (kv_type != kv_cache_type_name(p_runstate->kv_type)) {
+        std::cout << "initialize did not allocate the kv cache as " << kv_type
+                  << "\n";
+        exit(1);
+      }
+
+      std::string story = greedy_story("inference kv " + kv_type, 1);
+      // For the 260K model, fp16 generates the same greedy story as fp32
+      if (kv_type == "fp16" && story != story_1) {
+        std::cout << "the fp16 kv cache did not generate the story of "
+                  << "inference 1\n";
+        exit(1);
+      }
+      if (greedy_story("inference kv " + kv_type + " continued", 2) != story) {
+        std::cout << "the continuation did not read back the kv cache saved "
+                  << "as " << kv_type << "\n";
+        exit(1);
+      }
+    }
+  }
+
   // -----------------------------------------------------------------------------------------
   // Reset the model
   // '()' -> '(variant { Ok = record { status_code = 200 : nat16} })'
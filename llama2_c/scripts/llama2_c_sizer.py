@@ -12,6 +12,10 @@ ROOT_PATH = Path(__file__).parent.parent
 SIZE_OF_FLOAT = 4  # bytes
 SIZE_OF_POINTER = 4  # bytes
 SIZE_OF_BYTE_PIECES = 512  # bytes (static size)
+SIZE_OF_HALF = 2  # bytes
+
+# Storage types of the kv cache, see set_kv_cache_type
+KV_CACHE_TYPES = ["fp32", "fp16", "int8"]
 
 
 def read_config_from_file(file_path: Path) -> dict[str, int]:
@@ -70,10 +74,17 @@ def calculate_memory(config: dict[str, int]) -> dict[str, dict[str, float]]:
     q = x  # Same as x
     k = kv_dim * SIZE_OF_FLOAT
     v = k  # Same as k
-    att = config["n_heads"] * config["seq_len"] * SIZE_OF_FLOAT
     logits = config["vocab_size"] * SIZE_OF_FLOAT
     key_cache = n_layers * config["seq_len"] * kv_dim * SIZE_OF_FLOAT
     value_cache = key_cache  # Same as key_cache
+    # fp16 & int8 kv cache: int8 adds one float scale per head_size values
+    kv_cache_memory = {
+        "fp32": key_cache + value_cache,
+        "fp16": (key_cache + value_cache) * SIZE_OF_HALF / SIZE_OF_FLOAT,
+        "int8": (key_cache + value_cache)
+        * (1 + SIZE_OF_FLOAT / head_size)
+        / SIZE_OF_FLOAT,
+    }
 
     # Calculate total memory usage for Tokenizer, TransformerWeights and RunState
     total_tokenizer = vocab_memory + vocab_scores_memory + SIZE_OF_BYTE_PIECES
@@ -95,7 +106,7 @@ def calculate_memory(config: dict[str, int]) -> dict[str, dict[str, float]]:
         ]
     )
     total_run_state = sum(
-        [x, xb, xb2, hb, hb2, q, k, v, att, logits, key_cache, value_cache]
+        [x, xb, xb2, hb, hb2, q, k, v, logits, key_cache, value_cache]
     )
 
     # Collate the results in a dictionary
@@ -127,7 +138,6 @@ def calculate_memory(config: dict[str, int]) -> dict[str, dict[str, float]]:
             "q": q / (1024 * 1024),
             "k": k / (1024 * 1024),
             "v": v / (1024 * 1024),
-            "att": att / (1024 * 1024),
             "logits": logits / (1024 * 1024),
             "key_cache": key_cache / (1024 * 1024),
             "value_cache": value_cache / (1024 * 1024),
@@ -137,6 +147,14 @@ def calculate_memory(config: dict[str, int]) -> dict[str, dict[str, float]]:
             "Total TransformerWeights Memory (per model)": total_transformer_weights
             / (1024 * 1024),
             "Total RunState Memory (per user)": total_run_state / (1024 * 1024),
+            **{
+                f"Total RunState Memory (per user, {kv_type} kv cache)": (
+                    total_run_state - key_cache - value_cache + kv_memory
+                )
+                / (1024 * 1024)
+                for kv_type, kv_memory in kv_cache_memory.items()
+                if kv_type != "fp32"
+            },
             "Overall Total Memory": (total_transformer_weights + total_run_state)
             / (1024 * 1024),
         },
@@ -191,23 +209,28 @@ def write_data(file: TextIO, title: str, data: dict[str, dict[str, float]]) -> N
     else:
         # Calculate max users for each model
         # Calculate number of users for each model and add it to the data
-        number_of_users = {}
-        for model, values in data.items():
-            total_available_memory = 4 * 1024  # Available canister memory in MB
-            total_tokenizer_memory = values["Total Tokenizer Memory (per model)"]
-            total_transformer_weights_memory = values[
-                "Total TransformerWeights Memory (per model)"
-            ]
-            total_runstate_memory = values["Total RunState Memory (per user)"]
-
-            number_of_users[model] = int(
-                (
-                    total_available_memory
-                    - total_tokenizer_memory
-                    - total_transformer_weights_memory
+        number_of_users: dict[str, dict[str, int]] = {}
+        for kv_type in KV_CACHE_TYPES:
+            runstate_key = "Total RunState Memory (per user)"
+            if kv_type != "fp32":
+                runstate_key = f"Total RunState Memory (per user, {kv_type} kv cache)"
+            number_of_users[kv_type] = {}
+            for model, values in data.items():
+                total_available_memory = 4 * 1024  # Available canister memory in MB
+                total_tokenizer_memory = values["Total Tokenizer Memory (per model)"]
+                total_transformer_weights_memory = values[
+                    "Total TransformerWeights Memory (per model)"
+                ]
+                total_runstate_memory = values[runstate_key]
+
+                number_of_users[kv_type][model] = int(
+                    (
+                        total_available_memory
+                        - total_tokenizer_memory
+                        - total_transformer_weights_memory
+                    )
+                    / total_runstate_memory
                 )
-                / total_runstate_memory
-            )
 
         # Write the markdown table for number of users
         file.write("\n\n")
@@ -221,10 +244,14 @@ def write_data(file: TextIO, title: str, data: dict[str, dict[str, float]]) -> N
         file.write(" | ".join(headers) + "\n")
         file.write(" | ".join(["---"] * len(headers)) + "\n")
 
-        row_data = ["Max number of concurrent users"] + [
-            f"{number_of_users[model]}" for model in data.keys()
-        ]
-        file.write(" | ".join(row_data) + "\n")
+        for kv_type in KV_CACHE_TYPES:
+            label = "Max number of concurrent users"
+            if kv_type != "fp32":
+                label += f" ({kv_type} kv cache)"
+            row_data = [label] + [
+                f"{number_of_users[kv_type][model]}" for model in data.keys()
+            ]
+            file.write(" | ".join(row_data) + "\n")
 
     file.write("\n\n")
 
@@ -0,0 +1,38 @@
+"""Import command line arguments for the scripts."""
+
+import argparse
+
+
+def parse_args() -> argparse.Namespace:
+    """Returns the command line arguments"""
+    parser = argparse.ArgumentParser(
+        description="Quantize a legacy llama2.c model into the Q8_0, Q4_1, fp16 or bf16 format"
+    )
+    parser.add_argument(
+        "--model",
+        type=str,
+        default="models/stories15Mtok4096.bin",
+        help="Legacy fp32 model file (e.g. models/stories15Mtok4096.bin)",
+    )
+    parser.add_argument(
+        "--output",
+        type=str,
+        default="models/stories15Mtok4096_q80.bin",
+        help="Quantized model file (e.g. models/stories15Mtok4096_q80.bin)",
+    )
+    parser.add_argument(
+        "--format",
+        type=str,
+        default="q8_0",
+        choices=["q8_0", "q4_1", "fp16", "bf16"],
+        help="q8_0: int8 weights. q4_1: 4-bit weights, for the largest models. "
+        "fp16 & bf16: 16-bit weights, close to fp32 in accuracy",
+    )
+    parser.add_argument(
+        "--group-size",
+        type=int,
+        default=64,
+        help="Number of weights sharing one scale. Halved until it divides dim & hidden_dim",
+    )
+    args = parser.parse_args()
+    return args
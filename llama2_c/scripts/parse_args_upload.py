@@ -42,6 +42,13 @@ def parse_args() -> argparse.Namespace:
         default="tokenizers/tok4096.bin",
         help="Tokenizer file (e.g. tokenizers/tok4096.bin)",
     )
+    parser.add_argument(
+        "--draft-model",
+        type=str,
+        default="",
+        help="Optional draft model for speculative decoding, with the tokenizer"
+        " of the model (e.g. models/stories15M.bin for models/stories110M.bin)",
+    )
     parser.add_argument(
         "--chunksize",
         type=float,
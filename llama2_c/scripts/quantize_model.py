@@ -0,0 +1,206 @@
+"""Quantizes a legacy llama2.c model into the Q8_0, Q4_1, fp16 or bf16 format.
+
+The output starts with the 256 byte header of karpathy's export.py, with the
+magic number "ak42", followed by the rmsnorm weights in fp32.
+
+- q8_0 (version 2, as export.py): all other weights as int8, with one fp32
+  scale per group of weights
+- q4_1 (version 3): all other weights as 4-bit values, two per byte with the
+  low nibble first, with one fp32 scale & one fp32 min per group of weights
+- fp16 (version 4): all other weights as IEEE half precision values
+- bf16 (version 5): all other weights as bfloat16 values, the upper half of
+  the fp32 value, rounded to nearest even
+
+Run with:
+
+    python -m scripts.quantize_model --model models/stories15Mtok4096.bin --output models/stories15Mtok4096_q80.bin
+    python -m scripts.quantize_model --format q4_1 --model models/stories110M.bin --output models/stories110M_q41.bin
+    python -m scripts.quantize_model --format bf16 --model models/stories110M.bin --output models/stories110M_bf16.bin
+"""
+
+# pylint: disable=invalid-name, too-many-locals
+
+import struct
+import sys
+from array import array
+from pathlib import Path
+from typing import List, Tuple
+from .parse_args_quantize_model import parse_args
+
+ROOT_PATH = Path(__file__).parent.parent
+
+MAGIC = 0x616B3432
+VERSIONS = {"q8_0": 2, "q4_1": 3, "fp16": 4, "bf16": 5}
+HEADER_SIZE = 256
+Q_MAX = 127.0
+Q4_MAX = 15.0
+
+
+# ------------------------------------------------------------------------------
+def to_float32(value: float) -> float:
+    """Rounds a python float to float32, like the canister does"""
+    return float(struct.unpack("<f", struct.pack("<f", value))[0])
+
+
+def quantize_q80(w: array, group_size: int) -> Tuple[bytes, bytes, float]:
+    """Returns the int8 values, the fp32 scales & the max quantization error"""
+    q = array("b", bytes(len(w)))
+    s = array("f", bytes(4 * (len(w) // group_size)))
+    max_err = 0.0
+    for g in range(len(w) // group_size):
+        group = w[g * group_size : (g + 1) * group_size]
+        scale = to_float32(max(abs(x) for x in group) / Q_MAX)
+        s[g] = scale
+        for i, x in enumerate(group):
+            value = round(x / scale) if scale != 0.0 else 0
+            q[g * group_size + i] = value
+            max_err = max(max_err, abs(x - value * scale))
+    return q.tobytes(), s.tobytes(), max_err
+
+
+def quantize_q41(w: array, group_size: int) -> Tuple[bytes, bytes, float]:
+    """Returns the packed 4-bit values, the fp32 scales & mins, and the max
+    quantization error"""
+    q = bytearray(len(w) // 2)
+    s = array("f", bytes(4 * (len(w) // group_size)))
+    m = array("f", bytes(4 * (len(w) // group_size)))
+    max_err = 0.0
+    for g in range(len(w) // group_size):
+        group = w[g * group_size : (g + 1) * group_size]
+        wmin = min(group)
+        scale = to_float32((max(group) - wmin) / Q4_MAX)
+        s[g] = scale
+        m[g] = wmin
+        for i, x in enumerate(group):
+            value = min(int(round((x - wmin) / scale)), 15) if scale != 0.0 else 0
+            # two values per byte, low nibble first
+            q[(g * group_size + i) // 2] |= value << (4 * (i % 2))
+            max_err = max(max_err, abs(x - (value * scale + m[g])))
+    return bytes(q), s.tobytes() + m.tobytes(), max_err
+
+
+def to_fp16(w: array) -> Tuple[bytes, float]:
+    """Returns the fp16 values & the max rounding error.
+    Raises OverflowError for weights that do not fit in fp16."""
+    h = struct.pack(f"<{len(w)}e", *w)
+    widened = struct.unpack(f"<{len(w)}e", h)
+    return h, max(abs(x - y) for x, y in zip(w, widened))
+
+
+def to_bf16(w: array) -> Tuple[bytes, float]:
+    """Returns the bf16 values & the max rounding error"""
+    bits = array("I", w.tobytes())
+    # round to nearest even on the lower 16 bits
+    h = array("H", [(b + 0x7FFF + ((b >> 16) & 1)) >> 16 for b in bits])
+    widened = array("f", array("I", [x << 16 for x in h]).tobytes())
+    return h.tobytes(), max(abs(x - y) for x, y in zip(w, widened))
+
+
+def main() -> int:
+    """Reads the legacy model, writes the quantized model."""
+
+    args = parse_args()
+
+    model_path = ROOT_PATH / args.model
+    output_path = ROOT_PATH / args.output
+
+    try:
+        with open(model_path, "rb") as file:
+            data = file.read()
+    except FileNotFoundError:
+        print(f"ERROR: Unable to open the file {model_path}!")
+        sys.exit(1)
+
+    if struct.unpack("<I", data[:4])[0] == MAGIC:
+        print(f"ERROR: {model_path} is not a legacy llama2.c model.")
+        sys.exit(1)
+
+    config = list(struct.unpack("<7i", data[:28]))
+    dim, hidden_dim, n_layers, n_heads, n_kv_heads, vocab_size, seq_len = config
+    # negative vocab size is the legacy way of signaling unshared weights
+    shared_classifier = vocab_size > 0
+    vocab_size = abs(vocab_size)
+    config[5] = vocab_size
+    head_size = dim // n_heads
+    kv_dim = n_kv_heads * head_size
+
+    # The canister requires that the group size divides dim & hidden_dim
+    # and Q4_1 packs the values of a group in pairs
+    group_size = args.group_size
+    if args.format in ("fp16", "bf16"):
+        group_size = 0  # not used
+    while group_size > 0 and (dim % group_size != 0 or hidden_dim % group_size != 0):
+        group_size //= 2
+    if args.format == "q4_1" and group_size % 2 != 0:
+        print(f"ERROR: q4_1 needs an even group_size, but it is {group_size}")
+        sys.exit(1)
+    print(f"Using format = {args.format}, group_size = {group_size}")
+
+    offset = 28
+
+    def read(n: int) -> array:
+        nonlocal offset
+        w = array("f")
+        w.frombytes(data[offset : offset + 4 * n])
+        offset += 4 * n
+        return w
+
+    def read_layers(n_each: int) -> List[array]:
+        return [read(n_each) for _ in range(n_layers)]
+
+    # the order of the legacy format, see memory_map_weights in run.c
+    tok_embeddings = read(vocab_size * dim)
+    rms_att = read(n_layers * dim)
+    wq = read_layers(dim * dim)
+    wk = read_layers(dim * kv_dim)
+    wv = read_layers(dim * kv_dim)
+    wo = read_layers(dim * dim)
+    rms_ffn = read(n_layers * dim)
+    w1 = read_layers(dim * hidden_dim)
+    w2 = read_layers(hidden_dim * dim)
+    w3 = read_layers(dim * hidden_dim)
+    rms_final = read(dim)
+    offset += 4 * seq_len * head_size  # skip freq_cis_real & freq_cis_imag
+    wcls = [] if shared_classifier else [read(vocab_size * dim)]
+    if offset > len(data):
+        print(f"ERROR: {model_path} is too small for its config {config}")
+        sys.exit(1)
+
+    header = struct.pack("<Ii", MAGIC, VERSIONS[args.format])
+    header += struct.pack("<7i", *config)
+    header += struct.pack("<B", int(shared_classifier))
+    header += struct.pack("<i", group_size)
+    header += b"\0" * (HEADER_SIZE - len(header))
+
+    # the order of the quantized formats, see memory_map_weights_quantized and
+    # memory_map_weights_half in run.c
+    out = [header, rms_att.tobytes(), rms_ffn.tobytes(), rms_final.tobytes()]
+    max_err = 0.0
+    for w in [tok_embeddings] + wq + wk + wv + wo + w1 + w2 + w3 + wcls:
+        if args.format in ("fp16", "bf16"):
+            try:
+                h, err = to_fp16(w) if args.format == "fp16" else to_bf16(w)
+            except OverflowError:
+                print("ERROR: the weights do not fit in fp16, use bf16 instead.")
+                sys.exit(1)
+            out += [h]
+            max_err = max(max_err, err)
+            continue
+        if args.format == "q4_1":
+            q, s, err = quantize_q41(w, group_size)
+        else:
+            q, s, err = quantize_q80(w, group_size)
+        out += [q, s]
+        max_err = max(max_err, err)
+
+    with open(output_path, "wb") as file:
+        for b in out:
+            file.write(b)
+
+    print(f"Max quantization error: {max_err}")
+    print(f"Wrote {output_path}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
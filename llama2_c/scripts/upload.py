@@ -53,6 +53,7 @@ def main() -> int:
     candid_path = ROOT_PATH / args.candid
     model_path = ROOT_PATH / args.model
     tokenizer_path = ROOT_PATH / args.tokenizer
+    draft_model_path = ROOT_PATH / args.draft_model if args.draft_model else None
     chunk_size_mb = args.chunksize
 
     dfx_json_path = ROOT_PATH / "dfx.json"
@@ -66,6 +67,7 @@ def main() -> int:
         f"\n - candid_path     = {candid_path}"
         f"\n - model_path      = {model_path}"
         f"\n - tokenizer_path  = {tokenizer_path}"
+        f"\n - draft_model_path= {draft_model_path}"
     )
 
     # ---------------------------------------------------------------------------
@@ -188,6 +190,42 @@ def main() -> int:
             print(response)
             sys.exit(1)
 
+    # ---------------------------------------------------------------------------
+    # Reset the draft model, and upload it when given
+    print("--\nResetting the draft model in canister")
+    response = canister_llama2.reset_draft_model()  # pylint: disable=no-member
+    if "Ok" in response[0].keys():
+        if DEBUG_VERBOSE >= 2:
+            print("OK!")
+    else:
+        print("Something went wrong:")
+        print(response)
+        sys.exit(1)
+
+    if draft_model_path:
+        print(f"--\nReading the draft model file into a bytes object: {draft_model_path}")
+        draft_model_bytes = read_file_bytes(draft_model_path)
+
+        print(f"--\nUploading the draft model bytes, in {chunk_size_mb}Mb chunks")
+        count_bytes = 0
+        for chunk in generate_chunks(draft_model_bytes, chunk_size):
+            count_bytes += len(chunk)
+            if DEBUG_VERBOSE >= 1:
+                print(
+                    f"chunk size = {len(chunk)} bytes "
+                    f"({count_bytes / len(draft_model_bytes) * 100:.1f}%)"
+                )
+            response = canister_llama2.upload_draft_model_bytes_chunk(
+                chunk
+            )  # pylint: disable=no-member
+            if "Ok" in response[0].keys():
+                if DEBUG_VERBOSE >= 2:
+                    print("OK!")
+            else:
+                print("Something went wrong:")
+                print(response)
+                sys.exit(1)
+
     # ---------------------------------------------------------------------------
     # Initialize the canister
     print("--\nInitializing the canister, getting it ready for inference.")
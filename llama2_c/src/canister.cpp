@@ -9,10 +9,12 @@
 #include "http.h"
 #include "ic_api.h"
 #include "nft_collection.h"
+#include "prefix_cache.h"
 
 std::string *p_canister_owner_principal{nullptr};
 std::string *p_canister_mode{nullptr};
 bool ready_for_inference{false};
+bool draft_model_ready{false}; // a draft model for speculative decoding
 
 void set_canister_owner(IC_API &ic_api) {
   CandidTypePrincipal caller = ic_api.get_caller();
@@ -99,6 +101,77 @@ void set_canister_mode() {
   ic_api.to_wire(CandidTypeVariant{"Ok", status_code_record});
 }
 
+// The storage of the kv cache: "fp32", "fp16" or "int8"
+// fp16 halves & int8 quarters the kv cache of every user, in memory and in the
+// runstate files. The runstate files of existing chats can not be converted, so
+// it can only be set before the first chat or story. Call initialize next, to
+// allocate the run states in the new storage.
+void set_kv_cache_type() {
+  IC_API ic_api(CanisterUpdate{std::string(__func__)}, false);
+  if (!is_canister_owner(ic_api)) return;
+
+  std::string kv_type;
+  ic_api.from_wire(CandidTypeText(&kv_type));
+
+  KVCacheType new_kv_cache_type;
+  if (kv_type == "fp32") {
+    new_kv_cache_type = KV_CACHE_FP32;
+  } else if (kv_type == "fp16") {
+    new_kv_cache_type = KV_CACHE_FP16;
+  } else if (kv_type == "int8") {
+    new_kv_cache_type = KV_CACHE_INT8;
+  } else {
+    std::string error_msg = "ERROR: unknown kv cache type = " + kv_type;
+    ic_api.to_wire(CandidTypeVariant{
+        "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+    return;
+  }
+
+  if (new_kv_cache_type != kv_cache_type) {
+    if (p_chats && !p_chats->umap.empty()) {
+      std::string error_msg = "ERROR: the kv cache type can only be changed "
+                              "before the first chat or story";
+      ic_api.to_wire(CandidTypeVariant{
+          "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+      return;
+    }
+    kv_cache_type = new_kv_cache_type;
+    ready_for_inference = false;
+  }
+
+  IC_API::debug_print(std::string(__func__) +
+                      ": kv_cache_type = " + kv_cache_type_name(kv_cache_type));
+
+  CandidTypeRecord status_code_record;
+  status_code_record.append("status_code",
+                            CandidTypeNat16{Http::StatusCode::OK});
+  ic_api.to_wire(CandidTypeVariant{"Ok", status_code_record});
+}
+
+// The flops of recomputing a kv cache from its tokens that cost as much as a
+// byte of I/O to the runstate store, see save_kv_cache in chats.cpp. The
+// runstates that leave memory are only kept as tokens when recomputing them
+// costs less. 0, the default, always stores them. It can be changed at any
+// time: the kv cache of a chat is read back when it was stored, and else
+// recomputed.
+void set_recompute_flops_per_io_byte() {
+  IC_API ic_api(CanisterUpdate{std::string(__func__)}, false);
+  if (!is_canister_owner(ic_api)) return;
+
+  uint64_t flops{0};
+  ic_api.from_wire(CandidTypeNat64(&flops));
+  recompute_flops_per_io_byte = flops;
+
+  IC_API::debug_print(std::string(__func__) +
+                      ": recompute_flops_per_io_byte = " +
+                      std::to_string(recompute_flops_per_io_byte));
+
+  CandidTypeRecord status_code_record;
+  status_code_record.append("status_code",
+                            CandidTypeNat16{Http::StatusCode::OK});
+  ic_api.to_wire(CandidTypeVariant{"Ok", status_code_record});
+}
+
 void print_canister_metadata() {
   std::string msg = std::string(__func__) + ":";
   msg += "\n*p_canister_owner_principal     = " + *p_canister_owner_principal;
@@ -122,6 +195,9 @@ void canister_init() {
 
   // Create a p_metadata_users instance
   new_p_metadata_users();
+
+  // Create a p_prefix_cache instance
+  new_p_prefix_cache();
 }
 
 // --------------------------------------------------------------------------------------------------
@@ -7,6 +7,7 @@
 extern std::string *p_canister_owner_principal;
 extern std::string *p_canister_mode;
 extern bool ready_for_inference;
+extern bool draft_model_ready;
 
 bool is_canister_owner(IC_API &ic_api, bool err_to_wire = true);
 bool is_canister_mode_valid(std::string canister_mode);
@@ -17,5 +18,9 @@ bool is_canister_mode_nft_ordinal();
 void canister_init() WASM_SYMBOL_EXPORTED("canister_init");
 void set_canister_mode()
     WASM_SYMBOL_EXPORTED("canister_update set_canister_mode");
+void set_kv_cache_type()
+    WASM_SYMBOL_EXPORTED("canister_update set_kv_cache_type");
+void set_recompute_flops_per_io_byte()
+    WASM_SYMBOL_EXPORTED("canister_update set_recompute_flops_per_io_byte");
 void health() WASM_SYMBOL_EXPORTED("canister_query health");
 void ready() WASM_SYMBOL_EXPORTED("canister_query ready");
\ No newline at end of file
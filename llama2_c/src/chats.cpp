@@ -10,11 +10,15 @@
 #include "canister.h"
 #include "http.h"
 #include "ic_api.h"
+#include "runstate_store.h"
 
 // Orthogonally Persisted data
 Chats *p_chats{nullptr};
 RunState *p_runstate{nullptr}; // Just one run state that we read back each time
+RunState *p_draft_runstate{nullptr}; // Same, for the draft model
+RunStatePool *p_runstate_pool{nullptr}; // The RunStates kept in memory
 ChatsOutputHistory *p_chats_output_history{nullptr};
+ChatsTokenHistory *p_chats_token_history{nullptr};
 MetadataUsers *p_metadata_users{nullptr};
 
 // Create a p_chats & p_chats_output_history instance if not yet done
@@ -39,6 +43,29 @@ void new_p_chats() {
     init_run_state(p_runstate);
   }
 
+  if (p_draft_runstate == nullptr) {
+    IC_API::debug_print(std::string(__func__) +
+                        ": Creating p_draft_runstate instance.");
+    p_draft_runstate = new (std::nothrow) RunState();
+    if (p_draft_runstate == nullptr) {
+      // called from canister_init, so trap is correct!
+      IC_API::trap("Allocation of p_draft_runstate failed");
+    }
+    init_run_state(p_draft_runstate);
+  }
+
+  if (p_runstate_pool == nullptr) {
+    IC_API::debug_print(std::string(__func__) +
+                        ": Creating p_runstate_pool instance.");
+    p_runstate_pool = new (std::nothrow) RunStatePool();
+    if (p_runstate_pool == nullptr) {
+      // called from canister_init, so trap is correct!
+      IC_API::trap("Allocation of p_runstate_pool failed");
+    }
+  }
+
+  new_p_runstate_store();
+
   if (p_chats_output_history == nullptr) {
     IC_API::debug_print(std::string(__func__) +
                         ": Creating p_chats_output_history instance.");
@@ -48,6 +75,16 @@ void new_p_chats() {
       IC_API::trap("Allocation of p_chats_output_history failed");
     }
   }
+
+  if (p_chats_token_history == nullptr) {
+    IC_API::debug_print(std::string(__func__) +
+                        ": Creating p_chats_token_history instance.");
+    p_chats_token_history = new (std::nothrow) ChatsTokenHistory();
+    if (p_chats_token_history == nullptr) {
+      // called from canister_init, so trap is correct!
+      IC_API::trap("Allocation of p_chats_token_history failed");
+    }
+  }
 }
 
 // Delete the p_chats & p_chats_output_history instance
@@ -68,10 +105,32 @@ void delete_p_chats() {
     p_runstate = nullptr;
   }
 
+  if (p_draft_runstate) {
+    free_run_state(p_draft_runstate);
+    delete p_draft_runstate;
+    p_draft_runstate = nullptr;
+  }
+
+  if (p_runstate_pool) {
+    for (ResidentRunState &slot : p_runstate_pool->slots) {
+      free_run_state(&slot.state);
+      free_run_state(&slot.draft_state);
+    }
+    delete p_runstate_pool;
+    p_runstate_pool = nullptr;
+  }
+
+  delete_p_runstate_store();
+
   if (p_chats_output_history) {
     delete p_chats_output_history;
     p_chats_output_history = nullptr;
   }
+
+  if (p_chats_token_history) {
+    delete p_chats_token_history;
+    p_chats_token_history = nullptr;
+  }
 }
 
 // Create a p_metadata_users instance if not yet done
@@ -104,10 +163,20 @@ void init_run_state(RunState *s) {
   s->q = nullptr;
   s->k = nullptr;
   s->v = nullptr;
-  s->att = nullptr;
   s->logits = nullptr;
   s->key_cache = nullptr;
   s->value_cache = nullptr;
+  s->kv_type = kv_cache_type;
+  s->key_cache_f16 = nullptr;
+  s->value_cache_f16 = nullptr;
+  s->key_cache_q = nullptr;
+  s->value_cache_q = nullptr;
+  s->key_cache_s = nullptr;
+  s->value_cache_s = nullptr;
+  s->xq.q = nullptr;
+  s->xq.s = nullptr;
+  s->hq.q = nullptr;
+  s->hq.s = nullptr;
 }
 
 // key = principal or ordinal-id
@@ -149,10 +218,18 @@ bool build_new_chat(std::string key, IC_API &ic_api) {
   // Reset the output data
   std::string *output_history = &p_chats_output_history->umap[key];
   output_history->clear();
+  if (p_chats_token_history) p_chats_token_history->umap[key].clear();
+
+  // Remove the runstates of the previous chat: write_run_state appends to the
+  // kv cache rows in the store
+  delete_run_state_file(key);
+  delete_run_state_file(draft_run_state_key(key));
 
   //initialize the next token predicted on pos 0 to the BOS token (1)
   chat->next = 1;
   chat->pos = 0;
+  chat->draft_pos = 0; // the draft model starts in sync
+  chat->evicted = 0;   // nothing evicted by attention sinks yet
 
   //icpp: initialize to add begin-of-sentence
   chat->bos = 1; // We no longer use this...
@@ -161,6 +238,8 @@ bool build_new_chat(std::string key, IC_API &ic_api) {
   //icpp: initialize total_steps
   chat->total_steps = 0; // total story length, across multiple inference calls
   chat->inference_steps = 0; // per inference
+  chat->lookup_accepted = 0; // per inference
+  chat->lookup_rejected = 0; // per inference
 
   // --------------------------------------------------------------------------
   // The New Chat metadata
@@ -172,7 +251,121 @@ bool build_new_chat(std::string key, IC_API &ic_api) {
   return true;
 }
 
-// read runstate from file
+// The number of RunStates that fit in RUNSTATE_POOL_BUDGET
+static size_t runstate_pool_capacity() {
+  size_t bytes = run_state_bytes(&transformer.config, kv_cache_type);
+  if (draft_model_ready) {
+    bytes += run_state_bytes(&draft_transformer.config, kv_cache_type);
+  }
+  return static_cast<size_t>(RUNSTATE_POOL_BUDGET / bytes);
+}
+
+static ResidentRunState *find_resident_runstate(const std::string &key) {
+  if (!p_runstate_pool || key.empty()) return nullptr;
+  for (ResidentRunState &slot : p_runstate_pool->slots) {
+    if (slot.key == key) return &slot;
+  }
+  return nullptr;
+}
+
+// Writes the RunState in a slot of the pool to the RunStateStore, and frees
+// the slot. Its buffers stay allocated, as spare buffers. See save_kv_cache
+// for recompute.
+static bool spill_resident_runstate(ResidentRunState &slot, bool recompute) {
+  if (!save_kv_cache(slot.key, slot.state, false, recompute) ||
+      (slot.has_draft &&
+       !save_kv_cache(slot.key, slot.draft_state, true, recompute))) {
+    return false;
+  }
+  slot.key.clear();
+  slot.has_draft = false;
+  return true;
+}
+
+// A free slot of the pool, with spare buffers: a free slot, a new slot if the
+// budget allows, or else the least recently used slot, after writing its
+// RunState to the store. *slot_out is nullptr if the pool can not hold
+// another RunState. Returns false if writing to the store failed.
+static bool free_resident_runstate(bool with_draft,
+                                   ResidentRunState **slot_out) {
+  *slot_out = nullptr;
+  if (!p_runstate_pool) return true;
+  std::vector<ResidentRunState> &slots = p_runstate_pool->slots;
+  ResidentRunState *slot = nullptr;
+  for (ResidentRunState &s : slots) {
+    if (s.key.empty()) {
+      slot = &s;
+      break;
+    }
+  }
+  if (!slot && slots.size() < runstate_pool_capacity()) {
+    slots.emplace_back();
+    slot = &slots.back();
+    init_run_state(&slot->state);
+    init_run_state(&slot->draft_state);
+  }
+  if (!slot) {
+    for (ResidentRunState &s : slots) {
+      if (!slot || s.last_used < slot->last_used) slot = &s;
+    }
+    if (!slot) return true; // a budget of 0
+    std::cout << "Writing the RunState of " << slot->key
+              << " to the store, to make room in the pool" << std::endl;
+    if (!spill_resident_runstate(*slot, true)) return false;
+  }
+  if (!slot->state.x &&
+      !malloc_run_state(&slot->state, &transformer.config)) {
+    free_run_state(&slot->state);
+    return true;
+  }
+  if (with_draft && !slot->draft_state.x &&
+      !malloc_run_state(&slot->draft_state, &draft_transformer.config)) {
+    free_run_state(&slot->draft_state);
+    return true;
+  }
+  *slot_out = slot;
+  return true;
+}
+
+// Keeps the RunState of key, in p_runstate & p_draft_runstate, in the pool by
+// swapping buffers with a free slot. If the pool can not hold it, it is
+// written to the RunStateStore, see save_kv_cache for recompute.
+static bool store_runstate(const std::string &key, std::string *error_msg,
+                           bool recompute) {
+  if (p_runstate_pool) p_runstate_pool->key_in_use.clear();
+  auto it = p_chats->umap.find(key);
+  if (it == p_chats->umap.end()) return true; // deleted
+  const Chat &chat = it->second;
+  bool with_draft = draft_model_ready && chat.draft_pos == chat.pos;
+
+  ResidentRunState *slot;
+  if (!free_resident_runstate(with_draft, &slot)) {
+    *error_msg = "write_run_state failed for the least recently used RunState";
+    return false;
+  }
+  if (slot) {
+    std::swap(*p_runstate, slot->state);
+    if (with_draft) std::swap(*p_draft_runstate, slot->draft_state);
+    slot->key = key;
+    slot->has_draft = with_draft;
+    slot->last_used = ++p_runstate_pool->clock;
+    return true;
+  }
+
+  // write the run state from OP memory to the store
+  if (!save_kv_cache(key, *p_runstate, false, recompute)) {
+    *error_msg = "write_run_state failed for key " + key;
+    return false;
+  }
+  if (with_draft &&
+      !save_kv_cache(key, *p_draft_runstate, true, recompute)) {
+    *error_msg = "write_run_state failed for the draft of key " + key;
+    return false;
+  }
+  return true;
+}
+
+// read runstate from the pool, or else from the store
 // key = principal or ordinal-id
 bool load_runstate(std::string key, IC_API &ic_api) {
   if (p_chats && p_chats->umap.find(key) == p_chats->umap.end()) {
@@ -184,15 +377,44 @@ bool load_runstate(std::string key, IC_API &ic_api) {
     return false;
   }
 
-  // read the run state from file into OP memory
-  if (!read_run_state(key, *p_runstate, transformer.config)) {
-    // If nothing there, just continue with the empty run state
+  // A call that did not save its run state, eg. after an error, left it in
+  // p_runstate
+  std::string key_in_use = p_runstate_pool ? p_runstate_pool->key_in_use : "";
+  if (key_in_use == key) return true;
+  std::string error_msg;
+  if (!key_in_use.empty() && !store_runstate(key_in_use, &error_msg, true)) {
+    std::cout << error_msg << std::endl;
+    ic_api.to_wire(CandidTypeVariant{
+        "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+    return false;
+  }
+
+  Chat *chat = &p_chats->umap[key];
+  ResidentRunState *slot = find_resident_runstate(key);
+  if (slot) {
+    // the buffers of the slot become those of p_runstate, and the other way
+    // around: the slot now holds the spare buffers
+    std::swap(*p_runstate, slot->state);
+    if (slot->has_draft) std::swap(*p_draft_runstate, slot->draft_state);
+    slot->key.clear();
+    slot->has_draft = false;
+  } else {
+    // read the run state from the store into OP memory, or recompute it
+    if (!load_kv_cache(key, *p_runstate, false)) {
+      // If nothing there, just continue with the empty run state
+    }
+
+    // same for the draft model, if it is still in sync with the chat
+    if (draft_model_ready && chat->draft_pos == chat->pos && chat->pos > 0) {
+      load_kv_cache(key, *p_draft_runstate, true);
+    }
   }
 
+  if (p_runstate_pool) p_runstate_pool->key_in_use = key;
   return true;
 }
 
-// write the run state to file
+// keep the run state in the pool, or else write it to the store
 // key = principal or ordinal-id
 bool save_runstate(std::string key, IC_API &ic_api) {
   if (p_chats && p_chats->umap.find(key) == p_chats->umap.end()) {
@@ -204,22 +426,69 @@ bool save_runstate(std::string key, IC_API &ic_api) {
     return false;
   }
 
-  // write the run state from OP memory to a file
-  Chat *chat = &p_chats->umap[key];
-  if (!write_run_state(key, *p_runstate, transformer.config)) {
-    std::string error_msg = "write_run_state failed for key " + key;
+  std::string error_msg;
+  if (!store_runstate(key, &error_msg, true)) {
     std::cout << error_msg << std::endl;
     ic_api.to_wire(CandidTypeVariant{
         "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
     return false;
   }
 
-  // free the run state in OP memory
-  // free_run_state(&chat->state);
-
   return true;
 }
 
+// Writes the run state of key to the store, if it is in the pool, and takes
+// it out of the pool. For callers that read & write the store themselves,
+// eg. nft_story_continue_batch. The rows are written, not left to be
+// recomputed, since the caller reads them back right away.
+bool release_runstate(const std::string &key) {
+  if (!p_runstate_pool) return true;
+  std::string error_msg;
+  std::string key_in_use = p_runstate_pool->key_in_use;
+  if (!key_in_use.empty() &&
+      !store_runstate(key_in_use, &error_msg, key_in_use != key)) {
+    std::cout << error_msg << std::endl;
+    return false;
+  }
+  ResidentRunState *slot = find_resident_runstate(key);
+  return !slot || spill_resident_runstate(*slot, false);
+}
+
+// Takes the run state of key out of the pool, without writing it, eg. when
+// its story is deleted
+void drop_runstate(const std::string &key) {
+  if (!p_runstate_pool) return;
+  if (p_runstate_pool->key_in_use == key) p_runstate_pool->key_in_use.clear();
+  ResidentRunState *slot = find_resident_runstate(key);
+  if (slot) {
+    slot->key.clear();
+    slot->has_draft = false;
+  }
+}
+
+// Writes every run state of the pool to the store, and frees the pool, eg.
+// before initialize reallocates the RunStates. Returns false if a write failed.
+bool clear_runstate_pool() {
+  if (!p_runstate_pool) return true;
+  bool ok = true;
+  std::string error_msg;
+  std::string key_in_use = p_runstate_pool->key_in_use;
+  if (!key_in_use.empty() && !store_runstate(key_in_use, &error_msg, true)) {
+    std::cout << error_msg << std::endl;
+    ok = false;
+  }
+  for (ResidentRunState &slot : p_runstate_pool->slots) {
+    if (!slot.key.empty() && !spill_resident_runstate(slot, true)) {
+      std::cout << "write_run_state failed for key " << slot.key << std::endl;
+      ok = false;
+    }
+    free_run_state(&slot.state);
+    free_run_state(&slot.draft_state);
+  }
+  p_runstate_pool->slots.clear();
+  return ok;
+}
+
 bool is_ready_and_authorized(IC_API &ic_api) {
 
   if (!ready_for_inference) {
@@ -264,53 +533,274 @@ void new_chat() {
   ic_api.to_wire(CandidTypeVariant{"Ok", status_code_record});
 }
 
-// Function to write RunState to a file
+// icpp: The runstate, version 1, in the RunStateStore under its key: a
+//       RunStateFileHeader, followed by the kv
+//       cache rows of the positions [0, pos), position after position. A
+//       position holds, for every layer, its key row & its value row, in the
+//       storage of the kv_type, with the int8 scales behind their row.
+//       Only these rows carry state from one call to the next: the activations
+//       & the logits are recomputed by the next forward, so they are not saved.
+//       write_run_state only appends the rows of the positions generated since
+//       the last save, and read_run_state only reads [0, pos).
+//       The <key>.runstate files written before the store, of version 1 or of
+//       the legacy format without a header, are still read.
+#define RUN_STATE_FILE_MAGIC 0x73727069 // "iprs" in ASCII, little-endian
+#define RUN_STATE_FILE_VERSION 1
+
+struct RunStateFileHeader {
+  uint32_t magic;       // RUN_STATE_FILE_MAGIC
+  uint32_t version;     // RUN_STATE_FILE_VERSION
+  uint64_t config_hash; // see config_hash, the rows fit only this model
+  uint32_t kv_type;     // KVCacheType of the rows
+  int32_t pos;          // positions stored
+  uint64_t evicted;     // Chat.evicted when saved: eviction moves the rows
+};
+
+// FNV-1a of the Config
+static uint64_t config_hash(const Config &config) {
+  const int values[] = {config.dim,        config.hidden_dim, config.n_layers,
+                        config.n_heads,    config.n_kv_heads, config.vocab_size,
+                        config.seq_len};
+  uint64_t hash = 14695981039346656037ULL;
+  for (int value : values) {
+    for (int i = 0; i < 4; ++i) {
+      hash ^= static_cast<uint8_t>(static_cast<uint32_t>(value) >> (8 * i));
+      hash *= 1099511628211ULL;
+    }
+  }
+  return hash;
+}
+
+static RunStateFileHeader run_state_file_header(const RunState &state,
+                                                const Config &config,
+                                                const Chat &chat) {
+  RunStateFileHeader header{};
+  header.magic = RUN_STATE_FILE_MAGIC;
+  header.version = RUN_STATE_FILE_VERSION;
+  header.config_hash = config_hash(config);
+  header.kv_type = static_cast<uint32_t>(state.kv_type);
+  header.pos = chat.pos;
+  header.evicted = chat.evicted;
+  return header;
+}
+
+// true if the rows of a runstate with header saved belong to the same kv cache
+static bool run_state_file_matches(const RunStateFileHeader &saved,
+                                   const RunStateFileHeader &header) {
+  return saved.magic == RUN_STATE_FILE_MAGIC &&
+         saved.version == RUN_STATE_FILE_VERSION &&
+         saved.config_hash == header.config_hash &&
+         saved.kv_type == header.kv_type && saved.evicted == header.evicted;
+}
+
+// Applies f(data, count, size) to the kv cache rows of the positions
+// [first, last), in the order of the runstate
+template <typename F>
+static bool kv_cache_rows(const RunState &state, const Config &config,
+                          int first, int last, F f) {
+  size_t kv_dim = (config.dim * config.n_kv_heads) / config.n_heads;
+  size_t n_kv_heads = config.n_kv_heads;
+  for (int pos = first; pos < last; ++pos) {
+    for (int l = 0; l < config.n_layers; ++l) {
+      size_t row = static_cast<size_t>(l) * config.seq_len + pos;
+      size_t off = row * kv_dim;
+      size_t off_s = row * n_kv_heads;
+      bool ok;
+      switch (state.kv_type) {
+      case KV_CACHE_FP16:
+        ok = f(state.key_cache_f16 + off, kv_dim, sizeof(uint16_t)) &&
+             f(state.value_cache_f16 + off, kv_dim, sizeof(uint16_t));
+        break;
+      case KV_CACHE_INT8:
+        ok = f(state.key_cache_q + off, kv_dim, sizeof(int8_t)) &&
+             f(state.key_cache_s + off_s, n_kv_heads, sizeof(float)) &&
+             f(state.value_cache_q + off, kv_dim, sizeof(int8_t)) &&
+             f(state.value_cache_s + off_s, n_kv_heads, sizeof(float));
+        break;
+      default:
+        ok = f(state.key_cache + off, kv_dim, sizeof(float)) &&
+             f(state.value_cache + off, kv_dim, sizeof(float));
+        break;
+      }
+      if (!ok) return false;
+    }
+  }
+  return true;
+}
+
+// bytes of the rows of one position in the runstate
+size_t kv_cache_position_bytes(const RunState &state, const Config &config) {
+  size_t bytes = 0;
+  kv_cache_rows(state, config, 0, 1,
+                [&](const void *, size_t count, size_t size) {
+                  bytes += count * size;
+                  return true;
+                });
+  return bytes;
+}
+
+// Copies the kv cache rows of the positions [first, last) to dst, in the
+// order of the runstate
+void kv_cache_save_rows(const RunState &state, const Config &config, int first,
+                        int last, char *dst) {
+  kv_cache_rows(state, config, first, last,
+                [&](const void *data, size_t count, size_t size) {
+                  std::memcpy(dst, data, count * size);
+                  dst += count * size;
+                  return true;
+                });
+}
+
+// Copies the kv cache rows of the positions [first, last) from src, the
+// reverse of kv_cache_save_rows
+void kv_cache_load_rows(RunState &state, const Config &config, int first,
+                        int last, const char *src) {
+  kv_cache_rows(state, config, first, last,
+                [&](void *data, size_t count, size_t size) {
+                  std::memcpy(data, src, count * size);
+                  src += count * size;
+                  return true;
+                });
+}
+
+// The positions [0, pos) of the kv cache of chat that the store holds rows
+// of, with key, or -1 if it holds none that write_run_state can append to
+static int stored_run_state_pos(const std::string &key, const RunState &state,
+                                const Config &config, const Chat &chat) {
+  if (!p_runstate_store) return -1;
+  RunStateStore &store = *p_runstate_store;
+  RunStateFileHeader header = run_state_file_header(state, config, chat);
+  RunStateFileHeader saved{};
+  if (store.size(key) >= sizeof(saved) &&
+      store.read(key, 0, &saved, sizeof(saved)) &&
+      run_state_file_matches(saved, header) && saved.pos <= chat.pos) {
+    return saved.pos;
+  }
+  return -1;
+}
+
+// Function to write RunState to the RunStateStore
+// icpp: appends the rows of the positions [saved pos, chat.pos), if the store
+//       holds rows of this kv cache, else writes the rows [0, chat.pos)
 bool write_run_state(const std::string &key, const RunState &state,
-                     const Config &config) {
-  std::string filename = key + ".runstate";
-  std::ofstream out(filename, std::ios::binary);
-  if (!out) {
-    std::cout << "Error: Could not open file for writing: " << filename
+                     const Config &config, const Chat &chat) {
+  if (!p_runstate_store) return false;
+  RunStateStore &store = *p_runstate_store;
+  RunStateFileHeader header = run_state_file_header(state, config, chat);
+
+  int first = stored_run_state_pos(key, state, config, chat);
+  if (first < 0) {
+    first = 0;
+    // Another kv cache, or one saved as a file before the store
+    std::error_code ec;
+    std::filesystem::remove(key + ".runstate", ec);
+    store.truncate(key, 0);
+  }
+
+  // Serialize the new rows, one position per write, then the header, so it
+  // only counts written rows
+  size_t position_bytes = kv_cache_position_bytes(state, config);
+  std::vector<char> rows(position_bytes);
+  bool ok = true;
+  for (int pos = first; ok && pos < chat.pos; ++pos) {
+    kv_cache_save_rows(state, config, pos, pos + 1, rows.data());
+    ok = store.write(key, sizeof(header) + pos * position_bytes, rows.data(),
+                     position_bytes);
+  }
+  ok = ok && store.write(key, 0, &header, sizeof(header));
+  if (!store.close() || !ok) {
+    std::cerr << "Error: Failed to write the runstate of key " << key
               << std::endl;
     return false;
   }
 
-  // Serialize RunState
-  auto write_array = [&](const void *data, size_t count, size_t size) {
-    out.write(static_cast<const char *>(data), count * size);
-    return out.good();
+  return true;
+}
+
+// The runstate files written before version 1, with the activations & the
+// whole kv cache
+static bool read_run_state_legacy(std::ifstream &in, RunState &state,
+                                  const Config &config) {
+  auto read_array = [&](void *data, size_t count, size_t size) {
+    in.read(static_cast<char *>(data), count * size);
+    return in.good();
   };
+  size_t kv_dim = (config.dim * config.n_kv_heads) / config.n_heads;
+  size_t n = static_cast<size_t>(config.n_layers) * config.seq_len * kv_dim;
+  size_t n_scales =
+      static_cast<size_t>(config.n_layers) * config.seq_len * config.n_kv_heads;
+  if (!read_array(state.x, config.dim, sizeof(float)) ||
+      !read_array(state.xb, config.dim, sizeof(float)) ||
+      !read_array(state.xb2, config.dim, sizeof(float)) ||
+      !read_array(state.hb, config.hidden_dim, sizeof(float)) ||
+      !read_array(state.hb2, config.hidden_dim, sizeof(float)) ||
+      !read_array(state.q, config.dim, sizeof(float)) ||
+      !read_array(state.k, kv_dim, sizeof(float)) ||
+      !read_array(state.v, kv_dim, sizeof(float)) ||
+      !read_array(state.logits, config.vocab_size, sizeof(float))) {
+    return false;
+  }
+  switch (state.kv_type) {
+  case KV_CACHE_FP16:
+    return read_array(state.key_cache_f16, n, sizeof(uint16_t)) &&
+           read_array(state.value_cache_f16, n, sizeof(uint16_t));
+  case KV_CACHE_INT8:
+    return read_array(state.key_cache_q, n, sizeof(int8_t)) &&
+           read_array(state.key_cache_s, n_scales, sizeof(float)) &&
+           read_array(state.value_cache_q, n, sizeof(int8_t)) &&
+           read_array(state.value_cache_s, n_scales, sizeof(float));
+  default:
+    return read_array(state.key_cache, n, sizeof(float)) &&
+           read_array(state.value_cache, n, sizeof(float));
+  }
+}
 
-  if (!write_array(state.x, config.dim, sizeof(float)) ||
-      !write_array(state.xb, config.dim, sizeof(float)) ||
-      !write_array(state.xb2, config.dim, sizeof(float)) ||
-      !write_array(state.hb, config.hidden_dim, sizeof(float)) ||
-      !write_array(state.hb2, config.hidden_dim, sizeof(float)) ||
-      !write_array(state.q, config.dim, sizeof(float)) ||
-      !write_array(state.k, (config.dim * config.n_kv_heads) / config.n_heads,
-                   sizeof(float)) ||
-      !write_array(state.v, (config.dim * config.n_kv_heads) / config.n_heads,
-                   sizeof(float)) ||
-      !write_array(state.att, config.n_heads * config.seq_len, sizeof(float)) ||
-      !write_array(state.logits, config.vocab_size, sizeof(float)) ||
-      !write_array(state.key_cache,
-                   config.n_layers * config.seq_len *
-                       ((config.dim * config.n_kv_heads) / config.n_heads),
-                   sizeof(float)) ||
-      !write_array(state.value_cache,
-                   config.n_layers * config.seq_len *
-                       ((config.dim * config.n_kv_heads) / config.n_heads),
-                   sizeof(float))) {
-    std::cerr << "Error: Failed to write to file: " << filename << std::endl;
+// true if the rows after the header saved are those of this chat
+static bool run_state_header_fits(const RunStateFileHeader &saved,
+                                  const RunStateFileHeader &header,
+                                  const std::string &name) {
+  if (!run_state_file_matches(saved, header) || saved.pos < header.pos) {
+    std::cerr << "Error: The runstate " << name
+              << " does not hold the kv cache of this chat" << std::endl;
     return false;
   }
+  return true;
+}
 
+static bool read_run_state_from_store(const std::string &key, RunState &state,
+                                      const Config &config, const Chat &chat) {
+  RunStateStore &store = *p_runstate_store;
+  RunStateFileHeader header = run_state_file_header(state, config, chat);
+  RunStateFileHeader saved{};
+  bool ok = store.read(key, 0, &saved, sizeof(saved)) &&
+            run_state_header_fits(saved, header, key);
+
+  // Deserialize RunState, one position per read
+  size_t position_bytes = kv_cache_position_bytes(state, config);
+  std::vector<char> rows(position_bytes);
+  for (int pos = 0; ok && pos < chat.pos; ++pos) {
+    ok = store.read(key, sizeof(saved) + pos * position_bytes, rows.data(),
+                    position_bytes);
+    if (ok) kv_cache_load_rows(state, config, pos, pos + 1, rows.data());
+  }
+  if (!store.close() || !ok) {
+    std::cerr << "Error: Failed to read the runstate of key " << key
+              << std::endl;
+    return false;
+  }
   return true;
 }
 
-// Function to read RunState from a file
+// Function to read RunState from the RunStateStore, or else from a file
+// icpp: reads the rows of the positions [0, chat.pos)
 bool read_run_state(const std::string &key, RunState &state,
-                    const Config &config) {
+                    const Config &config, const Chat &chat) {
+  if (chat.pos == 0) return true; // a new chat, nothing to read
+  if (p_runstate_store && p_runstate_store->contains(key)) {
+    return read_run_state_from_store(key, state, config, chat);
+  }
+
+  // Saved before the store
   std::string filename = key + ".runstate";
   std::ifstream in(filename, std::ios::binary);
   if (!in) {
@@ -319,32 +809,28 @@ bool read_run_state(const std::string &key, RunState &state,
     return false;
   }
 
+  RunStateFileHeader header = run_state_file_header(state, config, chat);
+  RunStateFileHeader saved{};
+  if (!in.read(reinterpret_cast<char *>(&saved), sizeof(saved)) ||
+      saved.magic != RUN_STATE_FILE_MAGIC) {
+    in.clear();
+    in.seekg(0);
+    if (!read_run_state_legacy(in, state, config)) {
+      std::cerr << "Error: Failed to read from file: " << filename
+                << std::endl;
+      return false;
+    }
+    return true;
+  }
+  if (!run_state_header_fits(saved, header, filename)) return false;
+
   // Deserialize RunState
   auto read_array = [&](void *data, size_t count, size_t size) {
     in.read(static_cast<char *>(data), count * size);
     return in.good();
   };
 
-  if (!read_array(state.x, config.dim, sizeof(float)) ||
-      !read_array(state.xb, config.dim, sizeof(float)) ||
-      !read_array(state.xb2, config.dim, sizeof(float)) ||
-      !read_array(state.hb, config.hidden_dim, sizeof(float)) ||
-      !read_array(state.hb2, config.hidden_dim, sizeof(float)) ||
-      !read_array(state.q, config.dim, sizeof(float)) ||
-      !read_array(state.k, (config.dim * config.n_kv_heads) / config.n_heads,
-                  sizeof(float)) ||
-      !read_array(state.v, (config.dim * config.n_kv_heads) / config.n_heads,
-                  sizeof(float)) ||
-      !read_array(state.att, config.n_heads * config.seq_len, sizeof(float)) ||
-      !read_array(state.logits, config.vocab_size, sizeof(float)) ||
-      !read_array(state.key_cache,
-                  config.n_layers * config.seq_len *
-                      ((config.dim * config.n_kv_heads) / config.n_heads),
-                  sizeof(float)) ||
-      !read_array(state.value_cache,
-                  config.n_layers * config.seq_len *
-                      ((config.dim * config.n_kv_heads) / config.n_heads),
-                  sizeof(float))) {
+  if (!kv_cache_rows(state, config, 0, chat.pos, read_array)) {
     std::cerr << "Error: Failed to read from file: " << filename << std::endl;
     return false;
   }
@@ -352,21 +838,128 @@ bool read_run_state(const std::string &key, RunState &state,
   return true;
 }
 
+// The key of the run state of the draft model, saved as <key>.draft
+std::string draft_run_state_key(const std::string &key) {
+  return key + ".draft";
+}
+
+// Frees the pages of the runstate of key in the RunStateStore, and removes
+// its file, if it was saved before the store
 bool delete_run_state_file(const std::string &key) {
+  bool ok = !p_runstate_store || p_runstate_store->erase(key);
+
   std::string filename = key + ".runstate";
+  std::error_code ec;
+  std::filesystem::remove(filename, ec);
+  if (ec) {
+    std::cout << "Error: Could not delete file: " << filename << std::endl;
+    return false;
+  }
+  return ok;
+}
 
-  // Check if the file exists before attempting to delete
-  if (!std::filesystem::exists(filename)) {
-    std::cout << "Warning: File does not exist: " << filename << std::endl;
-    return true; // Not considered an error
+// icpp: recompute instead of store. For small models, forwarding the tokens of
+//       a chat again may cost fewer instructions than writing its kv cache
+//       rows to the RunStateStore & reading them back. The chat then only
+//       keeps its token history, a few KB, and load_kv_cache recomputes the
+//       rows with forward_prefill. The cost model compares the flops of that
+//       forward with RECOMPUTE_FLOPS_PER_IO_BYTE per byte of I/O: the rows
+//       that write_run_state appends, plus one read of all rows by the next
+//       read_run_state. Chats kept in the RunStatePool do neither, so this
+//       only applies when a RunState leaves the pool, or without a pool.
+//       The rows of a chat can only be recomputed when its token history is
+//       complete, and attention sinks did not evict any of its positions.
+//       The ratio is not yet calibrated, so the default of 0 always stores.
+//       Measure the instructions per flop of forward_prefill & per byte of
+//       the store with ic0.performance_counter, then set it with the endpoint
+//       set_recompute_flops_per_io_byte. The initial value can be compiled in
+//       with -DRECOMPUTE_FLOPS_PER_IO_BYTE=<flops> (see icpp.toml).
+#ifndef RECOMPUTE_FLOPS_PER_IO_BYTE
+#define RECOMPUTE_FLOPS_PER_IO_BYTE 0
+#endif
+uint64_t recompute_flops_per_io_byte{RECOMPUTE_FLOPS_PER_IO_BYTE};
+
+// The token history of the chat of key, if it holds every position of its kv
+// cache, else nullptr
+static const std::vector<int> *recompute_tokens(const std::string &key,
+                                                const Chat &chat) {
+  if (!p_chats_token_history || chat.evicted > 0) return nullptr;
+  auto it = p_chats_token_history->umap.find(key);
+  if (it == p_chats_token_history->umap.end() ||
+      static_cast<int>(it->second.size()) != chat.pos) {
+    return nullptr;
   }
+  return &it->second;
+}
 
-  // Attempt to delete the file
-  if (std::filesystem::remove(filename)) {
-    std::cout << "File deleted successfully: " << filename << std::endl;
-    return true;
-  } else {
-    std::cout << "Error: Could not delete file: " << filename << std::endl;
+// true if recomputing the rows [0, pos) is cheaper than appending the rows
+// [stored_pos, pos) to the store & reading the rows [0, pos) back
+static bool recompute_cheaper(const RunState &state, const Config &config,
+                              int pos, int stored_pos) {
+  if (recompute_flops_per_io_byte == 0) return false;
+  double dim = config.dim;
+  double kv_dim = (config.dim * config.n_kv_heads) / config.n_heads;
+  double n_layers = config.n_layers;
+  // the matmuls, without the classifier: the rows need no logits
+  double hidden_dim = config.hidden_dim;
+  double weights =
+      n_layers * (2 * dim * dim + 2 * dim * kv_dim + 3 * dim * hidden_dim);
+  // the attention of position p reads the keys & values of [0, p]
+  double flops = pos * 2 * weights + 2 * n_layers * dim * pos * (pos + 1.0);
+  double rows = (pos - stored_pos) + pos;
+  double io_bytes = rows * kv_cache_position_bytes(state, config);
+  return flops <= recompute_flops_per_io_byte * io_bytes;
+}
+
+// Saves the kv cache of the chat of key, or of its draft: the rows, with
+// write_run_state, or nothing when recompute is true & load_kv_cache can
+// recompute them cheaper. Callers that load the kv cache again right away,
+// eg. nft_story_continue_batch, pass recompute = false.
+bool save_kv_cache(const std::string &key, const RunState &state, bool draft,
+                   bool recompute) {
+  auto it = p_chats->umap.find(key);
+  if (it == p_chats->umap.end()) return true; // deleted
+  const Chat &chat = it->second;
+  const Config &config = draft ? draft_transformer.config : transformer.config;
+  std::string state_key = draft ? draft_run_state_key(key) : key;
+  if (recompute && recompute_tokens(key, chat)) {
+    int stored_pos = stored_run_state_pos(state_key, state, config, chat);
+    if (recompute_cheaper(state, config, chat.pos,
+                          stored_pos > 0 ? stored_pos : 0)) {
+      // Rows saved by an earlier call are stale
+      if (p_runstate_store && p_runstate_store->contains(state_key)) {
+        return delete_run_state_file(state_key);
+      }
+      return true;
+    }
+  }
+  return write_run_state(state_key, state, config, chat);
+}
+
+// Loads the kv cache of the chat of key, or of its draft: the rows saved by
+// save_kv_cache, or else recomputed from the token history
+bool load_kv_cache(const std::string &key, RunState &state, bool draft) {
+  auto it = p_chats->umap.find(key);
+  if (it == p_chats->umap.end()) return false;
+  Chat &chat = it->second;
+  if (chat.pos == 0) return true; // a new chat, nothing to load
+  Transformer *t = draft ? &draft_transformer : &transformer;
+  std::string state_key = draft ? draft_run_state_key(key) : key;
+  const std::vector<int> *history = recompute_tokens(key, chat);
+  if (!history || (p_runstate_store && p_runstate_store->contains(state_key))) {
+    return read_run_state(state_key, state, t->config, chat);
+  }
+
+  // the token at position i is entry i - 1 of the history, after the BOS
+  // token, and the last entry is chat.next, the token of position pos
+  std::vector<int> tokens;
+  tokens.reserve(chat.pos);
+  tokens.push_back(1);
+  tokens.insert(tokens.end(), history->begin(), history->end() - 1);
+  if (!forward_prefill(&state, &chat, t, tokens.data(), chat.pos, 0)) {
+    std::cerr << "Error: Failed to recompute the runstate of key " << state_key
+              << std::endl;
     return false;
   }
+  return true;
 }
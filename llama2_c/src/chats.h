@@ -2,6 +2,7 @@
 
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "ic_api.h"
 #include "run.h"
@@ -24,6 +25,7 @@ public:
 };
 extern Chats *p_chats;
 extern RunState *p_runstate;
+extern RunState *p_draft_runstate;
 
 // Save current chat history (the full human readable story)
 class ChatsOutputHistory {
@@ -33,6 +35,43 @@ public:
 };
 extern ChatsOutputHistory *p_chats_output_history;
 
+// The tokens of the current chat, after the BOS token, used by prompt lookup
+class ChatsTokenHistory {
+public:
+  //                 key
+  std::unordered_map<std::string, std::vector<int>> umap;
+};
+extern ChatsTokenHistory *p_chats_token_history;
+
+// The RunStates of the most recently used chats stay in memory between calls,
+// up to RUNSTATE_POOL_BUDGET bytes. load_runstate & save_runstate then swap
+// their buffers with p_runstate, instead of reading & writing the
+// RunStateStore. The least recently used RunState is written to the store when
+// the pool is full, see save_runstate.
+// Override the budget with -DRUNSTATE_POOL_BUDGET=<bytes> (see icpp.toml), 0
+// disables the pool.
+#ifndef RUNSTATE_POOL_BUDGET
+#define RUNSTATE_POOL_BUDGET (256ULL * 1024 * 1024)
+#endif
+
+struct ResidentRunState {
+  std::string key;       // empty: a free slot, with spare buffers
+  RunState state;        // the buffers of the chat of key
+  RunState draft_state;  // same for the draft model, if has_draft
+  bool has_draft{false}; // the draft was in sync when saved
+  unsigned long long last_used{0};
+};
+
+class RunStatePool {
+public:
+  std::vector<ResidentRunState> slots;
+  unsigned long long clock{0}; // for last_used
+  // The key whose buffers are in p_runstate, from load_runstate until
+  // save_runstate. Empty when p_runstate holds spare buffers.
+  std::string key_in_use;
+};
+extern RunStatePool *p_runstate_pool;
+
 // ---
 // Some minimal usage data: umap[key, MetaDataChat]
 
@@ -40,6 +79,9 @@ extern ChatsOutputHistory *p_chats_output_history;
 struct MetadataChat {
   uint64_t start_time{0};  // time in ns
   uint64_t total_steps{0}; // total number of steps (=tokens)
+  // proposed tokens of prompt lookup that were accepted & rejected
+  uint64_t lookup_accepted{0};
+  uint64_t lookup_rejected{0};
 };
 
 // Metadata for the User, containing a vector of all chats' metadata
@@ -63,10 +105,25 @@ bool is_ready_and_authorized(IC_API &ic_api);
 
 bool load_runstate(std::string key, IC_API &ic_api);
 bool save_runstate(std::string key, IC_API &ic_api);
+bool release_runstate(const std::string &key);
+void drop_runstate(const std::string &key);
+bool clear_runstate_pool();
 bool write_run_state(const std::string &key, const RunState &state,
-                     const Config &config);
+                     const Config &config, const Chat &chat);
 bool read_run_state(const std::string &key, RunState &state,
-                    const Config &config);
+                    const Config &config, const Chat &chat);
+std::string draft_run_state_key(const std::string &key);
 bool delete_run_state_file(const std::string &key);
+// icpp: the flops of recomputing a kv cache that cost as much as a byte of I/O
+//       to the RunStateStore, 0 always stores it, see save_kv_cache
+extern uint64_t recompute_flops_per_io_byte;
+bool save_kv_cache(const std::string &key, const RunState &state, bool draft,
+                   bool recompute);
+bool load_kv_cache(const std::string &key, RunState &state, bool draft);
+size_t kv_cache_position_bytes(const RunState &state, const Config &config);
+void kv_cache_save_rows(const RunState &state, const Config &config, int first,
+                        int last, char *dst);
+void kv_cache_load_rows(RunState &state, const Config &config, int first,
+                        int last, const char *src);
 
 void init_run_state(RunState *s);
\ No newline at end of file
@@ -2,16 +2,21 @@
 
 #include "inference.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <optional>
 #include <string>
 #include <unordered_map>
 #include <variant>
+#include <vector>
 
 #include "canister.h"
 #include "chats.h"
 #include "prompt.h"
 #include "http.h"
 #include "initialize.h"
+#include "prefix_cache.h"
 #include "run.h"
 #include "upload.h"
 
@@ -42,31 +47,122 @@ std::string safe_stringify(const char *piece) {
   return result;
 }
 
-// Copied from run.c and modified slightly
-std::string generate(IC_API ic_api, RunState *runstate, Chat *chat,
-                     Transformer *transformer, Tokenizer *tokenizer,
-                     Sampler *sampler, std::string prompt, int steps,
-                     bool *error) {
+// icpp: the state of a generate call, advanced one token at a time, so that
+//       generate_batch can forward the tokens of several stories together
+struct Generation {
+  RunState *runstate{nullptr};
+  RunState *draft_runstate{nullptr}; // of draft_transformer, or nullptr
+  Chat *chat{nullptr};
+  std::vector<int> *token_history{nullptr}; // the chat's tokens, or nullptr
+  int ngram_lookup{0}; // most tokens proposed by prompt lookup, 0: off
+  int lookup_tokens{0}; // tokens proposed by the next prompt lookup
+  int attention_sinks{0}; // positions kept when the kv cache is full, 0: off
+  Sampler *sampler{nullptr};
+  int *prompt_tokens{nullptr};
+  int num_prompt_tokens{0};
+  int num_prefill{0}; // prompt tokens forwarded by forward_prefill
+  int token{0};       // token that was predicted last, or BOS
+  int pos{0};         // position in the total sequence
+  int prompt_pos{0};  // position in the current prompt
+  int steps{0};
+  unsigned long long max_total_steps{0};
+  bool done{false};
+  std::string output;
+};
+
+// icpp: attention sinks with a rolling window (StreamingLLM). Without them, a
+//       story stops when its kv cache is full, at seq_len positions. With them,
+//       the first attention_sinks positions stay in the kv cache, and the oldest
+//       positions after them are evicted, a fraction of the window at a time,
+//       see kv_cache_evict. The kept positions are renumbered, so the memory
+//       and the cost per token stay flat, no matter how long the story gets.
+//       The token history is evicted with the kv cache.
+#define ATTENTION_SINKS_EVICT_FRACTION 4 // evict 1/4 of the window at a time
+
+// Makes room in the kv cache to forward n more positions, when there are
+// attention sinks. Returns the number of positions that can be forwarded.
+static int generation_make_room(Generation *g, Transformer *transformer,
+                                int n) {
+  int seq_len = transformer->config.seq_len;
+  int room = seq_len - g->pos;
+  if (g->attention_sinks == 0 || room >= n) return room;
+  int n_evict = std::max(n - room, (seq_len - g->attention_sinks) /
+                                       ATTENTION_SINKS_EVICT_FRACTION);
+  n_evict = std::min(n_evict, g->pos - g->attention_sinks);
+  if (n_evict <= 0) return room;
+
+  kv_cache_evict(g->runstate, transformer, g->attention_sinks, n_evict,
+                 g->pos);
+  if (g->draft_runstate) {
+    kv_cache_evict(g->draft_runstate, &draft_transformer, g->attention_sinks,
+                   n_evict, g->pos);
+  }
+  if (g->token_history) {
+    // the token at position i is entry i - 1, after the BOS token
+    auto first = g->token_history->begin() + (g->attention_sinks - 1);
+    g->token_history->erase(first, first + n_evict);
+  }
+  g->pos -= n_evict;
+  g->max_total_steps -= n_evict;
+  g->chat->pos = g->pos;
+  g->chat->evicted += n_evict;
+  return room + n_evict;
+}
+
+// A draft model with a shorter seq_len than the model drops out of sync with
+// the chat before it would forward a position beyond its kv cache. Returns
+// whether the draft can forward the positions [pos, pos + n), else stops
+// using it.
+static bool generation_draft_fits(Generation *g, int pos, int n) {
+  if (!g->draft_runstate) return false;
+  if (pos + n <= draft_transformer.config.seq_len) return true;
+  g->draft_runstate = nullptr;
+  g->chat->draft_pos = -1;
+  return false;
+}
+
+// The tokens of the positions [0, g.pos + n) of the chat, with the first n
+// prompt tokens, or nothing when they are not known, see prefix_cache.h
+static std::vector<int> generation_prefix(const Generation &g, int n) {
+  std::vector<int> tokens;
+  // attention sinks move the rows to other positions
+  if (g.chat->evicted > 0) return tokens;
+  if (g.pos > 0) {
+    if (!g.token_history) return tokens;
+    // the token at position i is entry i - 1, after the BOS token
+    tokens.push_back(1);
+    tokens.insert(tokens.end(), g.token_history->begin(),
+                  g.token_history->begin() + (g.pos - 1));
+  }
+  tokens.insert(tokens.end(), g.prompt_tokens, g.prompt_tokens + n);
+  return tokens;
+}
+
+// Copied from run.c and modified slightly: everything before the main loop
+// Returns an error message, with *error set to true
+static std::string generation_start(Generation *g, Transformer *transformer,
+                                    Tokenizer *tokenizer, std::string prompt,
+                                    int steps, bool *error) {
   // --- DEBUG TEST
   // *error = true;
   // return "Testing return of error=true from 'generate'.";
   //--- DEBUG TEST END
   *error = false;
-  std::string output;
+  Chat *chat = g->chat;
 
   // encode the (string) prompt into tokens sequence
-  int num_prompt_tokens = 0;
+  g->num_prompt_tokens = 0;
 
   // +3 for '\0', ?BOS, ?EOS
-  int *prompt_tokens = (int *)malloc((prompt.length() + 3) * sizeof(int));
-  if (!prompt_tokens) {
+  g->prompt_tokens = (int *)malloc((prompt.length() + 3) * sizeof(int));
+  if (!g->prompt_tokens) {
     *error = true;
     return "Failed to allocate memory for prompt_tokens.";
   }
   // We do not pass bos, but next, which is 1 after new_chat, else last token of previous call
   int error_code = 0;
-  encode(tokenizer, prompt.c_str(), chat->next, chat->eos, prompt_tokens,
-         &num_prompt_tokens, &error_code);
+  encode(tokenizer, prompt.c_str(), chat->next, chat->eos, g->prompt_tokens,
+         &g->num_prompt_tokens, &error_code);
   if (error_code != 0) {
     std::string error_msg;
     if (error_code == 1) {
@@ -85,97 +181,516 @@ std::string generate(IC_API ic_api, RunState *runstate, Chat *chat,
   chat->bos = 0;
   chat->eos = 0;
 
-  int token = chat->next; // token that was predicted last, or BOS
-  int pos = chat->pos;    // position in the total sequence
-  int prompt_pos = 0;     // position in the current prompt
-  // if (num_prompt_tokens > 0) {
-  //   token = prompt_tokens
-  //       [prompt_pos]; // kick off with the first token in the prompt
-  // }
+  g->token = chat->next; // token that was predicted last, or BOS
+  g->pos = chat->pos;    // position in the total sequence
+  g->prompt_pos = 0;     // position in the current prompt
 
-  // chat->total_steps += num_prompt_tokens + steps;
   // When we have a prompt, we do NOT take additional steps
   if (prompt.length() > 0) {
     steps = 0;
   }
-  // chat->total_steps += num_prompt_tokens + steps;
-  // // override to ~max length
-  // if (chat->total_steps > transformer->config.seq_len)
-  //   chat->total_steps = transformer->config.seq_len;
-
-  unsigned long long max_total_steps =
-      chat->total_steps + num_prompt_tokens + steps;
-  if (max_total_steps > transformer->config.seq_len)
-    max_total_steps = transformer->config.seq_len;
+  g->steps = steps;
+
+  g->max_total_steps = chat->total_steps + g->num_prompt_tokens + steps;
+  // icpp: in positions of the kv cache, see attention sinks
+  g->max_total_steps -= chat->evicted;
+  if (g->attention_sinks == 0 &&
+      g->max_total_steps > transformer->config.seq_len)
+    g->max_total_steps = transformer->config.seq_len;
+
+  // icpp: forward the forced prompt tokens in batches, see forward_prefill.
+  //       These are the iterations of the main loop below that are followed
+  //       by a prompt token, so their logits are never used. The main loop
+  //       then only does the bookkeeping for them.
+  //       With attention sinks, the prompt tokens that do not fit in the kv
+  //       cache are forwarded one at a time by the main loop.
+  int *prompt_tokens = g->prompt_tokens;
+  int num_prefill = 0;
+  int room = generation_make_room(g, transformer, g->num_prompt_tokens - 1);
+  while (num_prefill < g->num_prompt_tokens - 1 &&
+         g->pos + num_prefill < g->max_total_steps - 1 && num_prefill < room) {
+    num_prefill++;
+    // the main loop stops when the forced token is BOS
+    if (prompt_tokens[num_prefill] == 1) break;
+  }
+  if (num_prefill > 0) {
+    // the first forwarded token is chat->next, not prompt_tokens[0]
+    prompt_tokens[0] = g->token;
+    // icpp: the rows of the tokens that follow a path of the prefix cache are
+    //       copied from it, and only the rest is forwarded. When the rows of
+    //       the chat are on the path too, its prompt extends the path.
+    generation_draft_fits(g, g->pos, num_prefill);
+    std::vector<int> prefix = generation_prefix(*g, num_prefill);
+    int n_path = 0;
+    int n_draft_path = 0;
+    if (!prefix.empty()) {
+      n_path = prefix_cache_match(prefix, g->pos, g->runstate,
+                                  g->draft_runstate, &n_draft_path);
+    }
+    int n_cached = std::max(n_path - g->pos, 0);
+    if (n_cached > 0) {
+      IC_API::debug_print("prefix cache: " + std::to_string(n_cached) +
+                          " of " + std::to_string(num_prefill) +
+                          " prompt tokens");
+    }
+    // the path may hold the rows of the draft for fewer tokens
+    int n_draft_cached = std::max(n_draft_path - g->pos, 0);
+    int n = num_prefill - n_cached;
+    int n_draft = num_prefill - n_draft_cached;
+    if ((n > 0 && !forward_prefill(g->runstate, chat, transformer,
+                                   prompt_tokens + n_cached, n,
+                                   g->pos + n_cached)) ||
+        (g->draft_runstate && n_draft > 0 &&
+         !forward_prefill(g->draft_runstate, chat, &draft_transformer,
+                          prompt_tokens + n_draft_cached, n_draft,
+                          g->pos + n_draft_cached))) {
+      *error = true;
+      return "Failed to allocate memory for forward_prefill.";
+    }
+    if (!prefix.empty() && n_path >= g->pos) {
+      prefix_cache_insert(prefix, g->runstate, g->draft_runstate);
+    }
+  }
+  g->num_prefill = num_prefill;
 
   // start the main loop
   chat->inference_steps = 0;
-  long start =
-      0;    // used to time our code, only initialized after first iteration
-  int next; // will store the next token in the sequence
+  chat->lookup_accepted = 0;
+  chat->lookup_rejected = 0;
   // icpp: use -1, so the exact prompt will be returned when steps is 0
   //       this is critical when building the prompt in multiple calls
-  // while (pos < chat->total_steps - 1) {
-  while (pos < max_total_steps - 1) {
+  g->done = !(g->pos < g->max_total_steps - 1);
+  return "";
+}
 
-    // forward the transformer to get logits for the next token
-    float *logits = forward(runstate, chat, transformer, token, pos);
+// Whether the current iteration of the main loop forwards the transformer
+// icpp: unless it was already forwarded by forward_prefill, and only
+//       compute the logits when they are used to sample the next token
+static bool generation_wants_forward(const Generation &g,
+                                     ForwardOptions *options) {
+  options->logits = g.prompt_pos >= g.num_prompt_tokens - 1 && g.steps != 0;
+  return g.prompt_pos >= g.num_prefill;
+}
+
+static void generation_push(Generation *g, Tokenizer *tokenizer, int next);
+
+// The rest of an iteration of the main loop, with the logits of the forward
+static void generation_advance(Generation *g, Tokenizer *tokenizer,
+                               float *logits) {
+  Chat *chat = g->chat;
+  int next; // will store the next token in the sequence
 
-    // increase our counts
-    chat->inference_steps++;
-    chat->total_steps++;
+  // increase our counts
+  chat->inference_steps++;
+  chat->total_steps++;
 
-    // advance the state state machine
-    if (prompt_pos < num_prompt_tokens - 1) {
-      // if we are still processing the input prompt, force the next prompt token
-      next = prompt_tokens[prompt_pos + 1];
-      prompt_pos++;
+  // advance the state state machine
+  if (g->prompt_pos < g->num_prompt_tokens - 1) {
+    // if we are still processing the input prompt, force the next prompt token
+    next = g->prompt_tokens[g->prompt_pos + 1];
+    g->prompt_pos++;
+  } else {
+    // icpp: stop if we have exhausted the prompt_tokens, and caller did not ask for
+    //       any additional steps to be generated
+    if (g->steps == 0) {
+      g->done = true;
+      return;
+    }
+    // otherwise sample the next token from the logits
+    next = sample(g->sampler, logits);
+  }
+  generation_push(g, tokenizer, next);
+}
+
+// Adds the next token to the sequence
+static void generation_push(Generation *g, Tokenizer *tokenizer, int next) {
+  Chat *chat = g->chat;
+  g->pos++;
+
+  // data-dependent terminating condition: the BOS (=1) token delimits sequences
+  if (next == 1) {
+    g->done = true;
+    return;
+  }
+
+  // print the token as string, decode it with the Tokenizer object
+  char *piece = decode(tokenizer, g->token, next);
+  g->output += safe_stringify(piece);
+
+  g->token = next;
+  if (g->token_history) g->token_history->push_back(next);
+
+  // safe state in the chat, used in follow-up calls to the endpoint
+  chat->next = next;
+  chat->pos = g->pos;
+
+  g->done = !(g->pos < g->max_total_steps - 1);
+}
+
+// icpp: speculative decoding. Several next tokens are proposed, and the model
+//       verifies them all with one forward_verify. They are proposed by:
+//       - the draft model, SPECULATIVE_DRAFT_TOKENS tokens, one at a time
+//       - prompt lookup, when the Prompt asks for it: the tokens that followed
+//         the last occurrence of the final n-gram in the chat's token history
+//       A proposed token is accepted with probability min(1, p/q), with p & q
+//       the probability of the model and of the proposal (q = 1 for prompt
+//       lookup). At the first rejection, the next token is sampled from
+//       max(0, p - q), normalized, so the tokens are distributed exactly as if
+//       the model had sampled them one by one. With greedy sampling, a token
+//       is accepted when it is the argmax of the model, and the output is the
+//       same as without speculation.
+#define SPECULATIVE_DRAFT_TOKENS 4
+#define NGRAM_LOOKUP_MAX_TOKENS 8 // most tokens proposed by prompt lookup
+#define NGRAM_LOOKUP_MAX_N 3      // longest n-gram that is matched
+#define NGRAM_LOOKUP_MIN_N 2      // shortest n-gram that is matched
+
+struct Speculation {
+  std::vector<int> tokens;   // the last token, and the proposed tokens
+  std::vector<float> q;      // (SPECULATIVE_DRAFT_TOKENS, vocab_size)
+  std::vector<float> logits; // (max proposed + 1, vocab_size)
+};
+
+// Proposes up to k tokens with the draft model, into tokens[1..k] & q
+static void generation_propose_draft(Generation *g, Speculation *spec, int k,
+                                     int vocab_size) {
+  Sampler *sampler = g->sampler;
+  bool greedy = sampler->temperature == 0.0f;
+  int *tokens = spec->tokens.data();
+  ForwardOptions with_logits{true};
+  for (int i = 0; i < k; i++) {
+    float *q = spec->q.data() + static_cast<size_t>(i) * vocab_size;
+    memcpy(q,
+           forward_with_options(g->draft_runstate, g->chat, &draft_transformer,
+                                tokens[i], g->pos + i, with_logits),
+           vocab_size * sizeof(float));
+    if (greedy) {
+      tokens[i + 1] = sample_argmax(q, vocab_size);
     } else {
-      // icpp: stop if we have exhausted the prompt_tokens, and caller did not ask for
-      //       any additional steps to be generated
-      if (steps == 0) {
-        break;
+      sampler_probabilities(sampler, q);
+      tokens[i + 1] =
+          sample_mult(q, vocab_size, random_f32(&sampler->rng_state));
+    }
+  }
+}
+
+// Proposes up to k tokens with prompt lookup, into tokens[1..], and returns
+// how many. The history ends with g->token.
+static int generation_propose_lookup(Generation *g, Speculation *spec, int k) {
+  const std::vector<int> &history = *g->token_history;
+  int size = static_cast<int>(history.size());
+  for (int n = std::min(NGRAM_LOOKUP_MAX_N, size - 1); n >= NGRAM_LOOKUP_MIN_N;
+       n--) {
+    const int *suffix = history.data() + size - n;
+    // the most recent earlier occurrence of the suffix
+    for (int i = size - n - 1; i >= 0; i--) {
+      if (!std::equal(suffix, suffix + n, history.data() + i)) continue;
+      int count = std::min(k, size - (i + n));
+      std::copy(history.data() + i + n, history.data() + i + n + count,
+                spec->tokens.data() + 1);
+      return count;
+    }
+  }
+  return 0;
+}
+
+// Verifies the k proposed tokens, and adds the accepted ones and the next
+// token to the sequence. Without q, the tokens were proposed with certainty.
+// Returns the number of accepted tokens, or -1 on error
+static int generation_verify(Generation *g, Transformer *transformer,
+                             Tokenizer *tokenizer, Speculation *spec, int k,
+                             const float *q_all) {
+  Sampler *sampler = g->sampler;
+  int vocab_size = transformer->config.vocab_size;
+  bool greedy = sampler->temperature == 0.0f;
+  int *tokens = spec->tokens.data();
+
+  // the model verifies them, in one pass
+  float *logits = spec->logits.data();
+  if (!forward_verify(g->runstate, transformer, tokens, k + 1, g->pos,
+                      logits)) {
+    return -1;
+  }
+
+  int n_accepted = 0;
+  int next = -1;
+  for (int i = 0; i < k && next < 0; i++) {
+    float *p = logits + static_cast<size_t>(i) * vocab_size;
+    const float *q = q_all ? q_all + static_cast<size_t>(i) * vocab_size
+                           : nullptr;
+    int proposed = tokens[i + 1];
+    if (greedy) {
+      int best = sample_argmax(p, vocab_size);
+      if (best == proposed) {
+        n_accepted++;
+      } else {
+        next = best;
       }
-      // otherwise sample the next token from the logits
-      next = sample(sampler, logits);
+      continue;
+    }
+    sampler_probabilities(sampler, p);
+    float q_proposed = q ? q[proposed] : 1.0f;
+    if (random_f32(&sampler->rng_state) * q_proposed < p[proposed]) {
+      n_accepted++;
+      continue;
+    }
+    // rejected: sample from the residual distribution
+    float sum = 0.0f;
+    for (int j = 0; j < vocab_size; j++) {
+      float q_j = q ? q[j] : (j == proposed ? 1.0f : 0.0f);
+      p[j] = std::max(0.0f, p[j] - q_j);
+      sum += p[j];
     }
-    pos++;
+    if (sum <= 0.0f) {
+      next = proposed; // p equals q, up to rounding
+      continue;
+    }
+    for (int j = 0; j < vocab_size; j++) p[j] /= sum;
+    next = sample_mult(p, vocab_size, random_f32(&sampler->rng_state));
+  }
+  if (next < 0) {
+    // all accepted: the model's logits after the last one give a token more
+    float *p = logits + static_cast<size_t>(k) * vocab_size;
+    if (greedy) {
+      next = sample_argmax(p, vocab_size);
+    } else {
+      sampler_probabilities(sampler, p);
+      next = sample_mult(p, vocab_size, random_f32(&sampler->rng_state));
+    }
+  }
 
-    // std::cout << "pos = " << pos << std::endl;
+  for (int i = 1; i <= n_accepted + 1 && !g->done; i++) {
+    g->chat->inference_steps++;
+    g->chat->total_steps++;
+    generation_push(g, tokenizer, i <= n_accepted ? tokens[i] : next);
+  }
+  return n_accepted;
+}
 
-    // data-dependent terminating condition: the BOS (=1) token delimits sequences
-    if (next == 1) {
-      break;
+// One round of speculative decoding, when the next token is sampled.
+// Returns false when nothing was proposed, and the main loop must do a
+// regular iteration.
+static bool generation_speculate(Generation *g, Transformer *transformer,
+                                 Tokenizer *tokenizer, Speculation *spec,
+                                 bool *error) {
+  int max_proposed = static_cast<int>(spec->tokens.size()) - 1;
+  int room = generation_make_room(g, transformer, max_proposed + 1);
+  int n_left = std::min(static_cast<int>(g->max_total_steps) - 1 - g->pos,
+                        room);
+  int vocab_size = transformer->config.vocab_size;
+  int pos = g->pos;
+  spec->tokens[0] = g->token;
+
+  // every proposed token costs a position of forward_verify, so prompt lookup
+  // starts with 1 token, and proposes twice as many after a round that was
+  // accepted in full, up to ngram_lookup. A rejection falls back to the
+  // accepted tokens plus one.
+  int k = std::min(g->lookup_tokens, n_left - 1);
+  if (k > 0) {
+    k = generation_propose_lookup(g, spec, k);
+    if (k > 0) {
+      int n_accepted =
+          generation_verify(g, transformer, tokenizer, spec, k, nullptr);
+      if (n_accepted < 0) {
+        *error = true;
+        return true;
+      }
+      g->chat->lookup_accepted += n_accepted;
+      g->chat->lookup_rejected += k - n_accepted;
+      g->lookup_tokens = n_accepted == k
+                             ? std::min(2 * k, g->ngram_lookup)
+                             : std::max(n_accepted, 1);
+      // keep the kv cache of the draft in sync
+      if (generation_draft_fits(g, pos, n_accepted + 1) &&
+          !forward_prefill(g->draft_runstate, g->chat, &draft_transformer,
+                           spec->tokens.data(), n_accepted + 1, pos)) {
+        *error = true;
+      }
+      return true;
     }
+  }
 
-    // print the token as string, decode it with the Tokenizer object
-    char *piece = decode(tokenizer, token, next);
-    // safe_printf(piece); // same as printf("%s", piece), but skips "unsafe" bytes
-    output += safe_stringify(piece);
+  if (!g->draft_runstate) return false;
+  k = std::min(SPECULATIVE_DRAFT_TOKENS, n_left - 1);
+  if (k < 1) return false;
+  // the draft forwards [pos, pos + k), and pos + k when all are accepted
+  if (!generation_draft_fits(g, pos, k + 1)) return false;
+  generation_propose_draft(g, spec, k, vocab_size);
+  int n_accepted =
+      generation_verify(g, transformer, tokenizer, spec, k, spec->q.data());
+  if (n_accepted < 0) {
+    *error = true;
+    return true;
+  }
+  if (n_accepted == k) {
+    // keep the kv cache of the draft in sync
+    ForwardOptions no_logits{false};
+    forward_with_options(g->draft_runstate, g->chat, &draft_transformer,
+                         spec->tokens[k], pos + k, no_logits);
+  }
+  return true;
+}
 
-    // fflush(stdout);
-    token = next;
+// icpp: when compiled with -DPAGE_STATS, prints the 4 KiB pages of the weights
+//       & the kv cache touched per forward pass since the last print
+static void debug_print_page_stats() {
+  PageStats stats;
+  if (!page_stats(&stats, true) || stats.passes == 0) return;
+  IC_API::debug_print(
+      "pages touched per forward pass: " +
+      std::to_string(stats.weight_pages / stats.passes) + " of the weights, " +
+      std::to_string(stats.kv_cache_pages / stats.passes) +
+      " of the kv cache (" + std::to_string(stats.passes) + " passes, " +
+      std::to_string(stats.tokens) + " tokens)");
+}
 
-    // safe state in the chat, used in follow-up calls to the endpoint
-    chat->next = next;
-    chat->pos = pos;
+// Copied from run.c and modified slightly
+// icpp: with a draft_runstate or ngram_lookup > 0, the tokens are sampled
+//       with speculative decoding, see generation_speculate. The draft must be
+//       in sync with the chat, and is then kept in sync. The token_history of
+//       the chat is extended with the new tokens.
+std::string generate(IC_API ic_api, RunState *runstate,
+                     RunState *draft_runstate, Chat *chat,
+                     std::vector<int> *token_history,
+                     Transformer *transformer, Tokenizer *tokenizer,
+                     Sampler *sampler, std::string prompt, int steps,
+                     int ngram_lookup, int attention_sinks, bool *error) {
+  if (!draft_model_ready || chat->draft_pos != chat->pos) {
+    draft_runstate = nullptr;
+  }
+  if (token_history && static_cast<int>(token_history->size()) != chat->pos) {
+    token_history = nullptr; // eg. a chat from before the token history
+  }
+  Generation g;
+  g.runstate = runstate;
+  g.draft_runstate = draft_runstate;
+  g.chat = chat;
+  g.sampler = sampler;
+  g.token_history = token_history;
+  g.ngram_lookup = token_history ? ngram_lookup : 0;
+  g.lookup_tokens = std::min(g.ngram_lookup, 1);
+  g.attention_sinks = attention_sinks;
+  std::string error_msg =
+      generation_start(&g, transformer, tokenizer, prompt, steps, error);
+  if (*error) {
+    free(g.prompt_tokens);
+    return error_msg;
+  }
 
-    // init the timer here because the first iteration can be slower
-    // if (start == 0) { start = time_in_ms(); }
+  Speculation spec;
+  bool speculate = draft_runstate || g.ngram_lookup > 0;
+  if (speculate) {
+    size_t vocab_size = transformer->config.vocab_size;
+    size_t max_proposed = std::max(SPECULATIVE_DRAFT_TOKENS, g.ngram_lookup);
+    spec.tokens.resize(max_proposed + 1);
+    if (draft_runstate) spec.q.resize(SPECULATIVE_DRAFT_TOKENS * vocab_size);
+    spec.logits.resize((max_proposed + 1) * vocab_size);
   }
 
-  // printf("\n");
-  // output += "\n"; // icpp: don't do this... we're continuining in next call
+  while (!g.done) {
+    // forward the transformer to get logits for the next token
+    float *logits = nullptr;
+    ForwardOptions options;
+    if (generation_wants_forward(g, &options)) {
+      if (options.logits && speculate &&
+          generation_speculate(&g, transformer, tokenizer, &spec, error)) {
+        if (*error) {
+          free(g.prompt_tokens);
+          return "Failed to allocate memory for forward_verify.";
+        }
+        continue;
+      }
+      generation_make_room(&g, transformer, 1);
+      logits = forward_with_options(runstate, chat, transformer, g.token,
+                                    g.pos, options);
+      if (generation_draft_fits(&g, g.pos, 1)) {
+        ForwardOptions no_logits{false};
+        forward_with_options(g.draft_runstate, chat, &draft_transformer,
+                             g.token, g.pos, no_logits);
+      }
+    }
+    generation_advance(&g, tokenizer, logits);
+  }
+  if (g.draft_runstate) {
+    chat->draft_pos = chat->pos;
+  }
+  if (chat->lookup_accepted + chat->lookup_rejected > 0) {
+    IC_API::debug_print("prompt lookup: accepted " +
+                        std::to_string(chat->lookup_accepted) +
+                        " and rejected " +
+                        std::to_string(chat->lookup_rejected) +
+                        " proposed tokens");
+  }
+  debug_print_page_stats();
 
-  // report achieved tok/s (pos-1 because the timer starts after first iteration)
-  // if (pos > 1) {
-  //     long end = time_in_ms();
-  //     fprintf(stderr, "achieved tok/s: %f\n", (pos-1) / (double)(end-start)*1000);
-  // }
+  free(g.prompt_tokens);
+  return g.output;
+}
 
-  free(prompt_tokens);
+// icpp: generate for several stories at once. In every iteration, the stories
+//       that sample their next token are forwarded together with forward_batch,
+//       so the weights are read once for all of them. The output of every story
+//       is the same as with generate.
+static std::vector<std::string>
+generate_batch(std::vector<Generation> &gens, Transformer *transformer,
+               Tokenizer *tokenizer, const std::vector<std::string> &prompts,
+               const std::vector<int> &steps, bool *error) {
+  std::vector<std::string> outputs(gens.size());
+  *error = false;
+  for (size_t i = 0; i < gens.size() && !*error; ++i) {
+    std::string error_msg = generation_start(&gens[i], transformer, tokenizer,
+                                             prompts[i], steps[i], error);
+    if (*error) outputs = {error_msg};
+  }
 
-  return output;
+  std::vector<Generation *> batch;
+  std::vector<RunState *> states;
+  std::vector<int> tokens;
+  std::vector<int> positions;
+  bool busy = !*error;
+  while (busy) {
+    busy = false;
+    batch.clear();
+    states.clear();
+    tokens.clear();
+    positions.clear();
+    for (Generation &g : gens) {
+      if (g.done) continue;
+      busy = true;
+      ForwardOptions options;
+      if (generation_wants_forward(g, &options)) {
+        generation_make_room(&g, transformer, 1);
+        if (options.logits) {
+          batch.push_back(&g);
+          states.push_back(g.runstate);
+          tokens.push_back(g.token);
+          positions.push_back(g.pos);
+          continue;
+        }
+        // a forced prompt token: only fills the kv cache
+        forward_with_options(g.runstate, g.chat, transformer, g.token, g.pos,
+                             options);
+      }
+      generation_advance(&g, tokenizer, nullptr);
+    }
+    if (batch.empty()) continue;
+    if (!forward_batch(states.data(), transformer, tokens.data(),
+                       positions.data(), batch.size())) {
+      *error = true;
+      outputs = {"Failed to allocate memory for forward_batch."};
+      break;
+    }
+    for (Generation *g : batch) {
+      generation_advance(g, tokenizer, g->runstate->logits);
+    }
+  }
+
+  for (size_t i = 0; i < gens.size(); ++i) {
+    free(gens[i].prompt_tokens);
+    gens[i].prompt_tokens = nullptr;
+    if (!*error) outputs[i] = gens[i].output;
+  }
+  debug_print_page_stats();
+  return outputs;
 }
 
 // Inference endpoint for ICGPT, with story ownership based on principal of caller
@@ -209,7 +724,13 @@ void inference_(bool from_motoko) {
     r_in.append("topp", CandidTypeFloat32{&wire_prompt.topp});
   }
   r_in.append("rng_seed", CandidTypeNat64{&wire_prompt.rng_seed});
+  std::optional<uint64_t> ngram_lookup;
+  r_in.append("ngram_lookup", CandidTypeOptNat64{&ngram_lookup});
+  std::optional<uint64_t> attention_sinks;
+  r_in.append("attention_sinks", CandidTypeOptNat64{&attention_sinks});
   ic_api.from_wire(r_in);
+  wire_prompt.ngram_lookup = ngram_lookup.value_or(0);
+  wire_prompt.attention_sinks = attention_sinks.value_or(0);
 
   if (from_motoko) {
     wire_prompt.temperature =
@@ -241,7 +762,9 @@ void inference_(bool from_motoko) {
   if (!load_runstate(principal, ic_api)) return;
 
   bool error{false};
-  std::string output = do_inference(ic_api, wire_prompt, p_runstate, chat,
+  std::vector<int> *token_history = &p_chats_token_history->umap[principal];
+  std::string output = do_inference(ic_api, wire_prompt, p_runstate,
+                                    p_draft_runstate, chat, token_history,
                                     output_history, metadata_user, &error);
 
   if (error) {
@@ -251,7 +774,7 @@ void inference_(bool from_motoko) {
   }
 
   // --------------------------------------------------------------------------
-  // save the chat data to file & free it from OP memory
+  // save the run state, in memory or to file, see RunStatePool
   if (!save_runstate(principal, ic_api)) return;
 
   // IC_API::debug_print(output);
@@ -262,16 +785,47 @@ void inference_(bool from_motoko) {
   ic_api.to_wire(CandidTypeVariant{"Ok", CandidTypeRecord{inference_record}});
 }
 
+// parameter validation/overrides
+static void validate_prompt(IC_API &ic_api, Prompt *wire_prompt) {
+  if (wire_prompt->rng_seed <= 0)
+    wire_prompt->rng_seed = ic_api.time(); // time in ns
+  if (wire_prompt->temperature < 0.0) wire_prompt->temperature = 0.0;
+  if (wire_prompt->topp < 0.0 || 1.0 < wire_prompt->topp)
+    wire_prompt->topp = 0.9;
+  if (wire_prompt->steps < 0) wire_prompt->steps = 0;
+  if (wire_prompt->ngram_lookup > NGRAM_LOOKUP_MAX_TOKENS)
+    wire_prompt->ngram_lookup = NGRAM_LOOKUP_MAX_TOKENS;
+  // keep at least half of the kv cache for the rolling window
+  uint64_t max_attention_sinks =
+      static_cast<uint64_t>(transformer.config.seq_len / 2);
+  if (wire_prompt->attention_sinks > max_attention_sinks)
+    wire_prompt->attention_sinks = max_attention_sinks;
+}
+
+// Update & persist full output using Orthogonal Persistence
+static void save_output(const std::string &output, Chat *chat,
+                        std::string *output_history,
+                        MetadataUser *metadata_user) {
+  *output_history += output;
+
+  // Now we have the total_steps, stored with the chat
+  // And we can update the metadata_user
+  if (!metadata_user->metadata_chats.empty()) {
+    MetadataChat &metadata_chat = metadata_user->metadata_chats.back();
+    metadata_chat.total_steps += chat->total_steps;
+    metadata_chat.lookup_accepted += chat->lookup_accepted;
+    metadata_chat.lookup_rejected += chat->lookup_rejected;
+  }
+}
+
 std::string do_inference(IC_API &ic_api, Prompt wire_prompt, RunState *runstate,
-                         Chat *chat, std::string *output_history,
+                         RunState *draft_runstate, Chat *chat,
+                         std::vector<int> *token_history,
+                         std::string *output_history,
                          MetadataUser *metadata_user, bool *error) {
 
   // parameter validation/overrides
-  if (wire_prompt.rng_seed <= 0)
-    wire_prompt.rng_seed = ic_api.time(); // time in ns
-  if (wire_prompt.temperature < 0.0) wire_prompt.temperature = 0.0;
-  if (wire_prompt.topp < 0.0 || 1.0 < wire_prompt.topp) wire_prompt.topp = 0.9;
-  if (wire_prompt.steps < 0) wire_prompt.steps = 0;
+  validate_prompt(ic_api, &wire_prompt);
 
   // icpp: if caller provides a prompt , set bos & eos
   // if (wire_prompt.prompt.size() > 0) {
@@ -295,8 +849,10 @@ std::string do_inference(IC_API &ic_api, Prompt wire_prompt, RunState *runstate,
   // run!
   std::string output;
   // if (mode == "generate") {
-  output += generate(ic_api, runstate, chat, &transformer, &tokenizer, &sampler,
-                     wire_prompt.prompt, wire_prompt.steps, error);
+  output += generate(ic_api, runstate, draft_runstate, chat, token_history,
+                     &transformer, &tokenizer, &sampler, wire_prompt.prompt,
+                     wire_prompt.steps, wire_prompt.ngram_lookup,
+                     wire_prompt.attention_sinks, error);
   // } else if (mode =="chat") {
   // chat(&transformer, &tokenizer, &sampler, prompt, system_prompt, steps);
   // } else {
@@ -304,15 +860,7 @@ std::string do_inference(IC_API &ic_api, Prompt wire_prompt, RunState *runstate,
   // }
 
   if (!*error) {
-    // Update & persist full output using Orthogonal Persistence
-    *output_history += output;
-
-    // Now we have the total_steps, stored with the chat
-    // And we can update the metadata_user
-    if (!metadata_user->metadata_chats.empty()) {
-      MetadataChat &metadata_chat = metadata_user->metadata_chats.back();
-      metadata_chat.total_steps += chat->total_steps;
-    }
+    save_output(output, chat, output_history, metadata_user);
   }
 
   // memory and file handles cleanup
@@ -320,3 +868,53 @@ std::string do_inference(IC_API &ic_api, Prompt wire_prompt, RunState *runstate,
 
   return output;
 }
+
+// icpp: do_inference for several stories at once, see generate_batch.
+//       The generated sections go into stories[i].output.
+//       Returns the error message, with *error set to true
+std::string do_inference_batch(IC_API &ic_api,
+                               std::vector<StoryInference> &stories,
+                               bool *error) {
+  size_t n = stories.size();
+  std::vector<Sampler> samplers(n);
+  std::vector<Generation> gens(n);
+  std::vector<std::string> prompts(n);
+  std::vector<int> steps(n);
+  for (size_t i = 0; i < n; ++i) {
+    Prompt &wire_prompt = stories[i].wire_prompt;
+    validate_prompt(ic_api, &wire_prompt);
+    build_sampler(&samplers[i], transformer.config.vocab_size,
+                  wire_prompt.temperature, wire_prompt.topp,
+                  wire_prompt.rng_seed);
+    gens[i].runstate = stories[i].runstate;
+    gens[i].chat = stories[i].chat;
+    gens[i].sampler = &samplers[i];
+    gens[i].attention_sinks = wire_prompt.attention_sinks;
+    std::vector<int> *token_history = stories[i].token_history;
+    if (token_history &&
+        static_cast<int>(token_history->size()) == stories[i].chat->pos) {
+      gens[i].token_history = token_history;
+    }
+    prompts[i] = wire_prompt.prompt;
+    steps[i] = wire_prompt.steps;
+  }
+
+  std::vector<std::string> outputs =
+      generate_batch(gens, &transformer, &tokenizer, prompts, steps, error);
+
+  std::string error_msg;
+  if (*error) {
+    error_msg = outputs[0];
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      stories[i].output = outputs[i];
+      save_output(outputs[i], stories[i].chat, stories[i].output_history,
+                  stories[i].metadata_user);
+    }
+  }
+
+  for (Sampler &sampler : samplers) {
+    free_sampler(&sampler);
+  }
+  return error_msg;
+}
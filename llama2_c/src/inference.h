@@ -2,6 +2,7 @@
 
 #include "wasm_symbol.h"
 #include <string>
+#include <vector>
 #include "ic_api.h"
 #include "chats.h"
 #include "prompt.h"
@@ -10,6 +11,23 @@ void inference() WASM_SYMBOL_EXPORTED("canister_update inference");
 void inference_mo() WASM_SYMBOL_EXPORTED("canister_update inference_mo");
 
 void inference_(bool from_motoko);
+// draft_runstate: for speculative decoding with the draft model, or nullptr
 std::string do_inference(IC_API &ic_api, Prompt wire_prompt, RunState *runstate,
-                         Chat *chat, std::string *output_history,
+                         RunState *draft_runstate, Chat *chat,
+                         std::vector<int> *token_history,
+                         std::string *output_history,
                          MetadataUser *metadata_user, bool *error);
+
+// One story of do_inference_batch
+struct StoryInference {
+  Prompt wire_prompt;
+  RunState *runstate{nullptr};
+  Chat *chat{nullptr};
+  std::vector<int> *token_history{nullptr};
+  std::string *output_history{nullptr};
+  MetadataUser *metadata_user{nullptr};
+  std::string output; // the section of the story generated by this call
+};
+std::string do_inference_batch(IC_API &ic_api,
+                               std::vector<StoryInference> &stories,
+                               bool *error);
@@ -11,13 +11,16 @@
 #include "chats.h"
 #include "http.h"
 #include "ic_api.h"
+#include "prefix_cache.h"
 #include "upload.h"
 
 #include "run.h"
 
 // Orthogonally persisted model data
 Transformer transformer;
+Transformer draft_transformer;
 Tokenizer tokenizer;
+KVCacheType kv_cache_type{KV_CACHE_FP32};
 
 // -----------------------------------------------------------------------
 
@@ -148,8 +151,21 @@ bool build_tokenizer(Tokenizer *t, int vocab_size, IC_API &ic_api) {
 // - read_checkpoint
 // - build_transformer
 // - free_transformer
-// Modified to read the data from the uploaded tok4096.bin bytes
-void read_checkpoint(Config *config, TransformerWeights *weights) {
+// Modified to read the data from the uploaded model bytes, of the model or of
+// the draft model
+// Supported checkpoint formats:
+// - legacy (export.py --version 0): Config header, fp32 weights
+// - ak42 version 2 (export.py --version 2): 256 byte header, Q8_0 weights
+// - ak42 version 3 (scripts/quantize_model.py): 256 byte header, Q4_1 weights
+// - ak42 version 4 & 5 (scripts/quantize_model.py): 256 byte header, fp16 &
+//   bf16 weights, widened to fp32 inside the matmuls
+bool read_checkpoint(Config *config, TransformerWeights *weights,
+                     ModelBytes *model_bytes, std::string *error_msg) {
+  if (!model_bytes or (model_bytes && model_bytes->vec.size() == 0)) {
+    *error_msg = "ERROR: " + std::string(__func__) +
+                 " model bytes were not yet uploaded!";
+    return false;
+  }
   // FILE *file = fopen(checkpoint, "rb");
   // if (!file) {
   //   fprintf(stderr, "Couldn't open file %s\n", checkpoint);
@@ -159,9 +175,60 @@ void read_checkpoint(Config *config, TransformerWeights *weights) {
   // if (fread(config, sizeof(Config), 1, file) != 1) {
   //   exit(EXIT_FAILURE);
   // }
-  // Copy the data into config
-  int *data = reinterpret_cast<int *>(p_model_bytes->vec.data());
-  memcpy(config, data, sizeof(Config));
+  uint8_t *bytes = model_bytes->vec.data();
+  size_t file_size = model_bytes->vec.size();
+
+  // The ak42 header of export.py starts with a magic number & a version
+  uint32_t magic_number = 0;
+  int version = 0;
+  if (file_size >= CHECKPOINT_HEADER_SIZE) {
+    memcpy(&magic_number, bytes, sizeof(uint32_t));
+    memcpy(&version, bytes + sizeof(uint32_t), sizeof(int));
+  }
+
+  uint8_t shared_classifier = 0;
+  int group_size = 0;
+  WeightType weight_type = WEIGHT_TYPE_FP32;
+  uint8_t *weights_ptr = nullptr;
+  if (magic_number == CHECKPOINT_MAGIC) {
+    if (version == 2) {
+      weight_type = WEIGHT_TYPE_Q8_0;
+    } else if (version == 3) {
+      weight_type = WEIGHT_TYPE_Q4_1;
+    } else if (version == 4) {
+      weight_type = WEIGHT_TYPE_F16;
+    } else if (version == 5) {
+      weight_type = WEIGHT_TYPE_BF16;
+    } else {
+      *error_msg =
+          "ERROR: " + std::string(__func__) +
+          " unsupported checkpoint version " + std::to_string(version) +
+          ". Use the legacy fp32 format, Q8_0 (version 2), Q4_1 (version 3),"
+          " fp16 (version 4) or bf16 (version 5).";
+      return false;
+    }
+    // Copy the data into config
+    // The group_size is not aligned in the header, so memcpy it
+    uint8_t *header = bytes + sizeof(uint32_t) + sizeof(int);
+    memcpy(config, header, sizeof(Config));
+    header += sizeof(Config);
+    memcpy(&shared_classifier, header, sizeof(uint8_t));
+    header += sizeof(uint8_t);
+    memcpy(&group_size, header, sizeof(int));
+    weights_ptr = bytes + CHECKPOINT_HEADER_SIZE;
+  } else {
+    if (file_size < sizeof(Config)) {
+      *error_msg = "ERROR: " + std::string(__func__) +
+                   " model bytes are too small to hold a Config.";
+      return false;
+    }
+    // Copy the data into config
+    memcpy(config, bytes, sizeof(Config));
+    // negative vocab size is hacky way of signaling unshared weights. bit yikes.
+    shared_classifier = config->vocab_size > 0 ? 1 : 0;
+    config->vocab_size = abs(config->vocab_size);
+    weights_ptr = bytes + sizeof(Config);
+  }
 
   IC_API::debug_print("-------------------------------------");
   IC_API::debug_print("config.dim        = " + std::to_string(config->dim));
@@ -175,11 +242,21 @@ void read_checkpoint(Config *config, TransformerWeights *weights) {
   IC_API::debug_print("config.vocab_size = " +
                       std::to_string(config->vocab_size));
   IC_API::debug_print("config.seq_len    = " + std::to_string(config->seq_len));
+  IC_API::debug_print("weight format     = " +
+                      std::string(weight_type_name(weight_type)));
+  IC_API::debug_print("group_size        = " + std::to_string(group_size));
   IC_API::debug_print("-------------------------------------");
 
-  // negative vocab size is hacky way of signaling unshared weights. bit yikes.
-  int shared_weights = config->vocab_size > 0 ? 1 : 0;
-  config->vocab_size = abs(config->vocab_size);
+  if (config->dim <= 0 or config->hidden_dim <= 0 or config->n_layers <= 0 or
+      config->n_heads <= 0 or config->n_kv_heads <= 0 or
+      config->vocab_size <= 0 or config->seq_len <= 0 or
+      config->dim % config->n_heads != 0 or
+      config->n_heads % config->n_kv_heads != 0) {
+    *error_msg =
+        "ERROR: " + std::string(__func__) + " the model config is not valid.";
+    return false;
+  }
+
   // // figure out the file size
   // fseek(file, 0, SEEK_END); // move file pointer to end of file
   // *file_size = ftell(file); // get the file size, in bytes
@@ -196,23 +273,141 @@ void read_checkpoint(Config *config, TransformerWeights *weights) {
   //   exit(EXIT_FAILURE);
   // }
   // float *weights_ptr = *data + sizeof(Config) / sizeof(float);
-  // Copy the data into weights
-  float *weights_ptr =
-      reinterpret_cast<float *>(data + sizeof(Config) / sizeof(int));
-
-  memory_map_weights(weights, config, weights_ptr, shared_weights);
+  bool half = weight_type == WEIGHT_TYPE_F16 or weight_type == WEIGHT_TYPE_BF16;
+  if (half) {
+    // Verify that the uploaded bytes hold all the weights, before mapping
+    size_t weights_size =
+        checkpoint_weights_size_half(config, shared_classifier);
+    if (CHECKPOINT_HEADER_SIZE + weights_size > file_size) {
+      *error_msg =
+          "ERROR: " + std::string(__func__) + " expected " +
+          std::to_string(CHECKPOINT_HEADER_SIZE + weights_size) +
+          " model bytes for this " + weight_type_name(weight_type) +
+          " checkpoint, but got " + std::to_string(file_size);
+      return false;
+    }
+    // The 16-bit weights stay in the model bytes
+    memory_map_weights_half(weights, config, weights_ptr, shared_classifier,
+                            weight_type);
+  } else if (magic_number == CHECKPOINT_MAGIC) {
+    // The quantized matmuls run over whole groups, and Q4_1 packs the values
+    // of a group in pairs
+    if (group_size <= 0 or config->dim % group_size != 0 or
+        config->hidden_dim % group_size != 0 or
+        (weight_type == WEIGHT_TYPE_Q4_1 and group_size % 2 != 0)) {
+      *error_msg =
+          "ERROR: " + std::string(__func__) + " group_size " +
+          std::to_string(group_size) + " must divide dim (" +
+          std::to_string(config->dim) + ") and hidden_dim (" +
+          std::to_string(config->hidden_dim) + ")";
+      if (weight_type == WEIGHT_TYPE_Q4_1) *error_msg += " and must be even";
+      return false;
+    }
+    // Verify that the uploaded bytes hold all the weights, before mapping
+    size_t weights_size = checkpoint_weights_size_quantized(
+        config, shared_classifier, group_size, weight_type);
+    if (CHECKPOINT_HEADER_SIZE + weights_size > file_size) {
+      *error_msg =
+          "ERROR: " + std::string(__func__) + " expected " +
+          std::to_string(CHECKPOINT_HEADER_SIZE + weights_size) +
+          " model bytes for this " + weight_type_name(weight_type) +
+          " checkpoint, but got " + std::to_string(file_size);
+      return false;
+    }
+    if (!memory_map_weights_quantized(weights, config, weights_ptr,
+                                      shared_classifier, group_size,
+                                      weight_type)) {
+      *error_msg = "Failed to allocate memory for quantized weights.";
+      return false;
+    }
+  } else {
+    // Verify that the uploaded bytes hold all the weights, before mapping
+    size_t weights_size =
+        checkpoint_weights_size_fp32(config, shared_classifier);
+    if (sizeof(Config) + weights_size > file_size) {
+      *error_msg =
+          "ERROR: " + std::string(__func__) + " expected " +
+          std::to_string(sizeof(Config) + weights_size) +
+          " model bytes for this fp32 checkpoint, but got " +
+          std::to_string(file_size);
+      return false;
+    }
+    // Copy the data into weights
+    memory_map_weights(weights, config, reinterpret_cast<float *>(weights_ptr),
+                       shared_classifier);
+  }
+  if (weight_type == WEIGHT_TYPE_FP32 or half) {
+    // Fuse wq, wk & wv into one block per layer. The bytes are repacked in
+    // place, so only the first call to initialize does the repacking.
+    if (!fuse_qkv_weights(weights, config, !model_bytes->qkv_fused)) {
+      *error_msg = "Failed to allocate memory for repacking wqkv.";
+      return false;
+    }
+    model_bytes->qkv_fused = true;
+    // Fuse w1 & w3 into one block per layer, with interleaved rows
+    if (!fuse_w13_weights(weights, config, !model_bytes->w13_fused)) {
+      *error_msg = "Failed to allocate memory for repacking w13.";
+      return false;
+    }
+    model_bytes->w13_fused = true;
+    // Repack the weights of each layer into one block, when compiled with
+    // -DLAYER_MAJOR_WEIGHTS, in place as well
+    if (!layer_major_weights(weights, config, !model_bytes->layer_major)) {
+      *error_msg =
+          "Failed to allocate memory for repacking the weights layer-major.";
+      return false;
+    }
+    model_bytes->layer_major = true;
+    if (weights->layer_stride > 0) {
+      IC_API::debug_print("weights layer-major, " +
+                          std::to_string(weights->layer_stride) +
+                          " values per layer");
+    }
+    // Repack the matmul weights into panels of 4 rows, when compiled with
+    // -DWEIGHT_PANELS, in place as well
+    if (!model_bytes->panels && !repack_weight_panels(weights, config)) {
+      *error_msg =
+          "Failed to allocate memory for repacking the weights into panels.";
+      return false;
+    }
+    model_bytes->panels = true;
+    if (weight_panel_width() > 0) {
+      IC_API::debug_print("matmul weights in panels of 4 rows x " +
+                          std::to_string(weight_panel_width()) + " columns");
+    }
+  }
+  return true;
 }
 
-bool build_transformer(Transformer *t) {
+bool build_transformer(Transformer *t, ModelBytes *model_bytes,
+                       RunState *runstate, std::string *error_msg) {
   // read in the Config and the Weights from the checkpoint
-  read_checkpoint(&t->config, &t->weights);
+  if (!read_checkpoint(&t->config, &t->weights, model_bytes, error_msg))
+    return false;
+
+  // icpp: the RoPE rotation only depends on the config, not on the user
+  if (!build_rope_tables(t)) {
+    *error_msg = "Failed to allocate memory for the RoPE tables.";
+    return false;
+  }
+
+  // icpp: a forward specialized for the shape of the model, if there is one
+  t->forward_shape = select_forward_shape(&t->config);
+  std::cout << "initialize.cpp - build_transformer: using the "
+            << forward_shape_name(t->forward_shape) << " forward\n";
+  std::cout << "initialize.cpp - build_transformer: "
+            << kv_cache_bytes(&t->config, kv_cache_type)
+            << " bytes of kv cache per user, as "
+            << kv_cache_type_name(kv_cache_type) << "\n";
 
   // icpp: moved into build_active_chat
   // // allocate the RunState buffers
   // malloc_run_state(&t->state, &t->config);
   std::cout
       << "initialize.cpp - build_transform: calling malloc_run_state for p_runstate";
-  malloc_run_state(p_runstate, &t->config);
+  // icpp: initialize may be called again, eg. after set_kv_cache_type
+  free_run_state(runstate);
+  malloc_run_state(runstate, &t->config);
 
   // //icpp: initialize the token generation settings
   // reset_tokens(t);
@@ -220,13 +415,59 @@ bool build_transformer(Transformer *t) {
   return true;
 }
 
+// The optional draft model for speculative decoding. It proposes the tokens
+// that the model verifies, so it must use the same tokenizer. A draft with a
+// shorter seq_len drops out of sync with a story at its seq_len, see
+// generation_draft_fits. A draft that can not be used only logs a warning:
+// the model serves without it.
+void build_draft_transformer() {
+  draft_model_ready = false;
+  if (!p_draft_model_bytes or p_draft_model_bytes->vec.size() == 0) {
+    return;
+  }
+  free_run_state(p_draft_runstate);
+  std::string error_msg;
+  if (!build_transformer(&draft_transformer, p_draft_model_bytes,
+                         p_draft_runstate, &error_msg)) {
+    IC_API::debug_print("WARNING: " + std::string(__func__) +
+                        " continuing without the draft model: " + error_msg);
+    return;
+  }
+  if (draft_transformer.config.vocab_size != transformer.config.vocab_size) {
+    IC_API::debug_print(
+        "WARNING: " + std::string(__func__) +
+        " continuing without the draft model: its vocab_size (" +
+        std::to_string(draft_transformer.config.vocab_size) +
+        ") differs from the vocab_size of the model (" +
+        std::to_string(transformer.config.vocab_size) + ")");
+    return;
+  }
+  draft_model_ready = true;
+}
+
 void initialize() {
   IC_API ic_api(CanisterUpdate{std::string(__func__)}, false);
   if (!is_canister_owner(ic_api, true)) return;
 
-  build_transformer(&transformer);
+  // The RunStates are reallocated for the new model, so the pool writes the
+  // ones it holds in memory to the RunStateStore
+  if (!clear_runstate_pool()) {
+    IC_API::debug_print("WARNING: " + std::string(__func__) +
+                        " could not write every RunState in memory to the store");
+  }
+  // The kv cache rows of the prefix cache only fit the previous model
+  clear_prefix_cache();
+
+  std::string error_msg;
+  if (!build_transformer(&transformer, p_model_bytes, p_runstate,
+                         &error_msg)) {
+    ic_api.to_wire(CandidTypeVariant{
+        "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+    return;
+  }
   if (!build_tokenizer(&tokenizer, transformer.config.vocab_size, ic_api))
     return;
+  build_draft_transformer();
 
   ready_for_inference = true;
 
@@ -246,6 +487,10 @@ void print_config() {
   msg += "\nconfig.n_kv_heads      = " + std::to_string(config.n_kv_heads);
   msg += "\nconfig.vocab_size      = " + std::to_string(config.vocab_size);
   msg += "\nconfig.seq_len         = " + std::to_string(config.seq_len);
+  msg += "\nweight_format          = " +
+         std::string(weight_type_name(transformer.weights.weight_type));
+  msg += "\ngroup_size             = " +
+         std::to_string(transformer.weights.group_size);
   IC_API::debug_print(msg);
 }
 
@@ -265,5 +510,9 @@ void get_model_config() {
   r_out.append("n_kv_heads", CandidTypeInt{config.n_kv_heads});
   r_out.append("vocab_size", CandidTypeInt{config.vocab_size});
   r_out.append("seq_len", CandidTypeInt{config.seq_len});
+  r_out.append("weight_format",
+               CandidTypeText{std::string(
+                   weight_type_name(transformer.weights.weight_type))});
+  r_out.append("group_size", CandidTypeInt{transformer.weights.group_size});
   ic_api.to_wire(r_out);
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 // Maintain one chat per user (principal) in Orthogonal Persistence
 #include <iostream>
+#include <optional>
 
 #include "nft_collection.h"
 #include "canister.h"
@@ -330,6 +331,10 @@ void nft_story_(bool story_start, bool from_motoko) {
     r_in2.append("topp", CandidTypeFloat32{&wire_prompt.topp});
   }
   r_in2.append("rng_seed", CandidTypeNat64{&wire_prompt.rng_seed});
+  std::optional<uint64_t> ngram_lookup;
+  r_in2.append("ngram_lookup", CandidTypeOptNat64{&ngram_lookup});
+  std::optional<uint64_t> attention_sinks;
+  r_in2.append("attention_sinks", CandidTypeOptNat64{&attention_sinks});
 
   CandidArgs args;
   args.append(r_in1);
@@ -341,6 +346,8 @@ void nft_story_(bool story_start, bool from_motoko) {
         static_cast<float>(wire_prompt_motoko.temperature);
     wire_prompt.topp = static_cast<float>(wire_prompt_motoko.topp);
   }
+  wire_prompt.ngram_lookup = ngram_lookup.value_or(0);
+  wire_prompt.attention_sinks = attention_sinks.value_or(0);
 
   print_prompt(wire_prompt);
 
@@ -360,7 +367,9 @@ void nft_story_(bool story_start, bool from_motoko) {
   if (!load_runstate(token_id, ic_api)) return;
 
   bool error{false};
-  std::string output = do_inference(ic_api, wire_prompt, p_runstate, chat,
+  std::vector<int> *token_history = &p_chats_token_history->umap[token_id];
+  std::string output = do_inference(ic_api, wire_prompt, p_runstate,
+                                    p_draft_runstate, chat, token_history,
                                     output_history, metadata_user, &error);
 
   if (error) {
@@ -370,7 +379,7 @@ void nft_story_(bool story_start, bool from_motoko) {
   }
 
   // --------------------------------------------------------------------------
-  // save the chat data to file & free it from OP memory
+  // save the run state, in memory or to file, see RunStatePool
   if (!save_runstate(token_id, ic_api)) return;
 
   // --------------------------------------------------------------------------
@@ -384,6 +393,170 @@ void nft_story_(bool story_start, bool from_motoko) {
   ic_api.to_wire(CandidTypeVariant{"Ok", CandidTypeRecord{inference_record}});
 }
 
+// Continues the stories of several NFTs in one call. The stories are generated
+// together, so every layer's weights are read once per step for all of them.
+// The input is a record of parallel vectors, entry i is the story of
+// token_ids[i], continued with the Prompt made of the i-th entry of the others.
+void nft_story_continue_batch() {
+  IC_API ic_api(CanisterUpdate{std::string(__func__)}, false);
+  if (!is_canister_mode_nft_ordinal()) {
+    std::string error_msg = "Access Denied - Canister is not in NFT mode.";
+    ic_api.to_wire(CandidTypeVariant{
+        "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+    return;
+  }
+  if (!nft_is_whitelisted(ic_api, false)) {
+    std::string error_msg =
+        "Access Denied - You are not authorized to call this function.";
+    ic_api.to_wire(CandidTypeVariant{
+        "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+    return;
+  }
+  if (!is_ready_and_authorized(ic_api)) return;
+
+  // Get the token_ids & Prompts from the wire
+  std::vector<std::string> token_ids;
+  std::vector<std::string> prompts;
+  std::vector<uint64_t> steps;
+  std::vector<float> temperatures;
+  std::vector<float> topps;
+  std::vector<uint64_t> rng_seeds;
+  CandidTypeRecord r_in;
+  r_in.append("token_ids", CandidTypeVecText{&token_ids});
+  r_in.append("prompts", CandidTypeVecText{&prompts});
+  r_in.append("steps", CandidTypeVecNat64{&steps});
+  r_in.append("temperatures", CandidTypeVecFloat32{&temperatures});
+  r_in.append("topps", CandidTypeVecFloat32{&topps});
+  r_in.append("rng_seeds", CandidTypeVecNat64{&rng_seeds});
+  std::optional<uint64_t> attention_sinks;
+  r_in.append("attention_sinks", CandidTypeOptNat64{&attention_sinks});
+  ic_api.from_wire(r_in);
+
+  size_t n_stories = token_ids.size();
+  if (prompts.size() != n_stories || steps.size() != n_stories ||
+      temperatures.size() != n_stories || topps.size() != n_stories ||
+      rng_seeds.size() != n_stories) {
+    std::string error_msg =
+        "All vectors of the batch must have the same length.";
+    ic_api.to_wire(CandidTypeVariant{
+        "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+    return;
+  }
+  if (n_stories > NFT_STORY_BATCH_MAX) {
+    std::string error_msg = "A batch can have at most " +
+                            std::to_string(NFT_STORY_BATCH_MAX) + " stories.";
+    ic_api.to_wire(CandidTypeVariant{
+        "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+    return;
+  }
+  for (size_t i = 0; i < n_stories; ++i) {
+    for (size_t j = 0; j < i; ++j) {
+      if (token_ids[i] == token_ids[j]) {
+        std::string error_msg =
+            "The story of token_id " + token_ids[i] + " is twice in the batch.";
+        ic_api.to_wire(CandidTypeVariant{
+            "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+        return;
+      }
+    }
+  }
+
+  std::vector<StoryInference> stories(n_stories);
+  for (size_t i = 0; i < n_stories; ++i) {
+    const std::string &token_id = token_ids[i];
+    if (p_chats && p_chats->umap.find(token_id) == p_chats->umap.end()) {
+      // Does not yet exist
+      std::cout << "calling build_new_chat" << std::endl;
+      if (!build_new_chat(token_id, ic_api)) return;
+    }
+    StoryInference &story = stories[i];
+    story.wire_prompt.prompt = prompts[i];
+    story.wire_prompt.steps = steps[i];
+    story.wire_prompt.temperature = temperatures[i];
+    story.wire_prompt.topp = topps[i];
+    story.wire_prompt.rng_seed = rng_seeds[i];
+    story.wire_prompt.attention_sinks = attention_sinks.value_or(0);
+    print_prompt(story.wire_prompt);
+    story.chat = &p_chats->umap[token_id];
+    story.token_history = &p_chats_token_history->umap[token_id];
+    story.output_history = &p_chats_output_history->umap[token_id];
+    story.metadata_user = &p_metadata_users->umap[token_id];
+  }
+
+  // The stories are read from & written to their runstate files, so take
+  // them out of the pool of RunStates kept in memory, see RunStatePool
+  for (const std::string &token_id : token_ids) {
+    if (!release_runstate(token_id)) {
+      std::string error_msg = "write_run_state failed for the RunState of "
+                              "token_id " + token_id + " in memory";
+      ic_api.to_wire(CandidTypeVariant{
+          "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+      return;
+    }
+  }
+
+  // The first story uses p_runstate, the others get a RunState of their own
+  // for the duration of the call
+  std::vector<RunState> extra_runstates(n_stories > 0 ? n_stories - 1 : 0);
+  auto free_extra_runstates = [&]() {
+    for (RunState &runstate : extra_runstates) free_run_state(&runstate);
+  };
+  for (size_t i = 0; i < n_stories; ++i) {
+    RunState *runstate = p_runstate;
+    if (i > 0) {
+      runstate = &extra_runstates[i - 1];
+      init_run_state(runstate);
+      if (!malloc_run_state(runstate, &transformer.config)) {
+        free_extra_runstates();
+        std::string error_msg = "malloc_run_state failed";
+        ic_api.to_wire(CandidTypeVariant{
+            "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+        return;
+      }
+    }
+    // If nothing there, just continue with the empty run state
+    load_kv_cache(token_ids[i], *runstate, false);
+    stories[i].runstate = runstate;
+  }
+
+  bool error{false};
+  std::string error_msg = do_inference_batch(ic_api, stories, &error);
+  if (error) {
+    free_extra_runstates();
+    ic_api.to_wire(CandidTypeVariant{
+        "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+    return;
+  }
+
+  // --------------------------------------------------------------------------
+  // save the run states to file. The rows are always written: recomputing
+  // them would cost every story a full forward at each batch call.
+  for (size_t i = 0; i < n_stories; ++i) {
+    if (!save_kv_cache(token_ids[i], *stories[i].runstate, false, false)) {
+      free_extra_runstates();
+      error_msg = "write_run_state failed for key " + token_ids[i];
+      ic_api.to_wire(CandidTypeVariant{
+          "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+      return;
+    }
+  }
+  free_extra_runstates();
+
+  // --------------------------------------------------------------------------
+  // Send the generated responses to the wire
+  std::vector<std::string> inferences;
+  std::vector<uint64_t> num_tokens;
+  for (const StoryInference &story : stories) {
+    inferences.push_back(story.output);
+    num_tokens.push_back(story.chat->inference_steps);
+  }
+  CandidTypeRecord inference_batch_record;
+  inference_batch_record.append("num_tokens", CandidTypeVecNat64{num_tokens});
+  inference_batch_record.append("inferences", CandidTypeVecText{inferences});
+  ic_api.to_wire(
+      CandidTypeVariant{"Ok", CandidTypeRecord{inference_batch_record}});
+}
+
 // Checks if a story exists for an NFT in the collection
 bool nft_story_exists_(const std::string &token_id) {
   if ((p_chats && p_chats->umap.find(token_id) != p_chats->umap.end()) &&
@@ -451,8 +624,10 @@ void nft_story_delete() {
   ic_api.from_wire(r_in);
 
   // TODO: more elegant to do this in the destructor of Chat
-  // Delete the runstate file, if it exists
+  // Delete the runstate files, if they exist
   delete_run_state_file(token_id);
+  delete_run_state_file(draft_run_state_key(token_id));
+  drop_runstate(token_id);
 
   // Delete the entry from the p_chats, if it exists
   if (p_chats && p_chats->umap.find(token_id) == p_chats->umap.end()) {
@@ -466,6 +641,7 @@ void nft_story_delete() {
       p_chats->umap.erase(
           it); // Removes the Chat object and the key from the map
     }
+    if (p_chats_token_history) p_chats_token_history->umap.erase(token_id);
   }
 
   CandidTypeRecord status_code_record;
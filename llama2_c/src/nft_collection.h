@@ -20,6 +20,8 @@ void nft_story_continue()
     WASM_SYMBOL_EXPORTED("canister_update nft_story_continue");
 void nft_story_continue_mo()
     WASM_SYMBOL_EXPORTED("canister_update nft_story_continue_mo");
+void nft_story_continue_batch()
+    WASM_SYMBOL_EXPORTED("canister_update nft_story_continue_batch");
 void nft_get_story() WASM_SYMBOL_EXPORTED("canister_query nft_get_story");
 void nft_story_delete()
     WASM_SYMBOL_EXPORTED("canister_update nft_story_delete");
@@ -67,5 +69,8 @@ bool nft_is_whitelisted(IC_API &ic_api, bool err_to_wire = true);
 void new_p_nft_collection();
 void delete_p_nft_collection();
 void nft_story_(bool story_start, bool from_motoko);
+// The most stories nft_story_continue_batch takes in one call. Each of them
+// needs a RunState, with its own kv cache, for the duration of the call.
+#define NFT_STORY_BATCH_MAX 8
 bool nft_exists_(const std::string &token_id);
 bool nft_story_exists_(const std::string &token_id);
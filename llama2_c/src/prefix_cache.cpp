@@ -0,0 +1,193 @@
+// The kv cache rows of common token prefixes, shared by all chats & stories
+
+#include "prefix_cache.h"
+
+#include <algorithm>
+#include <new>
+#include <string>
+
+#include "chats.h"
+#include "ic_api.h"
+
+// Orthogonally Persisted data
+PrefixCache *p_prefix_cache{nullptr};
+
+void new_p_prefix_cache() {
+  if (p_prefix_cache == nullptr) {
+    IC_API::debug_print(std::string(__func__) +
+                        ": Creating p_prefix_cache instance.");
+    p_prefix_cache = new (std::nothrow) PrefixCache();
+    if (p_prefix_cache == nullptr) {
+      // called from canister_init, so trap is correct!
+      IC_API::trap("Allocation of p_prefix_cache failed");
+    }
+  }
+}
+
+void delete_p_prefix_cache() {
+  if (p_prefix_cache) {
+    delete p_prefix_cache;
+    p_prefix_cache = nullptr;
+  }
+}
+
+// Empties the cache, eg. when initialize loads another model
+void clear_prefix_cache() {
+  if (!p_prefix_cache) return;
+  p_prefix_cache->root.children.clear();
+  p_prefix_cache->bytes = 0;
+}
+
+static size_t prefix_node_bytes(const PrefixNode &node) {
+  return node.tokens.size() * sizeof(int) + node.rows.size() +
+         node.draft_rows.size();
+}
+
+// The length of the common prefix of the edge of node & tokens[pos...]
+static size_t prefix_node_common(const PrefixNode &node,
+                                 const std::vector<int> &tokens, size_t pos) {
+  size_t len = 0;
+  while (len < node.tokens.size() && pos + len < tokens.size() &&
+         node.tokens[len] == tokens[pos + len]) {
+    ++len;
+  }
+  return len;
+}
+
+// Copies the rows of the longest path of the tree that tokens follow, from
+// position 0, into the positions [first, ...) of state & draft_state. The
+// rows before first are those of the chat itself. Returns the length of the
+// path: the rows [first, length) were copied. The rows of the draft stop at
+// the first node that does not have them: the rows [first, *draft_length)
+// were copied into draft_state.
+int prefix_cache_match(const std::vector<int> &tokens, int first,
+                       RunState *state, RunState *draft_state,
+                       int *draft_length) {
+  *draft_length = 0;
+  PrefixCache *cache = p_prefix_cache;
+  if (!cache || PREFIX_CACHE_BUDGET == 0) return 0;
+
+  size_t bytes = kv_cache_position_bytes(*state, transformer.config);
+  size_t draft_bytes =
+      draft_state
+          ? kv_cache_position_bytes(*draft_state, draft_transformer.config)
+          : 0;
+  PrefixNode *node = &cache->root;
+  size_t pos = 0;
+  while (pos < tokens.size()) {
+    auto it = node->children.find(tokens[pos]);
+    if (it == node->children.end()) break;
+    PrefixNode *child = it->second.get();
+    size_t len = prefix_node_common(*child, tokens, pos);
+    size_t from = std::max(pos, static_cast<size_t>(first));
+    if (from < pos + len) {
+      if (child->draft_rows.empty()) draft_state = nullptr;
+      kv_cache_load_rows(*state, transformer.config, from, pos + len,
+                         child->rows.data() + (from - pos) * bytes);
+      if (draft_state) {
+        const char *draft_rows =
+            child->draft_rows.data() + (from - pos) * draft_bytes;
+        kv_cache_load_rows(*draft_state, draft_transformer.config, from,
+                           pos + len, draft_rows);
+      }
+    }
+    child->last_used = ++cache->clock;
+    pos += len;
+    if (draft_state) *draft_length = static_cast<int>(pos);
+    if (len < child->tokens.size()) break;
+    node = child;
+  }
+  return static_cast<int>(pos);
+}
+
+// The least recently used leaf, or nullptr if the tree is empty
+static PrefixNode *prefix_cache_lru_leaf(PrefixNode *node) {
+  PrefixNode *lru = nullptr;
+  for (auto &[token, child] : node->children) {
+    PrefixNode *leaf = child->children.empty()
+                           ? child.get()
+                           : prefix_cache_lru_leaf(child.get());
+    if (leaf && (!lru || leaf->last_used < lru->last_used)) lru = leaf;
+  }
+  return lru;
+}
+
+// Adds the path of tokens, with the rows of the positions [0, tokens.size())
+// of state & draft_state, and evicts the least recently used leaves beyond
+// PREFIX_CACHE_BUDGET. With a draft_state, the nodes of the path that have no
+// rows of the draft get them.
+void prefix_cache_insert(const std::vector<int> &tokens,
+                         const RunState *state, const RunState *draft_state) {
+  PrefixCache *cache = p_prefix_cache;
+  if (!cache || PREFIX_CACHE_BUDGET == 0) return;
+
+  size_t bytes = kv_cache_position_bytes(*state, transformer.config);
+  size_t draft_bytes =
+      draft_state
+          ? kv_cache_position_bytes(*draft_state, draft_transformer.config)
+          : 0;
+  PrefixNode *node = &cache->root;
+  size_t pos = 0;
+  while (pos < tokens.size()) {
+    auto it = node->children.find(tokens[pos]);
+    if (it == node->children.end()) {
+      // A new leaf with the rest of the tokens
+      auto leaf = std::make_unique<PrefixNode>();
+      size_t n = tokens.size() - pos;
+      leaf->tokens.assign(tokens.begin() + pos, tokens.end());
+      leaf->rows.resize(n * bytes);
+      kv_cache_save_rows(*state, transformer.config, pos, tokens.size(),
+                         leaf->rows.data());
+      if (draft_state) {
+        leaf->draft_rows.resize(n * draft_bytes);
+        kv_cache_save_rows(*draft_state, draft_transformer.config, pos,
+                           tokens.size(), leaf->draft_rows.data());
+      }
+      leaf->parent = node;
+      leaf->last_used = ++cache->clock;
+      cache->bytes += prefix_node_bytes(*leaf);
+      node->children[tokens[pos]] = std::move(leaf);
+      break;
+    }
+
+    PrefixNode *child = it->second.get();
+    size_t len = prefix_node_common(*child, tokens, pos);
+    if (len < child->tokens.size()) {
+      // Split the edge where tokens branch off: the common part moves into
+      // a new node, with the rest of the edge as its child
+      auto mid = std::make_unique<PrefixNode>();
+      size_t draft_len =
+          len * (child->draft_rows.size() / child->tokens.size());
+      mid->tokens.assign(child->tokens.begin(), child->tokens.begin() + len);
+      child->tokens.erase(child->tokens.begin(), child->tokens.begin() + len);
+      mid->rows.assign(child->rows.begin(), child->rows.begin() + len * bytes);
+      child->rows.erase(child->rows.begin(), child->rows.begin() + len * bytes);
+      mid->draft_rows.assign(child->draft_rows.begin(),
+                             child->draft_rows.begin() + draft_len);
+      child->draft_rows.erase(child->draft_rows.begin(),
+                              child->draft_rows.begin() + draft_len);
+      mid->parent = node;
+      mid->last_used = child->last_used;
+      child->parent = mid.get();
+      mid->children[child->tokens[0]] = std::move(it->second);
+      it->second = std::move(mid);
+      child = it->second.get();
+    }
+    if (draft_state && child->draft_rows.empty()) {
+      child->draft_rows.resize(len * draft_bytes);
+      kv_cache_save_rows(*draft_state, draft_transformer.config, pos,
+                         pos + len, child->draft_rows.data());
+      cache->bytes += child->draft_rows.size();
+    }
+    child->last_used = ++cache->clock;
+    pos += len;
+    node = child;
+  }
+
+  while (cache->bytes > PREFIX_CACHE_BUDGET) {
+    PrefixNode *leaf = prefix_cache_lru_leaf(&cache->root);
+    if (!leaf) break;
+    cache->bytes -= prefix_node_bytes(*leaf);
+    leaf->parent->children.erase(leaf->tokens[0]);
+  }
+}
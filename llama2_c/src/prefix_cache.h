@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "run.h"
+
+// The kv cache rows of the token sequences that chats & stories started with,
+// shared by all of them, in a radix tree keyed by token ids. A row depends on
+// the tokens before it, so a chat whose tokens follow a path of the tree, from
+// position 0, can copy the rows of that path into its own kv cache instead of
+// forwarding them, see generation_start. The rows of a node never change: a
+// chat that diverges writes its own rows in its own kv cache, and a node is
+// only split where a new sequence branches off.
+// The rows of the draft model are kept per node, when the sequence was
+// inserted with a draft, or by a later one with a draft that follows the node.
+// The least recently used leaves are evicted beyond PREFIX_CACHE_BUDGET bytes.
+// Override the budget with -DPREFIX_CACHE_BUDGET=<bytes> (see icpp.toml), 0
+// disables the cache.
+#ifndef PREFIX_CACHE_BUDGET
+#define PREFIX_CACHE_BUDGET (32ULL * 1024 * 1024)
+#endif
+
+struct PrefixNode {
+  std::vector<int> tokens;      // the edge from the parent
+  std::vector<char> rows;       // the kv cache rows of the tokens
+  std::vector<char> draft_rows; // same for the draft model, or empty
+  std::unordered_map<int, std::unique_ptr<PrefixNode>> children; // by token
+  PrefixNode *parent{nullptr};
+  unsigned long long last_used{0};
+};
+
+class PrefixCache {
+public:
+  PrefixNode root;
+  size_t bytes{0};         // of the rows & tokens of all nodes
+  unsigned long long clock{0}; // for last_used
+};
+extern PrefixCache *p_prefix_cache;
+
+void new_p_prefix_cache();
+void delete_p_prefix_cache();
+void clear_prefix_cache();
+int prefix_cache_match(const std::vector<int> &tokens, int first,
+                       RunState *state, RunState *draft_state,
+                       int *draft_length);
+void prefix_cache_insert(const std::vector<int> &tokens,
+                         const RunState *state, const RunState *draft_state);
@@ -14,5 +14,9 @@ void print_prompt(const Prompt &wire_prompt) {
       "\nwire_prompt.temperature  = " + std::to_string(wire_prompt.temperature);
   msg += "\nwire_prompt.topp         = " + std::to_string(wire_prompt.topp);
   msg += "\nwire_prompt.rng_seed     = " + std::to_string(wire_prompt.rng_seed);
+  msg += "\nwire_prompt.ngram_lookup = " +
+         std::to_string(wire_prompt.ngram_lookup);
+  msg += "\nwire_prompt.attention_sinks = " +
+         std::to_string(wire_prompt.attention_sinks);
   IC_API::debug_print(msg);
 }
\ No newline at end of file
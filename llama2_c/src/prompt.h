@@ -10,6 +10,10 @@ public:
   float temperature{1.0};
   float topp{0.9};
   uint64_t rng_seed{0};
+  // most tokens proposed per step by prompt lookup (opt on the wire), 0: off
+  uint64_t ngram_lookup{0};
+  // positions kept at the start of a full kv cache (opt on the wire), 0: off
+  uint64_t attention_sinks{0};
 };
 
 // Motoko does not support float32, so we use float64, and then map PromptMo onto Prompt
@@ -20,6 +24,10 @@ public:
   double temperature{1.0};
   double topp{0.9};
   uint64_t rng_seed{0};
+  // most tokens proposed per step by prompt lookup (opt on the wire), 0: off
+  uint64_t ngram_lookup{0};
+  // positions kept at the start of a full kv cache (opt on the wire), 0: off
+  uint64_t attention_sinks{0};
 };
 
 void print_prompt(const Prompt &wire_prompt);
\ No newline at end of file
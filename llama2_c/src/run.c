@@ -13,6 +13,7 @@ That's it. Everything else is identical...
 */
 // clang-format off
 #include "run.h" // ICPP
+#include "thread_pool.h" // ICPP
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -101,17 +102,45 @@ bool malloc_run_state(RunState* s, Config* p) {
     s->xb2 = calloc(p->dim, sizeof(float));
     s->hb = calloc(p->hidden_dim, sizeof(float));
     s->hb2 = calloc(p->hidden_dim, sizeof(float));
-    s->q = calloc(p->dim, sizeof(float));
-    s->k = calloc(kv_dim, sizeof(float));
-    s->v = calloc(kv_dim, sizeof(float));
-    s->att = calloc(p->n_heads * p->seq_len, sizeof(float));
+    // ICPP: q, k & v are contiguous, so the fused qkv matmul writes all three
+    s->q = calloc(p->dim + 2 * kv_dim, sizeof(float));
+    s->k = s->q ? s->q + p->dim : NULL;
+    s->v = s->q ? s->k + kv_dim : NULL;
     s->logits = calloc(p->vocab_size, sizeof(float));
-    s->key_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(float));
-    s->value_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(float));
+    // ICPP: the kv cache in the storage of kv_cache_type
+    size_t kv_size = (size_t)p->n_layers * p->seq_len * kv_dim;
+    size_t kv_heads = (size_t)p->n_layers * p->seq_len * p->n_kv_heads;
+    s->kv_type = kv_cache_type;
+    s->key_cache = NULL; s->value_cache = NULL;
+    s->key_cache_f16 = NULL; s->value_cache_f16 = NULL;
+    s->key_cache_q = NULL; s->value_cache_q = NULL;
+    s->key_cache_s = NULL; s->value_cache_s = NULL;
+    bool kv_ok;
+    if (s->kv_type == KV_CACHE_FP16) {
+        s->key_cache_f16 = calloc(kv_size, sizeof(uint16_t));
+        s->value_cache_f16 = calloc(kv_size, sizeof(uint16_t));
+        kv_ok = s->key_cache_f16 && s->value_cache_f16;
+    } else if (s->kv_type == KV_CACHE_INT8) {
+        s->key_cache_q = calloc(kv_size, sizeof(int8_t));
+        s->value_cache_q = calloc(kv_size, sizeof(int8_t));
+        s->key_cache_s = calloc(kv_heads, sizeof(float));
+        s->value_cache_s = calloc(kv_heads, sizeof(float));
+        kv_ok = s->key_cache_q && s->value_cache_q && s->key_cache_s && s->value_cache_s;
+    } else {
+        s->key_cache = calloc(kv_size, sizeof(float));
+        s->value_cache = calloc(kv_size, sizeof(float));
+        kv_ok = s->key_cache && s->value_cache;
+    }
+    // ICPP: buffers for quantized activations. We allocate one scale per value,
+    //       which covers every group_size.
+    s->xq.q = calloc(p->dim, sizeof(int8_t));
+    s->xq.s = calloc(p->dim, sizeof(float));
+    s->hq.q = calloc(p->hidden_dim, sizeof(int8_t));
+    s->hq.s = calloc(p->hidden_dim, sizeof(float));
     // ensure all mallocs went fine
     if (!s->x || !s->xb || !s->xb2 || !s->hb || !s->hb2 || !s->q
-     || !s->k || !s->v || !s->att || !s->logits || !s->key_cache
-     || !s->value_cache) {
+     || !s->k || !s->v || !s->logits || !kv_ok
+     || !s->xq.q || !s->xq.s || !s->hq.q || !s->hq.s) {
         // ICPP: The calling function will return Err
         // printf("malloc failed!\n");
         // exit(1);
@@ -128,15 +157,38 @@ void free_run_state(RunState* s) {
     if(s->hb) { free(s->hb); s->hb = NULL; }
     if(s->hb2) { free(s->hb2); s->hb2 = NULL; }
     if(s->q) { free(s->q); s->q = NULL; }
-    if(s->k) { free(s->k); s->k = NULL; }
-    if(s->v) { free(s->v); s->v = NULL; }
-    if(s->att) { free(s->att); s->att = NULL; }
+    s->k = NULL; // ICPP: k & v are part of the q allocation
+    s->v = NULL;
     if(s->logits) { free(s->logits); s->logits = NULL; }
     if(s->key_cache) { free(s->key_cache); s->key_cache = NULL; }
     if(s->value_cache) { free(s->value_cache); s->value_cache = NULL; }
+    if(s->key_cache_f16) { free(s->key_cache_f16); s->key_cache_f16 = NULL; }
+    if(s->value_cache_f16) { free(s->value_cache_f16); s->value_cache_f16 = NULL; }
+    if(s->key_cache_q) { free(s->key_cache_q); s->key_cache_q = NULL; }
+    if(s->value_cache_q) { free(s->value_cache_q); s->value_cache_q = NULL; }
+    if(s->key_cache_s) { free(s->key_cache_s); s->key_cache_s = NULL; }
+    if(s->value_cache_s) { free(s->value_cache_s); s->value_cache_s = NULL; }
+    if(s->xq.q) { free(s->xq.q); s->xq.q = NULL; }
+    if(s->xq.s) { free(s->xq.s); s->xq.s = NULL; }
+    if(s->hq.q) { free(s->hq.q); s->hq.q = NULL; }
+    if(s->hq.s) { free(s->hq.s); s->hq.s = NULL; }
+}
+
+// ICPP: the weights of a previously loaded fp16 or bf16 checkpoint
+static void clear_half_weights(TransformerWeights *w) {
+    w->h_tokens = NULL; w->h_wqkv = NULL; w->h_wo = NULL;
+    w->h_w13 = NULL; w->h_w2 = NULL; w->h_wcls = NULL;
 }
 
 void memory_map_weights(TransformerWeights *w, Config* p, float* ptr, int shared_weights) {
+    // ICPP: a previously loaded checkpoint may have been quantized
+    free_quantized_weights(w);
+    w->weight_type = WEIGHT_TYPE_FP32;
+    w->group_size = 0;
+    w->wqkv = NULL; // see fuse_qkv_weights
+    w->w13 = NULL;  // see fuse_w13_weights
+    w->layer_stride = 0; // see layer_major_weights
+    clear_half_weights(w);
     int head_size = p->dim / p->n_heads;
     // make sure the multiplications below are done in 64bit to fit the parameter counts of 13B+ models
     unsigned long long n_layers = p->n_layers;
@@ -167,6 +219,490 @@ void memory_map_weights(TransformerWeights *w, Config* p, float* ptr, int shared
     w->wcls = shared_weights ? w->token_embedding_table : ptr;
 }
 
+// ICPP: number of bytes that memory_map_weights maps, used to verify the upload
+size_t checkpoint_weights_size_fp32(Config* p, int shared_weights) {
+    size_t head_size = p->dim / p->n_heads;
+    size_t dim = p->dim;
+    size_t kv_dim = p->n_kv_heads * head_size;
+    size_t n_layers = p->n_layers;
+    size_t n = p->vocab_size * dim;                      // token_embedding_table
+    n += n_layers * dim * 2;                             // rms_att, rms_ffn
+    n += n_layers * dim * (dim + 2 * kv_dim);            // wq, wk, wv
+    n += n_layers * dim * dim;                           // wo
+    n += n_layers * dim * p->hidden_dim * 3;             // w1, w2, w3
+    n += dim;                                            // rms_final
+    n += p->seq_len * head_size;                         // freq_cis_real & freq_cis_imag
+    if (!shared_weights) { n += p->vocab_size * dim; }   // wcls
+    return n * sizeof(float);
+}
+
+// ICPP: The fp32 weights are repacked in place after the upload, see initialize.cpp.
+//       A repack is a permutation of rows of row_len bytes, applied by following
+//       its cycles, which needs two rows & one bit per row of extra memory.
+//       dst(row) returns where a row of the legacy layout goes.
+//       The fp16 & bf16 weights are repacked the same way, with rows of 16-bit values.
+typedef unsigned long long (*RowDestination)(unsigned long long row, Config* p);
+
+static bool permute_rows(void* rows, unsigned long long n_rows, unsigned long long row_len,
+                         RowDestination dst_of, Config* p) {
+    uint8_t *base = rows;
+    uint8_t *moved = calloc((n_rows + 7) / 8, sizeof(uint8_t));
+    uint8_t *row_buf = malloc(row_len);
+    uint8_t *row_tmp = malloc(row_len);
+    if (!moved || !row_buf || !row_tmp) {
+        free(moved); free(row_buf); free(row_tmp);
+        return false; // ICPP: caller will return Err
+    }
+    for (unsigned long long start = 0; start < n_rows; start++) {
+        if (moved[start / 8] & (1 << (start % 8))) { continue; }
+        // carry the row along its cycle, until we are back at the start
+        memcpy(row_buf, base + start * row_len, row_len);
+        unsigned long long row = start;
+        do {
+            unsigned long long dst = dst_of(row, p);
+            memcpy(row_tmp, base + dst * row_len, row_len);
+            memcpy(base + dst * row_len, row_buf, row_len);
+            memcpy(row_buf, row_tmp, row_len);
+            moved[dst / 8] |= (1 << (dst % 8));
+            row = dst;
+        } while (row != start);
+    }
+    free(moved); free(row_buf); free(row_tmp);
+    return true;
+}
+
+// wq of all layers, then wk, then wv -> (layer, dim + 2 * kv_dim, dim)
+static unsigned long long qkv_fused_row(unsigned long long row, Config* p) {
+    unsigned long long n_layers = p->n_layers;
+    unsigned long long dim = p->dim;
+    unsigned long long kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    unsigned long long qkv_dim = dim + 2 * kv_dim;
+    if (row < n_layers * dim) { // wq
+        return (row / dim) * qkv_dim + row % dim;
+    }
+    row -= n_layers * dim;
+    if (row < n_layers * kv_dim) { // wk
+        return (row / kv_dim) * qkv_dim + dim + row % kv_dim;
+    }
+    row -= n_layers * kv_dim; // wv
+    return (row / kv_dim) * qkv_dim + dim + kv_dim + row % kv_dim;
+}
+
+// w1 of all layers, then w2, then w3 -> (layer, 2 * hidden_dim, dim) with the rows
+// of w1 & w3 interleaved, followed by w2. w2 moves as a whole, in rows of dim floats.
+static unsigned long long w13_fused_row(unsigned long long row, Config* p) {
+    unsigned long long n_layers = p->n_layers;
+    unsigned long long hidden_dim = p->hidden_dim;
+    unsigned long long n = n_layers * hidden_dim; // rows of dim floats per weight
+    if (row < n) { // w1
+        return (row / hidden_dim) * 2 * hidden_dim + 2 * (row % hidden_dim);
+    }
+    if (row < 2 * n) { // w2
+        return row + n;
+    }
+    row -= 2 * n; // w3
+    return (row / hidden_dim) * 2 * hidden_dim + 2 * (row % hidden_dim) + 1;
+}
+
+// ICPP: Repacks wq, wk & wv of each layer into one (dim + 2 * kv_dim, dim) block,
+//       so forward computes q, k & v with a single matmul that reads x once.
+//       When repack is false, the weights were already repacked before.
+bool fuse_qkv_weights(TransformerWeights *w, Config* p, bool repack) {
+    unsigned long long kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    unsigned long long n_rows = (unsigned long long)p->n_layers * (p->dim + 2 * kv_dim);
+    if (w->weight_type != WEIGHT_TYPE_FP32) {
+        // fp16 & bf16: h_wqkv already points at wq, see memory_map_weights_half
+        return !repack || permute_rows(w->h_wqkv, n_rows, p->dim * sizeof(uint16_t), qkv_fused_row, p);
+    }
+    if (repack && !permute_rows(w->wq, n_rows, p->dim * sizeof(float), qkv_fused_row, p)) {
+        return false;
+    }
+    w->wqkv = w->wq;
+    // the separate matrices are no longer valid
+    w->wq = NULL; w->wk = NULL; w->wv = NULL;
+    return true;
+}
+
+// ICPP: Repacks w1 & w3 of each layer into one (2 * hidden_dim, dim) block with
+//       interleaved rows, so forward computes both with a single fused kernel,
+//       see matmul_swiglu. w2 moves behind the fused blocks.
+//       When repack is false, the weights were already repacked before.
+bool fuse_w13_weights(TransformerWeights *w, Config* p, bool repack) {
+    unsigned long long n_rows = 3ULL * p->n_layers * p->hidden_dim;
+    if (w->weight_type != WEIGHT_TYPE_FP32) {
+        // fp16 & bf16: h_w13 already points at w1, see memory_map_weights_half
+        if (repack && !permute_rows(w->h_w13, n_rows, p->dim * sizeof(uint16_t), w13_fused_row, p)) {
+            return false;
+        }
+        w->h_w2 = w->h_w13 + 2ULL * p->n_layers * p->hidden_dim * p->dim;
+        return true;
+    }
+    if (repack && !permute_rows(w->w1, n_rows, p->dim * sizeof(float), w13_fused_row, p)) {
+        return false;
+    }
+    w->w13 = w->w1;
+    w->w2 = w->w13 + 2ULL * p->n_layers * p->hidden_dim * p->dim;
+    // the separate matrices are no longer valid
+    w->w1 = NULL; w->w3 = NULL;
+    return true;
+}
+
+#ifdef LAYER_MAJOR_WEIGHTS
+// the weights of one layer, in rows of dim values, in the order forward reads them.
+// The fp16 & bf16 rmsnorm weights are fp32, outside the 16-bit rows: with_rms 0.
+static unsigned long long layer_rows(Config* p, int with_rms, unsigned long long rows[6]) {
+    unsigned long long kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    rows[0] = with_rms;                  // rms_att
+    rows[1] = p->dim + 2 * kv_dim;       // wqkv
+    rows[2] = p->dim;                    // wo
+    rows[3] = with_rms;                  // rms_ffn
+    rows[4] = 2ULL * p->hidden_dim;      // w13
+    rows[5] = p->hidden_dim;             // w2, (dim, hidden_dim) is hidden_dim rows of dim
+    return rows[0] + rows[1] + rows[2] + rows[3] + rows[4] + rows[5];
+}
+
+// every weight of all layers, then the next weight -> (layer, layer_rows, dim)
+static unsigned long long layer_major_row_impl(unsigned long long row, Config* p, int with_rms) {
+    unsigned long long rows[6];
+    unsigned long long n_layers = p->n_layers;
+    unsigned long long n = layer_rows(p, with_rms, rows);
+    unsigned long long offset = 0;
+    for (int i = 0; i < 6; i++) {
+        if (row < n_layers * rows[i]) {
+            return (row / rows[i]) * n + offset + row % rows[i];
+        }
+        row -= n_layers * rows[i];
+        offset += rows[i];
+    }
+    return row; // not reached
+}
+
+static unsigned long long layer_major_row_fp32(unsigned long long row, Config* p) {
+    return layer_major_row_impl(row, p, 1);
+}
+
+static unsigned long long layer_major_row_half(unsigned long long row, Config* p) {
+    return layer_major_row_impl(row, p, 0);
+}
+#endif
+
+// ICPP: Repacks the unquantized weights layer-major, when compiled with
+//       -DLAYER_MAJOR_WEIGHTS: the rmsnorm & matmul weights of a layer become one
+//       contiguous block, in the order forward reads them, and the blocks follow each
+//       other. The checkpoint stores every weight of all layers before the next weight,
+//       so a layer reads 6 regions far apart, each starting & ending in a partly used
+//       page. After the repack, w->rms_att_weight, w->wqkv, etc. point into the block
+//       of layer 0, and layer l is l * w->layer_stride values further, see layer_weights.
+//       fp16 & bf16 keep their fp32 rmsnorm weights apart. Quantized weights, with one
+//       QuantizedTensor per layer, stay type-major.
+//       Must be called after fuse_qkv_weights & fuse_w13_weights, and before
+//       repack_weight_panels. When repack is false, the weights were already repacked.
+bool layer_major_weights(TransformerWeights *w, Config* p, bool repack) {
+#ifdef LAYER_MAJOR_WEIGHTS
+    unsigned long long rows[6];
+    unsigned long long dim = p->dim;
+    unsigned long long n_layers = p->n_layers;
+    if (w->weight_type == WEIGHT_TYPE_FP32) {
+        unsigned long long n = layer_rows(p, 1, rows);
+        if (repack && !permute_rows(w->rms_att_weight, n_layers * n, dim * sizeof(float), layer_major_row_fp32, p)) {
+            return false;
+        }
+        w->wqkv = w->rms_att_weight + rows[0] * dim;
+        w->wo = w->wqkv + rows[1] * dim;
+        w->rms_ffn_weight = w->wo + rows[2] * dim;
+        w->w13 = w->rms_ffn_weight + rows[3] * dim;
+        w->w2 = w->w13 + rows[4] * dim;
+        w->layer_stride = n * dim;
+    } else if (w->weight_type == WEIGHT_TYPE_F16 || w->weight_type == WEIGHT_TYPE_BF16) {
+        unsigned long long n = layer_rows(p, 0, rows);
+        if (repack && !permute_rows(w->h_wqkv, n_layers * n, dim * sizeof(uint16_t), layer_major_row_half, p)) {
+            return false;
+        }
+        w->h_wo = w->h_wqkv + rows[1] * dim;
+        w->h_w13 = w->h_wo + rows[2] * dim;
+        w->h_w2 = w->h_w13 + rows[4] * dim;
+        w->layer_stride = n * dim;
+    }
+#else
+    (void)w; (void)p; (void)repack;
+#endif
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// ICPP: Quantized checkpoints (Q8_0), from runq.c of https://github.com/karpathy/llama2.c
+//       The group size is passed in, instead of using a global GS.
+//       Q4_1 (version 3) packs two 4-bit values per byte, low nibble first,
+//       and dequantizes as q * s + m, with a scale s and a min m per group.
+
+void dequantize_row(QuantizedTensor *qx, int row, float* x, int n, int group_size, WeightType weight_type) {
+    // dequantize row 'row' of a (rows, n) tensor into x (n,)
+    unsigned long long offset = (unsigned long long)row * n;
+    if (weight_type == WEIGHT_TYPE_Q4_1) {
+        uint8_t *q = (uint8_t*)qx->q;
+        for (int i = 0; i < n; i++) {
+            unsigned long long j = offset + i;
+            int nibble = (j & 1) ? (q[j / 2] >> 4) : (q[j / 2] & 0x0F);
+            x[i] = nibble * qx->s[j / group_size] + qx->m[j / group_size];
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        x[i] = qx->q[offset + i] * qx->s[(offset + i) / group_size];
+    }
+}
+
+void quantize(QuantizedTensor *qx, float* x, int n, int group_size) {
+    int num_groups = n / group_size;
+    float Q_MAX = 127.0f;
+
+    for (int group = 0; group < num_groups; group++) {
+
+        // find the max absolute value in the current group
+        float wmax = 0.0;
+        for (int i = 0; i < group_size; i++) {
+            float val = fabs(x[group * group_size + i]);
+            if (val > wmax) {
+                wmax = val;
+            }
+        }
+
+        // calculate and write the scaling factor
+        float scale = wmax / Q_MAX;
+        qx->s[group] = scale;
+
+        // calculate and write the quantized values
+        for (int i = 0; i < group_size; i++) {
+            float quant_value = scale != 0.0f ? x[group * group_size + i] / scale : 0.0f; // scale
+            int8_t quantized = (int8_t) round(quant_value); // round and clamp
+            qx->q[group * group_size + i] = quantized;
+        }
+    }
+}
+
+/* initialize `n` x quantized tensor (with `size_each` elements), starting from memory pointed at *ptr */
+QuantizedTensor *init_quantized_tensors(void **ptr, int n, unsigned long long size_each, int group_size, WeightType weight_type) {
+    void *p = *ptr;
+    QuantizedTensor *res = malloc(n * sizeof(QuantizedTensor));
+    if (!res) { return NULL; } // ICPP: caller will return Err
+    for(int i=0; i<n; i++) {
+        if (weight_type == WEIGHT_TYPE_Q4_1) {
+            /* map packed 4-bit values, scale factors & mins */
+            res[i].q = (int8_t*)p;
+            p = (int8_t*)p + size_each / 2;
+            res[i].s = (float*)p;
+            p = (float*)p + size_each / group_size;
+            res[i].m = (float*)p;
+            p = (float*)p + size_each / group_size;
+            continue;
+        }
+        /* map quantized int8 values*/
+        res[i].q = (int8_t*)p;
+        p = (int8_t*)p + size_each;
+        /* map scale factors */
+        res[i].s = (float*)p;
+        p = (float*)p + size_each / group_size;
+        res[i].m = NULL;
+    }
+    *ptr = p; // advance ptr to current position
+    return res;
+}
+
+// ICPP: name of the weight format, as reported by get_model_config
+const char* weight_type_name(WeightType weight_type) {
+    switch (weight_type) {
+        case WEIGHT_TYPE_Q8_0: return "q8_0";
+        case WEIGHT_TYPE_Q4_1: return "q4_1";
+        case WEIGHT_TYPE_F16: return "fp16";
+        case WEIGHT_TYPE_BF16: return "bf16";
+        default: return "fp32";
+    }
+}
+
+// ICPP: safe to call more than once, eg. when initialize is called again
+void free_quantized_weights(TransformerWeights *w) {
+    if (w->q_tokens) { free(w->q_tokens); }
+    if (w->q_wq) { free(w->q_wq); }
+    if (w->q_wk) { free(w->q_wk); }
+    if (w->q_wv) { free(w->q_wv); }
+    if (w->q_wo) { free(w->q_wo); }
+    if (w->q_w1) { free(w->q_w1); }
+    if (w->q_w2) { free(w->q_w2); }
+    if (w->q_w3) { free(w->q_w3); }
+    if (w->q_wcls && w->q_wcls != w->q_tokens) { free(w->q_wcls); }
+    w->q_tokens = NULL; w->q_wq = NULL; w->q_wk = NULL; w->q_wv = NULL; w->q_wo = NULL;
+    w->q_w1 = NULL; w->q_w2 = NULL; w->q_w3 = NULL; w->q_wcls = NULL;
+}
+
+// ICPP: number of bytes that memory_map_weights_quantized maps, used to verify the upload
+size_t checkpoint_weights_size_quantized(Config* p, uint8_t shared_classifier, int group_size, WeightType weight_type) {
+    int head_size = p->dim / p->n_heads;
+    size_t dim = p->dim;
+    size_t n_layers = p->n_layers;
+    size_t bytes = (2 * n_layers + 1) * dim * sizeof(float); // rmsnorm weights
+    size_t n = p->vocab_size * dim; // tokens
+    n += n_layers * dim * (p->n_heads * head_size);      // wq
+    n += n_layers * dim * (p->n_kv_heads * head_size) * 2; // wk, wv
+    n += n_layers * (p->n_heads * head_size) * dim;      // wo
+    n += n_layers * dim * p->hidden_dim * 3;             // w1, w2, w3
+    if (!shared_classifier) { n += dim * p->vocab_size; } // wcls
+    if (weight_type == WEIGHT_TYPE_Q4_1) {
+        bytes += n / 2 + 2 * (n / group_size) * sizeof(float);
+    } else {
+        bytes += n * sizeof(int8_t) + (n / group_size) * sizeof(float);
+    }
+    return bytes;
+}
+
+// ICPP: returns the end of the mapped weights, or NULL if an allocation failed
+void* memory_map_weights_quantized(TransformerWeights *w, Config* p, void* ptr, uint8_t shared_classifier, int group_size, WeightType weight_type) {
+    free_quantized_weights(w);
+    w->weight_type = weight_type;
+    w->group_size = group_size;
+    w->layer_stride = 0;
+    int head_size = p->dim / p->n_heads;
+    unsigned long long dim = p->dim;
+    // first are the parameters that are kept in fp32 (the rmsnorm (1D) weights)
+    float* fptr = (float*) ptr; // cast our pointer to float*
+    w->rms_att_weight = fptr;
+    fptr += p->n_layers * p->dim;
+    w->rms_ffn_weight = fptr;
+    fptr += p->n_layers * p->dim;
+    w->rms_final_weight = fptr;
+    fptr += p->dim;
+
+    // now read all the quantized weights
+    ptr = (void*)fptr; // now cast the pointer back to void*
+    w->q_tokens = init_quantized_tensors(&ptr, 1, p->vocab_size * dim, group_size, weight_type);
+    // ICPP: we do not dequantize the token embedding table up front, because that
+    //       would cost vocab_size * dim floats. forward dequantizes one row instead.
+    w->token_embedding_table = NULL;
+    w->wqkv = NULL;
+    w->w13 = NULL;
+    clear_half_weights(w);
+
+    w->q_wq = init_quantized_tensors(&ptr, p->n_layers, dim * (p->n_heads * head_size), group_size, weight_type);
+    w->q_wk = init_quantized_tensors(&ptr, p->n_layers, dim * (p->n_kv_heads * head_size), group_size, weight_type);
+    w->q_wv = init_quantized_tensors(&ptr, p->n_layers, dim * (p->n_kv_heads * head_size), group_size, weight_type);
+    w->q_wo = init_quantized_tensors(&ptr, p->n_layers, (p->n_heads * head_size) * dim, group_size, weight_type);
+
+    w->q_w1 = init_quantized_tensors(&ptr, p->n_layers, dim * p->hidden_dim, group_size, weight_type);
+    w->q_w2 = init_quantized_tensors(&ptr, p->n_layers, p->hidden_dim * dim, group_size, weight_type);
+    w->q_w3 = init_quantized_tensors(&ptr, p->n_layers, dim * p->hidden_dim, group_size, weight_type);
+
+    w->q_wcls = shared_classifier ? w->q_tokens : init_quantized_tensors(&ptr, 1, dim * p->vocab_size, group_size, weight_type);
+
+    // the fp32 matmul weights are not used
+    w->wq = NULL; w->wk = NULL; w->wv = NULL; w->wo = NULL;
+    w->w1 = NULL; w->w2 = NULL; w->w3 = NULL; w->wcls = NULL;
+
+    if (!w->q_tokens || !w->q_wq || !w->q_wk || !w->q_wv || !w->q_wo
+     || !w->q_w1 || !w->q_w2 || !w->q_w3 || !w->q_wcls) {
+        free_quantized_weights(w);
+        return NULL;
+    }
+    return ptr;
+}
+
+// ----------------------------------------------------------------------------
+// ICPP: fp16 (version 4) & bf16 (version 5) checkpoints, written by scripts/quantize_model.py
+//       in the order of the quantized checkpoints: the rmsnorm weights in fp32, then
+//       all other weights as 16-bit values, in the order of the legacy format. wq, wk & wv
+//       are contiguous, as are w1, w2 & w3, so they are fused in place like the fp32
+//       weights, see fuse_qkv_weights & fuse_w13_weights.
+
+// fp16 -> fp32, exact for every finite value, including the subnormals: the exponent
+// & mantissa are moved into place, and the multiplication by 2^112 rebiases the exponent
+// from 15 to 127, and normalizes the subnormals. The SIMD loads do the same.
+// fp16 inf & nan are not supported: quantize_model.py refuses weights that overflow fp16.
+float f16_to_f32(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t bits = (uint32_t)(h & 0x7fff) << 13;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    f *= 0x1p112f;
+    memcpy(&bits, &f, sizeof(bits));
+    bits |= sign;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// bf16 -> fp32: bf16 is the upper half of an fp32
+float bf16_to_f32(uint16_t h) {
+    uint32_t bits = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// fp32 -> fp16, rounded to nearest even, for the fp16 kv cache. Values beyond the range
+// of fp16 saturate to +-65504 instead of becoming inf, which would break the softmax.
+uint16_t f32_to_f16(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    float a = fabsf(f);
+    if (!(a < 65520.0f)) { return sign | 0x7bff; } // also nan
+    if (a < 0x1p-14f) {
+        // subnormal: the mantissa counts units of 2^-24. 1024 is the smallest normal.
+        return sign | (uint16_t)lrintf(a * 0x1p24f);
+    }
+    memcpy(&bits, &a, sizeof(bits));
+    bits -= 112u << 23; // rebias the exponent from 127 to 15
+    bits += 0xfff + ((bits >> 13) & 1); // round the mantissa to 10 bits, nearest even
+    return sign | (uint16_t)(bits >> 13);
+}
+
+// ICPP: number of bytes that memory_map_weights_half maps, used to verify the upload
+size_t checkpoint_weights_size_half(Config* p, uint8_t shared_classifier) {
+    size_t head_size = p->dim / p->n_heads;
+    size_t dim = p->dim;
+    size_t kv_dim = p->n_kv_heads * head_size;
+    size_t n_layers = p->n_layers;
+    size_t bytes = (2 * n_layers + 1) * dim * sizeof(float); // rmsnorm weights
+    size_t n = p->vocab_size * dim;                          // tokens
+    n += n_layers * dim * (dim + 2 * kv_dim);                // wq, wk, wv
+    n += n_layers * dim * dim;                               // wo
+    n += n_layers * dim * p->hidden_dim * 3;                 // w1, w2, w3
+    if (!shared_classifier) { n += p->vocab_size * dim; }    // wcls
+    return bytes + n * sizeof(uint16_t);
+}
+
+void memory_map_weights_half(TransformerWeights *w, Config* p, void* ptr, uint8_t shared_classifier, WeightType weight_type) {
+    free_quantized_weights(w);
+    w->weight_type = weight_type;
+    w->group_size = 0;
+    w->layer_stride = 0; // see layer_major_weights
+    int head_size = p->dim / p->n_heads;
+    unsigned long long dim = p->dim;
+    unsigned long long n_layers = p->n_layers;
+    float* fptr = (float*) ptr;
+    w->rms_att_weight = fptr;
+    fptr += n_layers * dim;
+    w->rms_ffn_weight = fptr;
+    fptr += n_layers * dim;
+    w->rms_final_weight = fptr;
+    fptr += dim;
+
+    uint16_t* hptr = (uint16_t*) fptr;
+    w->h_tokens = hptr;
+    hptr += p->vocab_size * dim;
+    w->h_wqkv = hptr; // wq, wk & wv, until fuse_qkv_weights
+    hptr += n_layers * dim * (p->n_heads * head_size + 2 * p->n_kv_heads * head_size);
+    w->h_wo = hptr;
+    hptr += n_layers * (p->n_heads * head_size) * dim;
+    w->h_w13 = hptr; // w1, w2 & w3, until fuse_w13_weights
+    w->h_w2 = NULL;
+    hptr += n_layers * dim * p->hidden_dim * 3;
+    w->h_wcls = shared_classifier ? w->h_tokens : hptr;
+
+    // the fp32 weights are not used
+    w->token_embedding_table = NULL;
+    w->wq = NULL; w->wk = NULL; w->wv = NULL; w->wo = NULL;
+    w->w1 = NULL; w->w2 = NULL; w->w3 = NULL; w->wcls = NULL;
+    w->wqkv = NULL; w->w13 = NULL;
+}
+
 // See initialize.cpp
 // void read_checkpoint(char* checkpoint, Config* config, TransformerWeights* weights,
 //                      int* fd, float** data, ssize_t* file_size) {
@@ -210,149 +746,1445 @@ void memory_map_weights(TransformerWeights *w, Config* p, float* ptr, int shared
 // ----------------------------------------------------------------------------
 // neural net blocks; the dynamics of the Transformer
 
-void rmsnorm(float* o, float* x, float* weight, int size) {
+// ICPP: the kernels of forward are always inlined, so that in the specialized
+//       forwards their sizes are compile time constants, see forward_with_options
+#if defined(__GNUC__) || defined(__clang__)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define FORCE_INLINE inline
+#endif
+
+// ICPP: native builds run the matmuls & attention on the thread pool of thread_pool.c,
+//       once there are at least PARALLEL_MIN_WORK multiply-adds to split. Below that,
+//       waking up the workers costs more than it saves. The wasm build has 1 thread.
+#define PARALLEL_MIN_WORK 32768
+
+static inline bool use_thread_pool(long long work) {
+    return work >= PARALLEL_MIN_WORK && thread_pool_size() > 1;
+}
+
+// ICPP: SIMD kernels, selected at compile time
+//       - wasm32 : compile with -msimd128 (see icpp.toml)
+//       - native : AVX2 when compiled with -mavx2, else SSE2 (always on x86_64)
+//       Every row has its own vector accumulator, reduced once at the end.
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#define SIMD_F32_WIDTH 4
+typedef v128_t simd_f32;
+static inline simd_f32 simd_f32_zero(void) { return wasm_f32x4_splat(0.0f); }
+static inline simd_f32 simd_f32_load(const float *p) { return wasm_v128_load(p); }
+static inline simd_f32 simd_f32_madd(simd_f32 acc, simd_f32 a, simd_f32 b) { return wasm_f32x4_add(acc, wasm_f32x4_mul(a, b)); }
+static inline simd_f32 simd_f32_mul(simd_f32 a, simd_f32 b) { return wasm_f32x4_mul(a, b); }
+static inline void simd_f32_store(float *p, simd_f32 v) { wasm_v128_store(p, v); }
+static inline simd_f32 simd_f32_set1(float a) { return wasm_f32x4_splat(a); }
+static inline simd_f32 simd_f32_add(simd_f32 a, simd_f32 b) { return wasm_f32x4_add(a, b); }
+static inline simd_f32 simd_f32_sub(simd_f32 a, simd_f32 b) { return wasm_f32x4_sub(a, b); }
+static inline simd_f32 simd_f32_div(simd_f32 a, simd_f32 b) { return wasm_f32x4_div(a, b); }
+static inline simd_f32 simd_f32_min(simd_f32 a, simd_f32 b) { return wasm_f32x4_min(a, b); }
+static inline simd_f32 simd_f32_max(simd_f32 a, simd_f32 b) { return wasm_f32x4_max(a, b); }
+static inline float simd_f32_hmax(simd_f32 v) {
+    float m01 = fmaxf(wasm_f32x4_extract_lane(v, 0), wasm_f32x4_extract_lane(v, 1));
+    float m23 = fmaxf(wasm_f32x4_extract_lane(v, 2), wasm_f32x4_extract_lane(v, 3));
+    return fmaxf(m01, m23);
+}
+typedef v128_t simd_i32;
+static inline simd_i32 simd_f32_round_i32(simd_f32 v) { return wasm_i32x4_trunc_sat_f32x4(wasm_f32x4_nearest(v)); }
+static inline simd_f32 simd_i32_to_f32(simd_i32 n) { return wasm_f32x4_convert_i32x4(n); }
+static inline simd_f32 simd_f32_pow2(simd_i32 n) { return wasm_i32x4_shl(wasm_i32x4_add(n, wasm_i32x4_splat(127)), 23); }
+static inline simd_f32 simd_f32_swap_pairs(simd_f32 v) { return wasm_i32x4_shuffle(v, v, 1, 0, 3, 2); }
+// same summation order as the SSE2 hsum, so a canister samples the same tokens as native
+static inline float simd_f32_hsum(simd_f32 v) {
+    return (wasm_f32x4_extract_lane(v, 0) + wasm_f32x4_extract_lane(v, 2))
+         + (wasm_f32x4_extract_lane(v, 1) + wasm_f32x4_extract_lane(v, 3));
+}
+static inline int32_t simd_dot_i8x16(const int8_t *a, const int8_t *b) {
+    v128_t va = wasm_v128_load(a);
+    v128_t vb = wasm_v128_load(b);
+    v128_t lo = wasm_i32x4_dot_i16x8(wasm_i16x8_extend_low_i8x16(va), wasm_i16x8_extend_low_i8x16(vb));
+    v128_t hi = wasm_i32x4_dot_i16x8(wasm_i16x8_extend_high_i8x16(va), wasm_i16x8_extend_high_i8x16(vb));
+    v128_t sum = wasm_i32x4_add(lo, hi);
+    return wasm_i32x4_extract_lane(sum, 0) + wasm_i32x4_extract_lane(sum, 1)
+         + wasm_i32x4_extract_lane(sum, 2) + wasm_i32x4_extract_lane(sum, 3);
+}
+#define SIMD_I8_WIDTH 16
+// fp16 & bf16 -> fp32, see f16_to_f32
+static inline simd_f32 simd_f32_load_bf16(const uint16_t *p) { return wasm_i32x4_shl(wasm_u32x4_load16x4(p), 16); }
+static inline simd_f32 simd_f32_load_f16(const uint16_t *p) {
+    v128_t h = wasm_u32x4_load16x4(p);
+    v128_t sign = wasm_i32x4_shl(wasm_v128_and(h, wasm_i32x4_splat(0x8000)), 16);
+    v128_t bits = wasm_i32x4_shl(wasm_v128_and(h, wasm_i32x4_splat(0x7fff)), 13);
+    return wasm_v128_or(wasm_f32x4_mul(bits, wasm_f32x4_splat(0x1p112f)), sign);
+}
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_F32_WIDTH 8
+typedef __m256 simd_f32;
+static inline simd_f32 simd_f32_zero(void) { return _mm256_setzero_ps(); }
+static inline simd_f32 simd_f32_load(const float *p) { return _mm256_loadu_ps(p); }
+static inline simd_f32 simd_f32_madd(simd_f32 acc, simd_f32 a, simd_f32 b) { return _mm256_add_ps(acc, _mm256_mul_ps(a, b)); }
+static inline simd_f32 simd_f32_mul(simd_f32 a, simd_f32 b) { return _mm256_mul_ps(a, b); }
+static inline void simd_f32_store(float *p, simd_f32 v) { _mm256_storeu_ps(p, v); }
+static inline simd_f32 simd_f32_set1(float a) { return _mm256_set1_ps(a); }
+static inline simd_f32 simd_f32_add(simd_f32 a, simd_f32 b) { return _mm256_add_ps(a, b); }
+static inline simd_f32 simd_f32_sub(simd_f32 a, simd_f32 b) { return _mm256_sub_ps(a, b); }
+static inline simd_f32 simd_f32_div(simd_f32 a, simd_f32 b) { return _mm256_div_ps(a, b); }
+static inline simd_f32 simd_f32_min(simd_f32 a, simd_f32 b) { return _mm256_min_ps(a, b); }
+static inline simd_f32 simd_f32_max(simd_f32 a, simd_f32 b) { return _mm256_max_ps(a, b); }
+static inline float simd_f32_hmax(simd_f32 v) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+typedef __m256i simd_i32;
+static inline simd_i32 simd_f32_round_i32(simd_f32 v) { return _mm256_cvtps_epi32(v); }
+static inline simd_f32 simd_i32_to_f32(simd_i32 n) { return _mm256_cvtepi32_ps(n); }
+static inline simd_f32 simd_f32_pow2(simd_i32 n) { return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(n, _mm256_set1_epi32(127)), 23)); }
+static inline simd_f32 simd_f32_swap_pairs(simd_f32 v) { return _mm256_permute_ps(v, _MM_SHUFFLE(2, 3, 0, 1)); }
+static inline float simd_f32_hsum(simd_f32 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+static inline int32_t simd_dot_i8x16(const int8_t *a, const int8_t *b) {
+    __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)a));
+    __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)b));
+    __m256i prod = _mm256_madd_epi16(va, vb);
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(prod), _mm256_extracti128_si256(prod, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+#define SIMD_I8_WIDTH 16
+// fp16 & bf16 -> fp32, see f16_to_f32. F16C gives the same results, for finite values.
+static inline simd_f32 simd_f32_load_bf16(const uint16_t *p) {
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p)), 16));
+}
+static inline simd_f32 simd_f32_load_f16(const uint16_t *p) {
+#ifdef __F16C__
+    return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)p));
+#else
+    __m256i h = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p));
+    __m256i sign = _mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(0x8000)), 16);
+    __m256i bits = _mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(0x7fff)), 13);
+    return _mm256_or_ps(_mm256_mul_ps(_mm256_castsi256_ps(bits), _mm256_set1_ps(0x1p112f)), _mm256_castsi256_ps(sign));
+#endif
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_F32_WIDTH 4
+typedef __m128 simd_f32;
+static inline simd_f32 simd_f32_zero(void) { return _mm_setzero_ps(); }
+static inline simd_f32 simd_f32_load(const float *p) { return _mm_loadu_ps(p); }
+static inline simd_f32 simd_f32_madd(simd_f32 acc, simd_f32 a, simd_f32 b) { return _mm_add_ps(acc, _mm_mul_ps(a, b)); }
+static inline simd_f32 simd_f32_mul(simd_f32 a, simd_f32 b) { return _mm_mul_ps(a, b); }
+static inline void simd_f32_store(float *p, simd_f32 v) { _mm_storeu_ps(p, v); }
+static inline simd_f32 simd_f32_set1(float a) { return _mm_set1_ps(a); }
+static inline simd_f32 simd_f32_add(simd_f32 a, simd_f32 b) { return _mm_add_ps(a, b); }
+static inline simd_f32 simd_f32_sub(simd_f32 a, simd_f32 b) { return _mm_sub_ps(a, b); }
+static inline simd_f32 simd_f32_div(simd_f32 a, simd_f32 b) { return _mm_div_ps(a, b); }
+static inline simd_f32 simd_f32_min(simd_f32 a, simd_f32 b) { return _mm_min_ps(a, b); }
+static inline simd_f32 simd_f32_max(simd_f32 a, simd_f32 b) { return _mm_max_ps(a, b); }
+static inline float simd_f32_hmax(simd_f32 v) {
+    __m128 m = _mm_max_ps(v, _mm_movehl_ps(v, v));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+typedef __m128i simd_i32;
+static inline simd_i32 simd_f32_round_i32(simd_f32 v) { return _mm_cvtps_epi32(v); }
+static inline simd_f32 simd_i32_to_f32(simd_i32 n) { return _mm_cvtepi32_ps(n); }
+static inline simd_f32 simd_f32_pow2(simd_i32 n) { return _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(n, _mm_set1_epi32(127)), 23)); }
+static inline simd_f32 simd_f32_swap_pairs(simd_f32 v) { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)); }
+static inline float simd_f32_hsum(simd_f32 v) {
+    __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+static inline int32_t simd_dot_i8x16(const int8_t *a, const int8_t *b) {
+    __m128i va = _mm_loadu_si128((const __m128i *)a);
+    __m128i vb = _mm_loadu_si128((const __m128i *)b);
+    // sign extend int8 -> int16, by shifting the duplicated byte down
+    __m128i prod = _mm_add_epi32(
+        _mm_madd_epi16(_mm_srai_epi16(_mm_unpacklo_epi8(va, va), 8), _mm_srai_epi16(_mm_unpacklo_epi8(vb, vb), 8)),
+        _mm_madd_epi16(_mm_srai_epi16(_mm_unpackhi_epi8(va, va), 8), _mm_srai_epi16(_mm_unpackhi_epi8(vb, vb), 8)));
+    prod = _mm_add_epi32(prod, _mm_shuffle_epi32(prod, _MM_SHUFFLE(1, 0, 3, 2)));
+    prod = _mm_add_epi32(prod, _mm_shuffle_epi32(prod, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(prod);
+}
+#define SIMD_I8_WIDTH 16
+// fp16 & bf16 -> fp32, see f16_to_f32
+static inline simd_f32 simd_f32_load_bf16(const uint16_t *p) {
+    // the 16 bits go into the upper half of each 32-bit lane
+    return _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), _mm_loadl_epi64((const __m128i *)p)));
+}
+static inline simd_f32 simd_f32_load_f16(const uint16_t *p) {
+    __m128i h = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)p), _mm_setzero_si128());
+    __m128i sign = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16);
+    __m128i bits = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x7fff)), 13);
+    return _mm_or_ps(_mm_mul_ps(_mm_castsi128_ps(bits), _mm_set1_ps(0x1p112f)), _mm_castsi128_ps(sign));
+}
+#endif
+
+// ICPP: panels of 4 rows, interleaved per PANEL_WIDTH columns, when compiled with
+//       -DWEIGHT_PANELS (see icpp.toml) on a SIMD build, see repack_weight_panels
+#if defined(WEIGHT_PANELS) && defined(SIMD_F32_WIDTH)
+#define PANEL_WIDTH SIMD_F32_WIDTH
+#endif
+
+// ICPP: fast expf, used instead of the libm expf when compiled with -DFAST_EXPF
+//       (see icpp.toml). Range reduction x = n * ln(2) + r, with |r| <= ln(2) / 2,
+//       and a degree 6 polynomial for exp(r), with the coefficients of the Cephes
+//       expf. exp(x) = 2^n * exp(r), where 2^n is written directly into the exponent.
+//       Max relative error vs exp in double: 8.4e-8 (< 1 ulp), checked for every float
+//       in [EXPF_FAST_MIN, EXPF_FAST_MAX].
+//       x is clamped to that range, so exp(-inf) returns 1.2e-38 instead of 0, which
+//       is negligible next to the exp(0) = 1 of the max in a softmax.
+#define EXPF_FAST_MIN -87.33654f // 2^-126, the smallest normal float
+#define EXPF_FAST_MAX 88.0f
+#define EXPF_LOG2E 1.44269504088896341f
+#define EXPF_LN2_HI 0.693359375f // ln(2) = EXPF_LN2_HI + EXPF_LN2_LO, with an exact n * EXPF_LN2_HI
+#define EXPF_LN2_LO -2.12194440e-4f
+#define EXPF_P0 1.9875691500e-4f
+#define EXPF_P1 1.3981999507e-3f
+#define EXPF_P2 8.3334519073e-3f
+#define EXPF_P3 4.1665795894e-2f
+#define EXPF_P4 1.6666665459e-1f
+#define EXPF_P5 5.0000001201e-1f
+
+float expf_fast(float x) {
+    x = fminf(fmaxf(x, EXPF_FAST_MIN), EXPF_FAST_MAX);
+    float n = floorf(x * EXPF_LOG2E + 0.5f);
+    float r = x - n * EXPF_LN2_HI;
+    r = r - n * EXPF_LN2_LO;
+    float p = EXPF_P0;
+    p = p * r + EXPF_P1;
+    p = p * r + EXPF_P2;
+    p = p * r + EXPF_P3;
+    p = p * r + EXPF_P4;
+    p = p * r + EXPF_P5;
+    float y = p * r * r + r + 1.0f;
+    union { uint32_t i; float f; } pow2n = { (uint32_t)((int)n + 127) << 23 };
+    return y * pow2n.f;
+}
+
+#ifdef SIMD_F32_WIDTH
+// same as expf_fast, for SIMD_F32_WIDTH values at a time
+static inline simd_f32 simd_f32_exp(simd_f32 x) {
+    x = simd_f32_min(simd_f32_max(x, simd_f32_set1(EXPF_FAST_MIN)), simd_f32_set1(EXPF_FAST_MAX));
+    simd_i32 n = simd_f32_round_i32(simd_f32_mul(x, simd_f32_set1(EXPF_LOG2E)));
+    simd_f32 nf = simd_i32_to_f32(n);
+    simd_f32 r = simd_f32_sub(x, simd_f32_mul(nf, simd_f32_set1(EXPF_LN2_HI)));
+    r = simd_f32_sub(r, simd_f32_mul(nf, simd_f32_set1(EXPF_LN2_LO)));
+    simd_f32 p = simd_f32_set1(EXPF_P0);
+    p = simd_f32_madd(simd_f32_set1(EXPF_P1), p, r);
+    p = simd_f32_madd(simd_f32_set1(EXPF_P2), p, r);
+    p = simd_f32_madd(simd_f32_set1(EXPF_P3), p, r);
+    p = simd_f32_madd(simd_f32_set1(EXPF_P4), p, r);
+    p = simd_f32_madd(simd_f32_set1(EXPF_P5), p, r);
+    simd_f32 y = simd_f32_add(simd_f32_madd(r, simd_f32_mul(p, r), r), simd_f32_set1(1.0f));
+    return simd_f32_mul(y, simd_f32_pow2(n));
+}
+#endif
+
+#ifdef FAST_EXPF
+#define EXPF expf_fast
+#else
+#define EXPF expf
+#endif
+
+static FORCE_INLINE void rmsnorm(float* o, float* x, float* weight, int size) {
     // calculate sum of squares
+    int j = 0;
     float ss = 0.0f;
-    for (int j = 0; j < size; j++) {
+#ifdef SIMD_F32_WIDTH
+    simd_f32 acc = simd_f32_zero();
+    for (; j <= size - SIMD_F32_WIDTH; j += SIMD_F32_WIDTH) {
+        simd_f32 vx = simd_f32_load(x + j);
+        acc = simd_f32_madd(acc, vx, vx);
+    }
+    ss = simd_f32_hsum(acc);
+#endif
+    for (; j < size; j++) {
         ss += x[j] * x[j];
     }
     ss /= size;
     ss += 1e-5f;
     ss = 1.0f / sqrtf(ss);
     // normalize and scale
-    for (int j = 0; j < size; j++) {
+    j = 0;
+#ifdef SIMD_F32_WIDTH
+    simd_f32 vss = simd_f32_set1(ss);
+    for (; j <= size - SIMD_F32_WIDTH; j += SIMD_F32_WIDTH) {
+        simd_f32_store(o + j, simd_f32_mul(simd_f32_load(weight + j), simd_f32_mul(vss, simd_f32_load(x + j))));
+    }
+#endif
+    for (; j < size; j++) {
         o[j] = weight[j] * (ss * x[j]);
     }
 }
 
+// ICPP: x[i] = exp(x[i] - shift), returns sum + the sum of the new x[i].
+//       Shared by softmax & the online softmax of attention.
+static inline float exp_sum(float* x, int size, float shift, float sum) {
+    int i = 0;
+#if defined(SIMD_F32_WIDTH) && defined(FAST_EXPF)
+    if (size >= SIMD_F32_WIDTH) {
+        simd_f32 vshift = simd_f32_set1(shift);
+        simd_f32 acc = simd_f32_zero();
+        for (; i <= size - SIMD_F32_WIDTH; i += SIMD_F32_WIDTH) {
+            simd_f32 e = simd_f32_exp(simd_f32_sub(simd_f32_load(x + i), vshift));
+            simd_f32_store(x + i, e);
+            acc = simd_f32_add(acc, e);
+        }
+        sum += simd_f32_hsum(acc);
+    }
+#endif
+    for (; i < size; i++) {
+        x[i] = EXPF(x[i] - shift);
+        sum += x[i];
+    }
+    return sum;
+}
+
 void softmax(float* x, int size) {
     // find max value (for numerical stability)
+    int i = 1;
     float max_val = x[0];
-    for (int i = 1; i < size; i++) {
+#ifdef SIMD_F32_WIDTH
+    if (size >= SIMD_F32_WIDTH) {
+        simd_f32 vmax = simd_f32_load(x);
+        for (i = SIMD_F32_WIDTH; i <= size - SIMD_F32_WIDTH; i += SIMD_F32_WIDTH) {
+            vmax = simd_f32_max(vmax, simd_f32_load(x + i));
+        }
+        max_val = simd_f32_hmax(vmax);
+    }
+#endif
+    for (; i < size; i++) {
         if (x[i] > max_val) {
             max_val = x[i];
         }
     }
     // exp and sum
-    float sum = 0.0f;
-    for (int i = 0; i < size; i++) {
-        x[i] = expf(x[i] - max_val);
-        sum += x[i];
-    }
+    float sum = exp_sum(x, size, max_val, 0.0f);
     // normalize
-    for (int i = 0; i < size; i++) {
+    i = 0;
+#ifdef SIMD_F32_WIDTH
+    simd_f32 vsum = simd_f32_set1(sum);
+    for (; i <= size - SIMD_F32_WIDTH; i += SIMD_F32_WIDTH) {
+        simd_f32_store(x + i, simd_f32_div(simd_f32_load(x + i), vsum));
+    }
+#endif
+    for (; i < size; i++) {
         x[i] /= sum;
     }
 }
 
-void matmul(float* xout, float* x, float* w, int n, int d) {
+// ICPP: RoPE tables, built once in build_transformer and shared by all users.
+//       The angle only depends on (pos, head_dim), never on the layer or the user.
+//       Each pair (v0, v1) of a head is rotated into (v0 * cos - v1 * sin, v0 * sin + v1 * cos),
+//       so the tables store the cos duplicated and the sin as (-sin, sin) for each pair,
+//       which turns the rotation into vec * rope_cos + swap_pairs(vec) * rope_sin.
+bool build_rope_tables(Transformer *t) {
+    Config* p = &t->config;
+    int head_size = p->dim / p->n_heads;
+    if (t->rope_cos) { free(t->rope_cos); t->rope_cos = NULL; }
+    if (t->rope_sin) { free(t->rope_sin); t->rope_sin = NULL; }
+    t->rope_cos = malloc((size_t)p->seq_len * head_size * sizeof(float));
+    t->rope_sin = malloc((size_t)p->seq_len * head_size * sizeof(float));
+    if (!t->rope_cos || !t->rope_sin) {
+        return false; // ICPP: caller will return Err
+    }
+    for (int pos = 0; pos < p->seq_len; pos++) {
+        for (int head_dim = 0; head_dim < head_size; head_dim += 2) {
+            float freq = 1.0f / powf(10000.0f, head_dim / (float)head_size);
+            float val = pos * freq;
+            float fcr = cosf(val);
+            float fci = sinf(val);
+            size_t i = (size_t)pos * head_size + head_dim;
+            t->rope_cos[i] = fcr;
+            t->rope_cos[i + 1] = fcr;
+            t->rope_sin[i] = -fci;
+            t->rope_sin[i + 1] = fci;
+        }
+    }
+    return true;
+}
+
+// rotate the n values of vec, with the table rows of the current pos
+static FORCE_INLINE void rope_rotate(float* vec, const float* rope_cos, const float* rope_sin, int n) {
+    int i = 0;
+#ifdef SIMD_F32_WIDTH
+    for (; i <= n - SIMD_F32_WIDTH; i += SIMD_F32_WIDTH) {
+        simd_f32 v = simd_f32_load(vec + i);
+        simd_f32 out = simd_f32_mul(v, simd_f32_load(rope_cos + i));
+        out = simd_f32_madd(out, simd_f32_swap_pairs(v), simd_f32_load(rope_sin + i));
+        simd_f32_store(vec + i, out);
+    }
+#endif
+    for (; i < n; i += 2) {
+        float v0 = vec[i];
+        float v1 = vec[i+1];
+        vec[i]   = v0 * rope_cos[i] + v1 * rope_sin[i];
+        vec[i+1] = v1 * rope_cos[i+1] + v0 * rope_sin[i+1];
+    }
+}
+
+// ICPP: the weights of the unquantized matmuls are fp32, or 16-bit for the fp16 & bf16
+//       checkpoints, which are widened to fp32 as they are loaded. The kernels below
+//       are instantiated per weight type with a constant wt, see matmul_batch, so the
+//       branches on wt fold away.
+static FORCE_INLINE const void* weight_row(const void* w, unsigned long long offset, WeightType wt) {
+    if (wt == WEIGHT_TYPE_FP32) { return (const float*)w + offset; }
+    return (const uint16_t*)w + offset;
+}
+
+static FORCE_INLINE float load_weight(const void* w, int j, WeightType wt) {
+    if (wt == WEIGHT_TYPE_F16) { return f16_to_f32(((const uint16_t*)w)[j]); }
+    if (wt == WEIGHT_TYPE_BF16) { return bf16_to_f32(((const uint16_t*)w)[j]); }
+    return ((const float*)w)[j];
+}
+
+#ifdef SIMD_F32_WIDTH
+static FORCE_INLINE simd_f32 simd_f32_load_weights(const void* w, int j, WeightType wt) {
+    if (wt == WEIGHT_TYPE_F16) { return simd_f32_load_f16((const uint16_t*)w + j); }
+    if (wt == WEIGHT_TYPE_BF16) { return simd_f32_load_bf16((const uint16_t*)w + j); }
+    return simd_f32_load((const float*)w + j);
+}
+#endif
+
+// ICPP: dot products of x with 1 or 4 consecutive rows of w, the micro kernels of
+//       all unquantized matmuls. Every (row, token) dot product is summed in the same
+//       order, whether it is computed for 1 token or for a batch, see forward_prefill.
+static FORCE_INLINE float dot1(const float* x, const void* w, int n, WeightType wt) {
+#ifdef SIMD_F32_WIDTH
+    int n_simd = n - n % SIMD_F32_WIDTH;
+    simd_f32 acc = simd_f32_zero();
+    for (int j = 0; j < n_simd; j += SIMD_F32_WIDTH) {
+        acc = simd_f32_madd(acc, simd_f32_load_weights(w, j, wt), simd_f32_load(x + j));
+    }
+    float val = simd_f32_hsum(acc);
+    for (int j = n_simd; j < n; j++) {
+        val += load_weight(w, j, wt) * x[j];
+    }
+    return val;
+#else
+    float val = 0.0f;
+    for (int j = 0; j < n; j++) {
+        val += load_weight(w, j, wt) * x[j];
+    }
+    return val;
+#endif
+}
+
+// 4 rows at a time, so every load of x is used 4 times
+// ICPP: with PANEL_WIDTH, the 4 rows are one panel, read front to back as a single
+//       stream, see repack_weight_panels. The products are summed in the same order.
+static FORCE_INLINE void dot4(float* out, const float* x, const void* w, int n, WeightType wt) {
+#ifdef SIMD_F32_WIDTH
+    int n_simd = n - n % SIMD_F32_WIDTH;
+#ifdef PANEL_WIDTH
+    const int step = 4; // column j of a row is at step * j in the panel
+    const void *w0 = w;
+    const void *w1 = weight_row(w0, PANEL_WIDTH, wt);
+    const void *w2 = weight_row(w1, PANEL_WIDTH, wt);
+    const void *w3 = weight_row(w2, PANEL_WIDTH, wt);
+    const void *t0 = weight_row(w, 4ULL * n_simd, wt); // the tails, row by row
+#else
+    const int step = 1;
+    const void *w0 = w;
+    const void *w1 = weight_row(w0, n, wt);
+    const void *w2 = weight_row(w1, n, wt);
+    const void *w3 = weight_row(w2, n, wt);
+    const void *t0 = weight_row(w0, n_simd, wt);
+#endif
+    const void *t1 = weight_row(t0, step == 1 ? n : n - n_simd, wt);
+    const void *t2 = weight_row(t1, step == 1 ? n : n - n_simd, wt);
+    const void *t3 = weight_row(t2, step == 1 ? n : n - n_simd, wt);
+    simd_f32 acc0 = simd_f32_zero();
+    simd_f32 acc1 = simd_f32_zero();
+    simd_f32 acc2 = simd_f32_zero();
+    simd_f32 acc3 = simd_f32_zero();
+    for (int j = 0; j < n_simd; j += SIMD_F32_WIDTH) {
+        simd_f32 vx = simd_f32_load(x + j);
+        acc0 = simd_f32_madd(acc0, simd_f32_load_weights(w0, step * j, wt), vx);
+        acc1 = simd_f32_madd(acc1, simd_f32_load_weights(w1, step * j, wt), vx);
+        acc2 = simd_f32_madd(acc2, simd_f32_load_weights(w2, step * j, wt), vx);
+        acc3 = simd_f32_madd(acc3, simd_f32_load_weights(w3, step * j, wt), vx);
+    }
+    float val0 = simd_f32_hsum(acc0);
+    float val1 = simd_f32_hsum(acc1);
+    float val2 = simd_f32_hsum(acc2);
+    float val3 = simd_f32_hsum(acc3);
+    for (int j = n_simd; j < n; j++) {
+        val0 += load_weight(t0, j - n_simd, wt) * x[j];
+        val1 += load_weight(t1, j - n_simd, wt) * x[j];
+        val2 += load_weight(t2, j - n_simd, wt) * x[j];
+        val3 += load_weight(t3, j - n_simd, wt) * x[j];
+    }
+    out[0] = val0;
+    out[1] = val1;
+    out[2] = val2;
+    out[3] = val3;
+#else
+    for (int r = 0; r < 4; r++) {
+        out[r] = dot1(x, weight_row(w, (unsigned long long)r * n, wt), n, wt);
+    }
+#endif
+}
+
+// ICPP: the unquantized matmul weights, fp32 or 16-bit, see weight_row
+typedef struct { const void *wqkv, *wo, *w13, *w2, *wcls; } MatmulWeights;
+
+static inline MatmulWeights matmul_weights(TransformerWeights* w) {
+    if (w->weight_type == WEIGHT_TYPE_F16 || w->weight_type == WEIGHT_TYPE_BF16) {
+        MatmulWeights mw = { w->h_wqkv, w->h_wo, w->h_w13, w->h_w2, w->h_wcls };
+        return mw;
+    }
+    MatmulWeights mw = { w->wqkv, w->wo, w->w13, w->w2, w->wcls };
+    return mw;
+}
+
+// ICPP: the rmsnorm & unquantized matmul weights of layer l. Type-major, as in the
+//       checkpoint, a weight of layer l is l times its own size into its region.
+//       Layer-major, l * layer_stride values, see layer_major_weights.
+//       The matmul weights are NULL for quantized checkpoints.
+typedef struct { float *rms_att, *rms_ffn; const void *wqkv, *wo, *w13, *w2; } LayerWeights;
+
+static inline LayerWeights layer_weights(TransformerWeights* w, MatmulWeights* mw, Config* p, unsigned long long l) {
+    unsigned long long dim = p->dim;
+    unsigned long long hidden_dim = p->hidden_dim;
+    unsigned long long kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    unsigned long long stride = w->layer_stride;
+    WeightType wt = w->weight_type;
+    // the fp16 & bf16 rmsnorm weights stay type-major
+    unsigned long long rms_stride = stride && wt == WEIGHT_TYPE_FP32 ? stride : dim;
+    LayerWeights lw = { w->rms_att_weight + l * rms_stride, w->rms_ffn_weight + l * rms_stride, NULL, NULL, NULL, NULL };
+    if (mw->wqkv) {
+        lw.wqkv = weight_row(mw->wqkv, l * (stride ? stride : (dim + 2 * kv_dim) * dim), wt);
+        lw.wo = weight_row(mw->wo, l * (stride ? stride : dim * dim), wt);
+        lw.w13 = weight_row(mw->w13, l * (stride ? stride : 2 * hidden_dim * dim), wt);
+        lw.w2 = weight_row(mw->w2, l * (stride ? stride : dim * hidden_dim), wt);
+    }
+    return lw;
+}
+
+// ICPP: Repacks the unquantized matmul weights into panels, when compiled with
+//       -DWEIGHT_PANELS. A matrix (d, n) becomes d / 4 panels of 4 rows, and every
+//       panel holds PANEL_WIDTH columns of row 0, 1, 2 & 3, then the next PANEL_WIDTH
+//       columns of the 4 rows, etc. The last n % PANEL_WIDTH columns of the 4 rows
+//       follow row by row, and the last d % 4 rows stay as they are. So dot4 reads a
+//       panel as one stream, in the order of its loop, instead of 4 rows far apart.
+//       A panel takes the bytes of its 4 rows: the repacking is done in place, one
+//       panel at a time, with a buffer of 4 rows.
+//       Must be called after fuse_qkv_weights & fuse_w13_weights, and only once.
+#ifdef PANEL_WIDTH
+static void repack_panels(void* w, unsigned long long d, unsigned long long n, size_t elem, uint8_t* rows) {
+    unsigned long long n_simd = n - n % PANEL_WIDTH;
+    size_t block = PANEL_WIDTH * elem;
+    size_t tail = (n - n_simd) * elem;
+    for (unsigned long long i = 0; i + 4 <= d; i += 4) {
+        uint8_t* panel = (uint8_t*)w + i * n * elem;
+        memcpy(rows, panel, 4 * n * elem);
+        uint8_t* dst = panel;
+        for (unsigned long long j = 0; j < n_simd; j += PANEL_WIDTH) {
+            for (int r = 0; r < 4; r++) {
+                memcpy(dst, rows + (r * n + j) * elem, block);
+                dst += block;
+            }
+        }
+        for (int r = 0; r < 4; r++) {
+            memcpy(dst, rows + (r * n + n_simd) * elem, tail);
+            dst += tail;
+        }
+    }
+}
+
+// row i of a matrix (d, n) repacked by repack_panels, into x (n,) as fp32
+static void panel_row(float* x, const void* w, unsigned long long i, unsigned long long d, int n, WeightType wt) {
+    unsigned long long n_simd = n - n % PANEL_WIDTH;
+    if (i >= d - d % 4) { // not in a panel
+        const void* wi = weight_row(w, i * n, wt);
+        for (int j = 0; j < n; j++) { x[j] = load_weight(wi, j, wt); }
+        return;
+    }
+    const void* panel = weight_row(w, (i - i % 4) * n, wt);
+    int r = i % 4;
+    for (unsigned long long j = 0; j < n_simd; j++) {
+        x[j] = load_weight(panel, 4 * (j - j % PANEL_WIDTH) + r * PANEL_WIDTH + j % PANEL_WIDTH, wt);
+    }
+    const void* t = weight_row(panel, 4 * n_simd + r * (n - n_simd), wt);
+    for (unsigned long long j = n_simd; j < (unsigned long long)n; j++) {
+        x[j] = load_weight(t, j - n_simd, wt);
+    }
+}
+#endif
+
+// the number of columns per row of a panel, 0 when the weights are not repacked
+int weight_panel_width(void) {
+#ifdef PANEL_WIDTH
+    return PANEL_WIDTH;
+#else
+    return 0;
+#endif
+}
+
+bool repack_weight_panels(TransformerWeights* w, Config* p) {
+#ifdef PANEL_WIDTH
+    WeightType wt = w->weight_type;
+    if (wt != WEIGHT_TYPE_FP32 && wt != WEIGHT_TYPE_F16 && wt != WEIGHT_TYPE_BF16) {
+        return true; // the quantized matmuls read row by row
+    }
+    size_t elem = wt == WEIGHT_TYPE_FP32 ? sizeof(float) : sizeof(uint16_t);
+    unsigned long long dim = p->dim;
+    unsigned long long hidden_dim = p->hidden_dim;
+    unsigned long long kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    unsigned long long max_n = dim > hidden_dim ? dim : hidden_dim;
+    uint8_t* rows = malloc(4 * max_n * elem);
+    if (!rows) {
+        return false; // ICPP: caller will return Err
+    }
+    MatmulWeights mw = matmul_weights(w);
+    for (unsigned long long l = 0; l < (unsigned long long)p->n_layers; l++) {
+        LayerWeights lw = layer_weights(w, &mw, p, l);
+        repack_panels((void*)lw.wqkv, dim + 2 * kv_dim, dim, elem, rows);
+        repack_panels((void*)lw.wo, dim, dim, elem, rows);
+        repack_panels((void*)lw.w13, 2 * hidden_dim, dim, elem, rows);
+        repack_panels((void*)lw.w2, dim, hidden_dim, elem, rows);
+    }
+    // the token embedding table, when shared, is read with panel_row
+    repack_panels((void*)mw.wcls, p->vocab_size, dim, elem, rows);
+    free(rows);
+#else
+    (void)w; (void)p;
+#endif
+    return true;
+}
+
+// ICPP: W (d,n) @ X (n, n_batch) -> XOUT (d, n_batch), with x & xout stored per token.
+//       Cache blocking: a block of 4 rows of W is loaded from memory once, and then
+//       reused from the cache for every token of the batch.
+//       Native builds split the blocks of rows over the thread pool, see thread_pool.c
+static FORCE_INLINE void matmul_batch_rows(float* xout, float* x, const void* w, int n, int d, int n_batch, int i0, int i1, WeightType wt) {
+    for (int i = i0; i < i1; i += 4) {
+        const void *wi = weight_row(w, (unsigned long long)i * n, wt);
+        for (int b = 0; b < n_batch; b++) {
+            dot4(xout + (unsigned long long)b * d + i, x + (unsigned long long)b * n, wi, n, wt);
+        }
+    }
+}
+
+typedef struct { float* xout; float* x; const void* w; int n; int d; int n_batch; WeightType wt; } MatmulTask;
+
+static void matmul_task(void* ctx, int start, int end) {
+    MatmulTask* t = ctx;
+    switch (t->wt) {
+        case WEIGHT_TYPE_F16: matmul_batch_rows(t->xout, t->x, t->w, t->n, t->d, t->n_batch, 4 * start, 4 * end, WEIGHT_TYPE_F16); break;
+        case WEIGHT_TYPE_BF16: matmul_batch_rows(t->xout, t->x, t->w, t->n, t->d, t->n_batch, 4 * start, 4 * end, WEIGHT_TYPE_BF16); break;
+        default: matmul_batch_rows(t->xout, t->x, t->w, t->n, t->d, t->n_batch, 4 * start, 4 * end, WEIGHT_TYPE_FP32); break;
+    }
+}
+
+static FORCE_INLINE void matmul_batch_typed(float* xout, float* x, const void* w, int n, int d, int n_batch, WeightType wt) {
+    int d4 = d - d % 4;
+    int i;
+    if (use_thread_pool((long long)d4 * n * n_batch)) {
+        MatmulTask task = { xout, x, w, n, d, n_batch, wt };
+        parallel_for(d4 / 4, matmul_task, &task);
+    } else {
+        matmul_batch_rows(xout, x, w, n, d, n_batch, 0, d4, wt);
+    }
+    // remaining rows
+    for (i = d4; i < d; i++) {
+        const void *wi = weight_row(w, (unsigned long long)i * n, wt);
+        for (int b = 0; b < n_batch; b++) {
+            xout[(unsigned long long)b * d + i] = dot1(x + (unsigned long long)b * n, wi, n, wt);
+        }
+    }
+}
+
+static FORCE_INLINE void matmul_batch(float* xout, float* x, const void* w, int n, int d, int n_batch, WeightType wt) {
+    switch (wt) {
+        case WEIGHT_TYPE_F16: matmul_batch_typed(xout, x, w, n, d, n_batch, WEIGHT_TYPE_F16); break;
+        case WEIGHT_TYPE_BF16: matmul_batch_typed(xout, x, w, n, d, n_batch, WEIGHT_TYPE_BF16); break;
+        default: matmul_batch_typed(xout, x, w, n, d, n_batch, WEIGHT_TYPE_FP32); break;
+    }
+}
+
+static FORCE_INLINE void matmul(float* xout, float* x, const void* w, int n, int d, WeightType wt) {
     // W (d,n) @ x (n,) -> xout (d,)
     // by far the most amount of time is spent inside this little function
+    matmul_batch(xout, x, w, n, d, 1, wt);
+}
+
+// ICPP: hb (hidden_dim,) = silu(W1 @ x) * (W3 @ x), with the rows of W1 & W3
+//       interleaved in w13 (2 * hidden_dim, dim), see fuse_w13_weights.
+//       Both dot products stay in registers, so hb2 is not needed.
+static FORCE_INLINE float swiglu(float h1, float h3) {
+    // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
+    h1 *= (1.0f / (1.0f + EXPF(-h1)));
+    // elementwise multiply with w3(x)
+    return h1 * h3;
+}
+
+// hb = silu(hb) * hb2, for the unfused w1 & w3 of the quantized checkpoints
+static void swiglu_rows(float* hb, const float* hb2, int n) {
+    int i = 0;
+#if defined(SIMD_F32_WIDTH) && defined(FAST_EXPF)
+    simd_f32 one = simd_f32_set1(1.0f);
+    for (; i <= n - SIMD_F32_WIDTH; i += SIMD_F32_WIDTH) {
+        simd_f32 h1 = simd_f32_load(hb + i);
+        simd_f32 sigmoid = simd_f32_div(one, simd_f32_add(one, simd_f32_exp(simd_f32_sub(simd_f32_zero(), h1))));
+        simd_f32_store(hb + i, simd_f32_mul(simd_f32_mul(h1, sigmoid), simd_f32_load(hb2 + i)));
+    }
+#endif
+    for (; i < n; i++) {
+        hb[i] = swiglu(hb[i], hb2[i]);
+    }
+}
+
+static FORCE_INLINE void matmul_swiglu_rows(float* hb, float* x, const void* w13, int n, int hidden_dim, int n_batch, int i0, int i1, WeightType wt) {
+    // 2 hidden units (4 rows) at a time, so every load of x is used 4 times
+    for (int i = i0; i < i1; i += 2) {
+        const void *wi = weight_row(w13, (unsigned long long)i * 2 * n, wt);
+        for (int b = 0; b < n_batch; b++) {
+            float val[4]; // w1 row i, w3 row i, w1 row i + 1, w3 row i + 1
+            dot4(val, x + (unsigned long long)b * n, wi, n, wt);
+            hb[(unsigned long long)b * hidden_dim + i] = swiglu(val[0], val[1]);
+            hb[(unsigned long long)b * hidden_dim + i + 1] = swiglu(val[2], val[3]);
+        }
+    }
+}
+
+static void matmul_swiglu_task(void* ctx, int start, int end) {
+    MatmulTask* t = ctx;
+    switch (t->wt) {
+        case WEIGHT_TYPE_F16: matmul_swiglu_rows(t->xout, t->x, t->w, t->n, t->d, t->n_batch, 2 * start, 2 * end, WEIGHT_TYPE_F16); break;
+        case WEIGHT_TYPE_BF16: matmul_swiglu_rows(t->xout, t->x, t->w, t->n, t->d, t->n_batch, 2 * start, 2 * end, WEIGHT_TYPE_BF16); break;
+        default: matmul_swiglu_rows(t->xout, t->x, t->w, t->n, t->d, t->n_batch, 2 * start, 2 * end, WEIGHT_TYPE_FP32); break;
+    }
+}
+
+static FORCE_INLINE void matmul_swiglu_batch_typed(float* hb, float* x, const void* w13, int n, int hidden_dim, int n_batch, WeightType wt) {
+    int h2 = hidden_dim - hidden_dim % 2;
     int i;
-    #pragma omp parallel for private(i)
-    for (i = 0; i < d; i++) {
-        float val = 0.0f;
-        for (int j = 0; j < n; j++) {
-            val += w[i * n + j] * x[j];
+    if (use_thread_pool((long long)h2 * 2 * n * n_batch)) {
+        MatmulTask task = { hb, x, w13, n, hidden_dim, n_batch, wt };
+        parallel_for(h2 / 2, matmul_swiglu_task, &task);
+    } else {
+        matmul_swiglu_rows(hb, x, w13, n, hidden_dim, n_batch, 0, h2, wt);
+    }
+    // remaining hidden unit
+    for (i = h2; i < hidden_dim; i++) {
+        const void *wi = weight_row(w13, (unsigned long long)i * 2 * n, wt);
+        for (int b = 0; b < n_batch; b++) {
+            float *xb = x + (unsigned long long)b * n;
+            hb[(unsigned long long)b * hidden_dim + i] = swiglu(dot1(xb, wi, n, wt), dot1(xb, weight_row(wi, n, wt), n, wt));
+        }
+    }
+}
+
+static FORCE_INLINE void matmul_swiglu_batch(float* hb, float* x, const void* w13, int n, int hidden_dim, int n_batch, WeightType wt) {
+    switch (wt) {
+        case WEIGHT_TYPE_F16: matmul_swiglu_batch_typed(hb, x, w13, n, hidden_dim, n_batch, WEIGHT_TYPE_F16); break;
+        case WEIGHT_TYPE_BF16: matmul_swiglu_batch_typed(hb, x, w13, n, hidden_dim, n_batch, WEIGHT_TYPE_BF16); break;
+        default: matmul_swiglu_batch_typed(hb, x, w13, n, hidden_dim, n_batch, WEIGHT_TYPE_FP32); break;
+    }
+}
+
+static FORCE_INLINE void matmul_swiglu(float* hb, float* x, const void* w13, int n, int hidden_dim, WeightType wt) {
+    matmul_swiglu_batch(hb, x, w13, n, hidden_dim, 1, wt);
+}
+
+// ICPP: dot product of a quantized x (n,) with row 'in / n' of a quantized W
+static inline float dot_q80(const int8_t* xq, const float* xs, QuantizedTensor *w, unsigned long long in, int n, int group_size) {
+    float val = 0.0f;
+    int32_t ival = 0;
+
+    // do the matmul in groups of group_size
+    int j;
+    for (j = 0; j <= n - group_size; j += group_size) {
+#ifdef SIMD_I8_WIDTH
+        // ICPP: integer sums, so the result is identical to the scalar loop
+        if (group_size % SIMD_I8_WIDTH == 0) {
+            for (int k = 0; k < group_size; k += SIMD_I8_WIDTH) {
+                ival += simd_dot_i8x16(xq + j + k, w->q + in + j + k);
+            }
+        } else
+#endif
+        for (int k = 0; k < group_size; k++) {
+            ival += ((int32_t) xq[j + k]) * ((int32_t) w->q[in + j + k]);
         }
-        xout[i] = val;
+        val += ((float) ival) * w->s[(in + j) / group_size] * xs[j / group_size];
+        ival = 0;
+    }
+    return val;
+}
+
+// x is Q8_0, W is Q4_1, dequantized on the fly:
+//   sum(w * x) = sum((qw * sw + mw) * qx * sx)
+//              = sx * (sw * sum(qw * qx) + mw * sum(qx)), per group
+// ICPP: group_size is even, verified in read_checkpoint
+static inline float dot_q41(const int8_t* xq, const float* xs, QuantizedTensor *w, unsigned long long in, int n, int group_size) {
+    float val = 0.0f;
+    uint8_t *wq = (uint8_t*)w->q + in / 2;
+
+    int j;
+    for (j = 0; j <= n - group_size; j += group_size) {
+        int32_t ival = 0;
+        int32_t xsum = 0;
+        for (int k = 0; k < group_size; k += 2) {
+            uint8_t packed = wq[(j + k) / 2];
+            int32_t x0 = xq[j + k];
+            int32_t x1 = xq[j + k + 1];
+            ival += (packed & 0x0F) * x0 + (packed >> 4) * x1;
+            xsum += x0 + x1;
+        }
+        int g = (in + j) / group_size;
+        val += (ival * w->s[g] + xsum * w->m[g]) * xs[j / group_size];
+    }
+    return val;
+}
+
+// ICPP: W (d,n) @ X (n, n_batch) -> XOUT (d, n_batch), with the tokens of x quantized
+//       back to back: token b has its values at x->q + b * n & its scales at x->s + b * n / group_size.
+//       The activations x are always Q8_0.
+//       n is a multiple of group_size, verified in read_checkpoint
+typedef struct {
+    float* xout; QuantizedTensor *x; QuantizedTensor *w;
+    int n; int d; int group_size; WeightType weight_type; int n_batch;
+} MatmulQuantizedTask;
+
+static void matmul_quantized_task(void* ctx, int start, int end) {
+    MatmulQuantizedTask* t = ctx;
+    int n = t->n;
+    for (int i = start; i < end; i++) {
+        unsigned long long in = (unsigned long long)i * n;
+        for (int b = 0; b < t->n_batch; b++) {
+            const int8_t* xq = t->x->q + (unsigned long long)b * n;
+            const float* xs = t->x->s + (unsigned long long)b * n / t->group_size;
+            t->xout[(unsigned long long)b * t->d + i] = t->weight_type == WEIGHT_TYPE_Q4_1
+                ? dot_q41(xq, xs, t->w, in, n, t->group_size)
+                : dot_q80(xq, xs, t->w, in, n, t->group_size);
+        }
+    }
+}
+
+void matmul_quantized_batch(float* xout, QuantizedTensor *x, QuantizedTensor *w, int n, int d, int group_size, WeightType weight_type, int n_batch) {
+    MatmulQuantizedTask task = { xout, x, w, n, d, group_size, weight_type, n_batch };
+    if (use_thread_pool((long long)d * n * n_batch)) {
+        parallel_for(d, matmul_quantized_task, &task);
+    } else {
+        matmul_quantized_task(&task, 0, d);
+    }
+}
+
+void matmul_quantized(float* xout, QuantizedTensor *x, QuantizedTensor *w, int n, int d, int group_size, WeightType weight_type) {
+    // W (d,n) @ x (n,) -> xout (d,)
+    matmul_quantized_batch(xout, x, w, n, d, group_size, weight_type, 1);
+}
+
+// ----------------------------------------------------------------------------
+// ICPP: the kv cache is stored as fp32, fp16 or int8, see KVCacheType. A row of the
+//       cache is written once, when its token is forwarded, and read by the attention
+//       of every later token. int8 rows are quantized per kv head, with the quantize
+//       of the Q8_0 activations, so every head has its own scale.
+
+const char* kv_cache_type_name(KVCacheType kv_type) {
+    switch (kv_type) {
+        case KV_CACHE_FP16: return "fp16";
+        case KV_CACHE_INT8: return "int8";
+        default: return "fp32";
+    }
+}
+
+// bytes of the key & value caches of one RunState
+size_t kv_cache_bytes(Config* p, KVCacheType kv_type) {
+    size_t kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    size_t n = (size_t)p->n_layers * p->seq_len * kv_dim;
+    size_t n_scales = (size_t)p->n_layers * p->seq_len * p->n_kv_heads;
+    switch (kv_type) {
+        case KV_CACHE_FP16: return 2 * n * sizeof(uint16_t);
+        case KV_CACHE_INT8: return 2 * (n * sizeof(int8_t) + n_scales * sizeof(float));
+        default: return 2 * n * sizeof(float);
+    }
+}
+
+// ICPP: bytes that malloc_run_state allocates for a RunState with a kv cache of kv_type
+size_t run_state_bytes(Config* p, KVCacheType kv_type) {
+    size_t kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    size_t n = 3 * p->dim + 2 * p->hidden_dim + p->dim + 2 * kv_dim + p->vocab_size;
+    size_t n_q = p->dim + p->hidden_dim; // xq & hq
+    return n * sizeof(float) + n_q * (sizeof(int8_t) + sizeof(float)) + kv_cache_bytes(p, kv_type);
+}
+
+// writes k & v (kv_dim,) into the row of the cache at offset off = loff + pos * kv_dim
+static FORCE_INLINE void kv_cache_store(RunState* s, unsigned long long off, const float* k, const float* v, int kv_dim, int head_size) {
+    switch (s->kv_type) {
+        case KV_CACHE_FP16:
+            for (int i = 0; i < kv_dim; i++) {
+                s->key_cache_f16[off + i] = f32_to_f16(k[i]);
+                s->value_cache_f16[off + i] = f32_to_f16(v[i]);
+            }
+            break;
+        case KV_CACHE_INT8: {
+            QuantizedTensor kq = { s->key_cache_q + off, s->key_cache_s + off / head_size, NULL };
+            QuantizedTensor vq = { s->value_cache_q + off, s->value_cache_s + off / head_size, NULL };
+            quantize(&kq, (float*)k, kv_dim, head_size);
+            quantize(&vq, (float*)v, kv_dim, head_size);
+            break;
+        }
+        default:
+            memcpy(s->key_cache + off, k, kv_dim * sizeof(float));
+            memcpy(s->value_cache + off, v, kv_dim * sizeof(float));
+            break;
+    }
+}
+
+// q . k, for the key of one head at offset off of the cache
+static FORCE_INLINE float kv_cache_key_dot(RunState* s, unsigned long long off, const float* q, int head_size) {
+    float score = 0.0f;
+    switch (s->kv_type) {
+        case KV_CACHE_FP16: {
+            const uint16_t* k = s->key_cache_f16 + off;
+            for (int i = 0; i < head_size; i++) {
+                score += q[i] * f16_to_f32(k[i]);
+            }
+            return score;
+        }
+        case KV_CACHE_INT8: {
+            const int8_t* k = s->key_cache_q + off;
+            for (int i = 0; i < head_size; i++) {
+                score += q[i] * k[i];
+            }
+            return score * s->key_cache_s[off / head_size];
+        }
+        default: {
+            const float* k = s->key_cache + off;
+            for (int i = 0; i < head_size; i++) {
+                score += q[i] * k[i];
+            }
+            return score;
+        }
+    }
+}
+
+// xb += a * v, for the value of one head at offset off of the cache
+static FORCE_INLINE void kv_cache_value_add(RunState* s, unsigned long long off, float a, float* xb, int head_size) {
+    switch (s->kv_type) {
+        case KV_CACHE_FP16: {
+            const uint16_t* v = s->value_cache_f16 + off;
+            for (int i = 0; i < head_size; i++) {
+                xb[i] += a * f16_to_f32(v[i]);
+            }
+            break;
+        }
+        case KV_CACHE_INT8: {
+            const int8_t* v = s->value_cache_q + off;
+            float as = a * s->value_cache_s[off / head_size];
+            for (int i = 0; i < head_size; i++) {
+                xb[i] += as * v[i];
+            }
+            break;
+        }
+        default: {
+            const float* v = s->value_cache + off;
+            for (int i = 0; i < head_size; i++) {
+                xb[i] += a * v[i];
+            }
+            break;
+        }
+    }
+}
+
+// reads the key (kv_dim,) of the row of the cache at offset off into k, as fp32
+static void kv_cache_load_key(RunState* s, unsigned long long off, float* k, int kv_dim, int head_size) {
+    switch (s->kv_type) {
+        case KV_CACHE_FP16:
+            for (int i = 0; i < kv_dim; i++) {
+                k[i] = f16_to_f32(s->key_cache_f16[off + i]);
+            }
+            break;
+        case KV_CACHE_INT8:
+            for (int i = 0; i < kv_dim; i++) {
+                k[i] = s->key_cache_q[off + i] * s->key_cache_s[(off + i) / head_size];
+            }
+            break;
+        default:
+            memcpy(k, s->key_cache + off, kv_dim * sizeof(float));
+            break;
+    }
+}
+
+// writes the key k (kv_dim,) only into the row of the cache at offset off
+static void kv_cache_store_key(RunState* s, unsigned long long off, float* k, int kv_dim, int head_size) {
+    switch (s->kv_type) {
+        case KV_CACHE_FP16:
+            for (int i = 0; i < kv_dim; i++) {
+                s->key_cache_f16[off + i] = f32_to_f16(k[i]);
+            }
+            break;
+        case KV_CACHE_INT8: {
+            QuantizedTensor kq = { s->key_cache_q + off, s->key_cache_s + off / head_size, NULL };
+            quantize(&kq, k, kv_dim, head_size);
+            break;
+        }
+        default:
+            memcpy(s->key_cache + off, k, kv_dim * sizeof(float));
+            break;
+    }
+}
+
+// moves the n keys & values at offset src of the cache to offset dst, with their scales
+static void kv_cache_move(RunState* s, unsigned long long dst, unsigned long long src, size_t n, int head_size) {
+    switch (s->kv_type) {
+        case KV_CACHE_FP16:
+            memmove(s->key_cache_f16 + dst, s->key_cache_f16 + src, n * sizeof(uint16_t));
+            memmove(s->value_cache_f16 + dst, s->value_cache_f16 + src, n * sizeof(uint16_t));
+            break;
+        case KV_CACHE_INT8:
+            memmove(s->key_cache_q + dst, s->key_cache_q + src, n * sizeof(int8_t));
+            memmove(s->value_cache_q + dst, s->value_cache_q + src, n * sizeof(int8_t));
+            memmove(s->key_cache_s + dst / head_size, s->key_cache_s + src / head_size, n / head_size * sizeof(float));
+            memmove(s->value_cache_s + dst / head_size, s->value_cache_s + src / head_size, n / head_size * sizeof(float));
+            break;
+        default:
+            memmove(s->key_cache + dst, s->key_cache + src, n * sizeof(float));
+            memmove(s->value_cache + dst, s->value_cache + src, n * sizeof(float));
+            break;
+    }
+}
+
+// rotate the n values of vec back, with the table rows of the number of positions
+static FORCE_INLINE void rope_unrotate(float* vec, const float* rope_cos, const float* rope_sin, int n) {
+    for (int i = 0; i < n; i += 2) {
+        float v0 = vec[i];
+        float v1 = vec[i+1];
+        vec[i]   = v0 * rope_cos[i] - v1 * rope_sin[i];
+        vec[i+1] = v1 * rope_cos[i+1] - v0 * rope_sin[i+1];
+    }
+}
+
+// ICPP: attention sinks with a rolling window, see generation_make_room in inference.cpp.
+//       Evicts the n_evict positions n_sinks..n_sinks+n_evict-1 from the kv cache holding
+//       the positions 0..pos-1. The later positions move down by n_evict, and their keys
+//       are rotated back by n_evict positions, so the cache holds the consecutive RoPE
+//       positions 0..pos-n_evict-1 again, and attention does not change. The values do
+//       not depend on the position. The fp16 & int8 keys are rounded again.
+void kv_cache_evict(RunState* s, Transformer* t, int n_sinks, int n_evict, int pos) {
+    Config* p = &t->config;
+    int head_size = p->dim / p->n_heads;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int n_move = pos - n_sinks - n_evict;
+    if (n_sinks < 0 || n_evict <= 0 || n_evict >= p->seq_len || n_move < 0) {
+        return;
+    }
+    const float* rope_cos = t->rope_cos + (size_t)n_evict * head_size;
+    const float* rope_sin = t->rope_sin + (size_t)n_evict * head_size;
+    float* k = s->xb; // scratch (dim,), free between two forwards
+    for (int l = 0; l < p->n_layers; l++) {
+        unsigned long long dst = ((unsigned long long)l * p->seq_len + n_sinks) * kv_dim;
+        unsigned long long src = dst + (unsigned long long)n_evict * kv_dim;
+        kv_cache_move(s, dst, src, (size_t)n_move * kv_dim, head_size);
+        for (int r = 0; r < n_move; r++) {
+            unsigned long long off = dst + (unsigned long long)r * kv_dim;
+            kv_cache_load_key(s, off, k, kv_dim, head_size);
+            for (int h = 0; h < kv_dim; h += head_size) {
+                rope_unrotate(k + h, rope_cos, rope_sin, head_size);
+            }
+            kv_cache_store_key(s, off, k, kv_dim, head_size);
+        }
+    }
+}
+
+// ICPP: multihead attention of the query q at position pos, over the kv cache of one
+//       layer at offset loff, for positions 0..pos inclusively. The result goes into xb.
+//       Single pass, with an online softmax: the timesteps are processed in tiles of
+//       ATTENTION_TILE, and the weighted sum of the values is rescaled whenever the
+//       running max of the scores increases. No (n_heads, seq_len) buffer is needed.
+#define ATTENTION_TILE 32
+
+//       Native builds split the heads over the thread pool.
+static FORCE_INLINE void attention_heads(RunState* s, unsigned long long loff, float* q_pos, float* xb_pos, int pos,
+                                         int dim, int n_heads, int n_kv_heads, int h0, int h1) {
+    int kv_dim = (dim * n_kv_heads) / n_heads;
+    int kv_mul = n_heads / n_kv_heads; // integer multiplier of the kv sharing in multiquery
+    int head_size = dim / n_heads;
+    float sqrt_head_size = sqrtf(head_size);
+    for (int h = h0; h < h1; h++) {
+        // get the query vector for this head
+        float* q = q_pos + h * head_size;
+        // the weighted sum of the values goes directly into xb
+        float* xb = xb_pos + h * head_size;
+        memset(xb, 0, head_size * sizeof(float));
+        float max_score = -INFINITY; // running max of the scores
+        float sum = 0.0f;            // running sum of exp(score - max_score)
+        for (int t0 = 0; t0 <= pos; t0 += ATTENTION_TILE) {
+            int t1 = t0 + ATTENTION_TILE <= pos + 1 ? t0 + ATTENTION_TILE : pos + 1;
+            // attention scores of this tile, as the dot product of q and k
+            float att[ATTENTION_TILE];
+            float tile_max = -INFINITY;
+            for (int t = t0; t < t1; t++) {
+                unsigned long long k_off = loff + t * kv_dim + (h / kv_mul) * head_size;
+                float score = kv_cache_key_dot(s, k_off, q, head_size);
+                score /= sqrt_head_size;
+                att[t - t0] = score;
+                if (score > tile_max) { tile_max = score; }
+            }
+            // rescale what we have so far to the new max
+            if (tile_max > max_score) {
+                float correction = EXPF(max_score - tile_max);
+                sum *= correction;
+                for (int i = 0; i < head_size; i++) {
+                    xb[i] *= correction;
+                }
+                max_score = tile_max;
+            }
+            // accumulate the weighted values of this tile
+            sum = exp_sum(att, t1 - t0, max_score, sum);
+            for (int t = t0; t < t1; t++) {
+                float a = att[t - t0];
+                kv_cache_value_add(s, loff + t * kv_dim + (h / kv_mul) * head_size, a, xb, head_size);
+            }
+        }
+        // normalize
+        float inv_sum = 1.0f / sum;
+        for (int i = 0; i < head_size; i++) {
+            xb[i] *= inv_sum;
+        }
+    }
+}
+
+typedef struct {
+    RunState* s; unsigned long long loff; float* q_pos; float* xb_pos; int pos;
+    int dim; int n_heads; int n_kv_heads;
+} AttentionTask;
+
+static void attention_task(void* ctx, int start, int end) {
+    AttentionTask* t = ctx;
+    attention_heads(t->s, t->loff, t->q_pos, t->xb_pos, t->pos, t->dim, t->n_heads, t->n_kv_heads, start, end);
+}
+
+static FORCE_INLINE void attention(RunState* s, unsigned long long loff, float* q_pos, float* xb_pos, int pos,
+                                   int dim, int n_heads, int n_kv_heads) {
+    if (use_thread_pool(2LL * (pos + 1) * dim)) {
+        AttentionTask task = { s, loff, q_pos, xb_pos, pos, dim, n_heads, n_kv_heads };
+        parallel_for(n_heads, attention_task, &task);
+    } else {
+        attention_heads(s, loff, q_pos, xb_pos, pos, dim, n_heads, n_kv_heads, 0, n_heads);
+    }
+}
+
+// ICPP: Q8_0 & Q4_1 quantize the activations, fp32, fp16 & bf16 do not
+static inline bool weight_type_quantized(WeightType weight_type) {
+    return weight_type == WEIGHT_TYPE_Q8_0 || weight_type == WEIGHT_TYPE_Q4_1;
+}
+
+// ICPP: Counts the distinct 4 KiB pages of the weights & of the kv cache that each
+//       forward pass reads or writes, when compiled with -DPAGE_STATS (see icpp.toml).
+//       The IC meters the memory a message touches in pages of 4 KiB, so this shows
+//       what a layout change saves, eg. layer_major_weights. Every range a pass touches
+//       is logged, and when the next pass begins the ranges are sorted & merged, so a
+//       page touched twice in a pass counts once. The totals are read with page_stats.
+typedef enum { PAGES_WEIGHTS = 0, PAGES_KV_CACHE = 1, PAGE_KINDS = 2 } PageKind;
+
+#ifdef PAGE_STATS
+#define STATS_PAGE_SIZE 4096
+#define PAGE_RANGES_MAX 16384
+typedef struct { uintptr_t first, last; } PageRange; // pages, both included
+static PageRange page_ranges[PAGE_KINDS][PAGE_RANGES_MAX];
+static int n_page_ranges[PAGE_KINDS];
+static PageStats page_totals;
+static bool page_pass_open = false;
+static int page_pass_tokens = 0;
+
+static int compare_page_ranges(const void* a, const void* b) {
+    uintptr_t first_a = ((const PageRange*)a)->first;
+    uintptr_t first_b = ((const PageRange*)b)->first;
+    return first_a < first_b ? -1 : first_a > first_b;
+}
+
+// sorts & merges the logged ranges of a kind, returns the number of distinct pages
+static unsigned long long page_ranges_merge(int kind) {
+    PageRange* r = page_ranges[kind];
+    int n = n_page_ranges[kind];
+    if (n == 0) {
+        return 0;
+    }
+    qsort(r, n, sizeof(PageRange), compare_page_ranges);
+    int m = 0;
+    for (int i = 1; i < n; i++) {
+        if (r[i].first <= r[m].last + 1) {
+            if (r[i].last > r[m].last) { r[m].last = r[i].last; }
+        } else {
+            r[++m] = r[i];
+        }
+    }
+    n_page_ranges[kind] = m + 1;
+    unsigned long long pages = 0;
+    for (int i = 0; i <= m; i++) {
+        pages += r[i].last - r[i].first + 1;
+    }
+    return pages;
+}
+
+static void page_pass_flush(void) {
+    if (!page_pass_open) {
+        return;
+    }
+    page_totals.passes += 1;
+    page_totals.tokens += page_pass_tokens;
+    page_totals.weight_pages += page_ranges_merge(PAGES_WEIGHTS);
+    page_totals.kv_cache_pages += page_ranges_merge(PAGES_KV_CACHE);
+    n_page_ranges[PAGES_WEIGHTS] = 0;
+    n_page_ranges[PAGES_KV_CACHE] = 0;
+    page_pass_open = false;
+}
+#endif
+
+// a forward pass of n_tokens tokens begins
+static inline void page_pass_begin(int n_tokens) {
+#ifdef PAGE_STATS
+    page_pass_flush();
+    page_pass_open = true;
+    page_pass_tokens = n_tokens;
+#else
+    (void)n_tokens;
+#endif
+}
+
+static inline void page_touch(PageKind kind, const void* ptr, size_t bytes) {
+#ifdef PAGE_STATS
+    if (bytes == 0) {
+        return;
+    }
+    if (n_page_ranges[kind] == PAGE_RANGES_MAX) {
+        page_ranges_merge(kind);
+        if (n_page_ranges[kind] == PAGE_RANGES_MAX) { // not expected: a page may count twice
+            unsigned long long pages = page_ranges_merge(kind);
+            if (kind == PAGES_WEIGHTS) { page_totals.weight_pages += pages; }
+            else { page_totals.kv_cache_pages += pages; }
+            n_page_ranges[kind] = 0;
+        }
+    }
+    PageRange r = { (uintptr_t)ptr / STATS_PAGE_SIZE, ((uintptr_t)ptr + bytes - 1) / STATS_PAGE_SIZE };
+    page_ranges[kind][n_page_ranges[kind]++] = r;
+#else
+    (void)kind; (void)ptr; (void)bytes;
+#endif
+}
+
+bool page_stats(PageStats* stats, bool clear) {
+#ifdef PAGE_STATS
+    page_pass_flush();
+    *stats = page_totals;
+    if (clear) {
+        memset(&page_totals, 0, sizeof(PageStats));
+    }
+    return true;
+#else
+    memset(stats, 0, sizeof(PageStats));
+    (void)clear;
+    return false;
+#endif
+}
+
+// the values [offset, offset + n) of an unquantized weight
+static inline void page_touch_weight(const void* w, unsigned long long offset, unsigned long long n, WeightType wt) {
+    size_t elem = wt == WEIGHT_TYPE_FP32 ? sizeof(float) : sizeof(uint16_t);
+    page_touch(PAGES_WEIGHTS, weight_row(w, offset, wt), n * elem);
+}
+
+// the values [offset, offset + n) of a quantized weight
+static inline void page_touch_quantized(const QuantizedTensor* t, unsigned long long offset, unsigned long long n, int gs, WeightType wt) {
+    if (wt == WEIGHT_TYPE_Q4_1) {
+        page_touch(PAGES_WEIGHTS, t->q + offset / 2, n / 2);
+        page_touch(PAGES_WEIGHTS, t->m + offset / gs, n / gs * sizeof(float));
+    } else {
+        page_touch(PAGES_WEIGHTS, t->q + offset, n);
+    }
+    page_touch(PAGES_WEIGHTS, t->s + offset / gs, n / gs * sizeof(float));
+}
+
+// the weights of layer l, without full only those up to the kv cache write
+static inline void page_touch_layer(TransformerWeights* w, LayerWeights* lw, Config* p, unsigned long long l, bool full) {
+    unsigned long long dim = p->dim;
+    unsigned long long hidden_dim = p->hidden_dim;
+    unsigned long long kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    WeightType wt = w->weight_type;
+    int gs = w->group_size;
+    bool quantized = wt == WEIGHT_TYPE_Q8_0 || wt == WEIGHT_TYPE_Q4_1;
+    page_touch(PAGES_WEIGHTS, lw->rms_att, dim * sizeof(float));
+    if (quantized) {
+        page_touch_quantized(w->q_wq + l, 0, dim * dim, gs, wt);
+        page_touch_quantized(w->q_wk + l, 0, dim * kv_dim, gs, wt);
+        page_touch_quantized(w->q_wv + l, 0, dim * kv_dim, gs, wt);
+    } else {
+        page_touch_weight(lw->wqkv, 0, (dim + 2 * kv_dim) * dim, wt);
+    }
+    if (!full) {
+        return;
+    }
+    page_touch(PAGES_WEIGHTS, lw->rms_ffn, dim * sizeof(float));
+    if (quantized) {
+        page_touch_quantized(w->q_wo + l, 0, dim * dim, gs, wt);
+        page_touch_quantized(w->q_w1 + l, 0, dim * hidden_dim, gs, wt);
+        page_touch_quantized(w->q_w3 + l, 0, dim * hidden_dim, gs, wt);
+        page_touch_quantized(w->q_w2 + l, 0, dim * hidden_dim, gs, wt);
+    } else {
+        page_touch_weight(lw->wo, 0, dim * dim, wt);
+        page_touch_weight(lw->w13, 0, 2 * hidden_dim * dim, wt);
+        page_touch_weight(lw->w2, 0, dim * hidden_dim, wt);
+    }
+}
+
+// the final rmsnorm & the classifier
+static inline void page_touch_classifier(TransformerWeights* w, MatmulWeights* mw, Config* p) {
+    unsigned long long n = (unsigned long long)p->vocab_size * p->dim;
+    page_touch(PAGES_WEIGHTS, w->rms_final_weight, p->dim * sizeof(float));
+    if (w->weight_type == WEIGHT_TYPE_Q8_0 || w->weight_type == WEIGHT_TYPE_Q4_1) {
+        page_touch_quantized(w->q_wcls, 0, n, w->group_size, w->weight_type);
+    } else {
+        page_touch_weight(mw->wcls, 0, n, w->weight_type);
+    }
+}
+
+// the kv cache rows of positions first..last of the layer at loff
+static inline void page_touch_kv_cache(RunState* s, unsigned long long loff, int first, int last, int kv_dim, int head_size) {
+    unsigned long long off = loff + (unsigned long long)first * kv_dim;
+    unsigned long long n = (unsigned long long)(last - first + 1) * kv_dim;
+    switch (s->kv_type) {
+        case KV_CACHE_FP16:
+            page_touch(PAGES_KV_CACHE, s->key_cache_f16 + off, n * sizeof(uint16_t));
+            page_touch(PAGES_KV_CACHE, s->value_cache_f16 + off, n * sizeof(uint16_t));
+            break;
+        case KV_CACHE_INT8:
+            page_touch(PAGES_KV_CACHE, s->key_cache_q + off, n);
+            page_touch(PAGES_KV_CACHE, s->value_cache_q + off, n);
+            page_touch(PAGES_KV_CACHE, s->key_cache_s + off / head_size, n / head_size * sizeof(float));
+            page_touch(PAGES_KV_CACHE, s->value_cache_s + off / head_size, n / head_size * sizeof(float));
+            break;
+        default:
+            page_touch(PAGES_KV_CACHE, s->key_cache + off, n * sizeof(float));
+            page_touch(PAGES_KV_CACHE, s->value_cache + off, n * sizeof(float));
+            break;
+    }
+}
+
+// ICPP: copies the token embedding into x, for every weight type
+static FORCE_INLINE void embedding_row(float* x, TransformerWeights* w, int token, int dim, int vocab_size) {
+    unsigned long long offset = (unsigned long long)token * dim;
+    if (w->weight_type == WEIGHT_TYPE_Q8_0 || w->weight_type == WEIGHT_TYPE_Q4_1) {
+        page_touch_quantized(w->q_tokens, offset, dim, w->group_size, w->weight_type);
+    } else {
+        page_touch_weight(w->token_embedding_table ? (const void*)w->token_embedding_table : (const void*)w->h_tokens, offset, dim, w->weight_type);
+    }
+#ifdef PANEL_WIDTH
+    // shared with the classifier, which was repacked, see repack_weight_panels
+    if ((w->wcls && w->wcls == w->token_embedding_table) || (w->h_wcls && w->h_wcls == w->h_tokens)) {
+        page_touch_weight(w->wcls ? (const void*)w->wcls : (const void*)w->h_wcls, (offset - offset % (4ULL * dim)), 4ULL * dim, w->weight_type);
+        panel_row(x, w->wcls ? (const void*)w->wcls : (const void*)w->h_wcls, token, vocab_size, dim, w->weight_type);
+        return;
+    }
+#else
+    (void)vocab_size; // only the panels of the classifier need it
+#endif
+    switch (w->weight_type) {
+        case WEIGHT_TYPE_Q8_0:
+        case WEIGHT_TYPE_Q4_1:
+            dequantize_row(w->q_tokens, token, x, dim, w->group_size, w->weight_type);
+            break;
+        case WEIGHT_TYPE_F16:
+            for (int i = 0; i < dim; i++) { x[i] = f16_to_f32(w->h_tokens[offset + i]); }
+            break;
+        case WEIGHT_TYPE_BF16:
+            for (int i = 0; i < dim; i++) { x[i] = bf16_to_f32(w->h_tokens[offset + i]); }
+            break;
+        default:
+            memcpy(x, w->token_embedding_table + offset, dim * sizeof(float));
+            break;
     }
 }
 
 float* forward(RunState *runstate, Chat *chat, Transformer* transformer, int token, int pos) {
+    ForwardOptions options = { true };
+    return forward_with_options(runstate, chat, transformer, token, pos, options);
+}
+
+// ICPP: With options.logits false, forward only fills the kv cache and returns NULL.
+//       Everything after the kv cache write of the last layer only feeds the logits,
+//       so the attention & ffn of the last layer, the final rmsnorm & the classifier
+//       are skipped.
+static FORCE_INLINE float* forward_impl(RunState *runstate, Chat *chat, Transformer* transformer, int token, int pos, ForwardOptions options,
+                                        int dim, int n_heads, int n_kv_heads, int hidden_dim) {
 
     // a few convenience variables
     Config* p = &transformer->config;
     TransformerWeights* w = &transformer->weights;
     RunState* s = runstate;
     float *x = s->x;
-    int dim = p->dim;
-    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
-    int kv_mul = p->n_heads / p->n_kv_heads; // integer multiplier of the kv sharing in multiquery
-    int hidden_dim =  p->hidden_dim;
-    int head_size = dim / p->n_heads;
+    int kv_dim = (dim * n_kv_heads) / n_heads;
+    int head_size = dim / n_heads;
+    int quantized = weight_type_quantized(w->weight_type); // ICPP
+    int gs = w->group_size;
+    WeightType wt = w->weight_type;
+    MatmulWeights mw = matmul_weights(w);
+    float* rope_cos = transformer->rope_cos + pos * head_size; // ICPP
+    float* rope_sin = transformer->rope_sin + pos * head_size;
+    page_pass_begin(1); // ICPP
 
     // copy the token embedding into x
-    float* content_row = w->token_embedding_table + token * dim;
-    memcpy(x, content_row, dim*sizeof(*x));
+    embedding_row(x, w, token, dim, p->vocab_size);
 
     // forward all the layers
     for(unsigned long long l = 0; l < p->n_layers; l++) {
+        LayerWeights lw = layer_weights(w, &mw, p, l); // ICPP
+        page_touch_layer(w, &lw, p, l, options.logits || l + 1 < (unsigned long long)p->n_layers);
 
         // attention rmsnorm
-        rmsnorm(s->xb, x, w->rms_att_weight + l*dim, dim);
+        rmsnorm(s->xb, x, lw.rms_att, dim);
 
         // qkv matmuls for this position
-        matmul(s->q, s->xb, w->wq + l*dim*dim, dim, dim);
-        matmul(s->k, s->xb, w->wk + l*dim*kv_dim, dim, kv_dim);
-        matmul(s->v, s->xb, w->wv + l*dim*kv_dim, dim, kv_dim);
+        if (quantized) {
+            quantize(&s->xq, s->xb, dim, gs);
+            matmul_quantized(s->q, &s->xq, w->q_wq + l, dim, dim, gs, wt);
+            matmul_quantized(s->k, &s->xq, w->q_wk + l, dim, kv_dim, gs, wt);
+            matmul_quantized(s->v, &s->xq, w->q_wv + l, dim, kv_dim, gs, wt);
+        } else {
+            // ICPP: fused, writes s->q, s->k & s->v, which are contiguous
+            matmul(s->q, s->xb, lw.wqkv, dim, dim + 2*kv_dim, wt);
+        }
 
         // RoPE relative positional encoding: complex-valued rotate q and k in each head
-        for (int i = 0; i < dim; i+=2) {
-            int head_dim = i % head_size;
-            float freq = 1.0f / powf(10000.0f, head_dim / (float)head_size);
-            float val = pos * freq;
-            float fcr = cosf(val);
-            float fci = sinf(val);
-            int rotn = i < kv_dim ? 2 : 1; // how many vectors? 2 = q & k, 1 = q only
-            for (int v = 0; v < rotn; v++) {
-                float* vec = v == 0 ? s->q : s->k; // the vector to rotate (query or key)
-                float v0 = vec[i];
-                float v1 = vec[i+1];
-                vec[i]   = v0 * fcr - v1 * fci;
-                vec[i+1] = v0 * fci + v1 * fcr;
-            }
+        // ICPP: with the precomputed tables, see build_rope_tables
+        for (int h = 0; h < n_heads; h++) {
+            rope_rotate(s->q + h * head_size, rope_cos, rope_sin, head_size);
+        }
+        for (int h = 0; h < n_kv_heads; h++) {
+            rope_rotate(s->k + h * head_size, rope_cos, rope_sin, head_size);
         }
 
         // save key,value at this time step (pos) to our kv cache
-        int loff = l * p->seq_len * kv_dim; // kv cache layer offset for convenience
-        float* key_cache_row = s->key_cache + loff + pos * kv_dim;
-        float* value_cache_row = s->value_cache + loff + pos * kv_dim;
-        memcpy(key_cache_row, s->k, kv_dim * sizeof(*key_cache_row));
-        memcpy(value_cache_row, s->v, kv_dim * sizeof(*value_cache_row));
+        unsigned long long loff = l * p->seq_len * kv_dim; // kv cache layer offset for convenience
+        kv_cache_store(s, loff + pos * kv_dim, s->k, s->v, kv_dim, head_size); // ICPP
+        page_touch_kv_cache(s, loff, pos, pos, kv_dim, head_size);
 
-        // multihead attention. iterate over all heads
-        int h;
-        #pragma omp parallel for private(h)
-        for (h = 0; h < p->n_heads; h++) {
-            // get the query vector for this head
-            float* q = s->q + h * head_size;
-            // attention scores for this head
-            float* att = s->att + h * p->seq_len;
-            // iterate over all timesteps, including the current one
-            for (int t = 0; t <= pos; t++) {
-                // get the key vector for this head and at this timestep
-                float* k = s->key_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
-                // calculate the attention score as the dot product of q and k
-                float score = 0.0f;
-                for (int i = 0; i < head_size; i++) {
-                    score += q[i] * k[i];
-                }
-                score /= sqrtf(head_size);
-                // save the score to the attention buffer
-                att[t] = score;
-            }
-
-            // softmax the scores to get attention weights, from 0..pos inclusively
-            softmax(att, pos + 1);
-
-            // weighted sum of the values, store back into xb
-            float* xb = s->xb + h * head_size;
-            memset(xb, 0, head_size * sizeof(float));
-            for (int t = 0; t <= pos; t++) {
-                // get the value vector for this head and at this timestep
-                float* v = s->value_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
-                // get the attention weight for this timestep
-                float a = att[t];
-                // accumulate the weighted value into xb
-                for (int i = 0; i < head_size; i++) {
-                    xb[i] += a * v[i];
-                }
-            }
+        // ICPP: the rest of the last layer only feeds the logits
+        if (!options.logits && l == p->n_layers - 1) {
+            return NULL;
         }
 
+        // multihead attention. iterate over all heads
+        page_touch_kv_cache(s, loff, 0, pos, kv_dim, head_size); // ICPP
+        attention(s, loff, s->q, s->xb, pos, dim, n_heads, n_kv_heads);
+
         // final matmul to get the output of the attention
-        matmul(s->xb2, s->xb, w->wo + l*dim*dim, dim, dim);
+        if (quantized) {
+            quantize(&s->xq, s->xb, dim, gs);
+            matmul_quantized(s->xb2, &s->xq, w->q_wo + l, dim, dim, gs, wt);
+        } else {
+            matmul(s->xb2, s->xb, lw.wo, dim, dim, wt);
+        }
 
         // residual connection back into x
         for (int i = 0; i < dim; i++) {
@@ -360,25 +2192,29 @@ float* forward(RunState *runstate, Chat *chat, Transformer* transformer, int tok
         }
 
         // ffn rmsnorm
-        rmsnorm(s->xb, x, w->rms_ffn_weight + l*dim, dim);
+        rmsnorm(s->xb, x, lw.rms_ffn, dim);
 
         // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
         // first calculate self.w1(x) and self.w3(x)
-        matmul(s->hb, s->xb, w->w1 + l*dim*hidden_dim, dim, hidden_dim);
-        matmul(s->hb2, s->xb, w->w3 + l*dim*hidden_dim, dim, hidden_dim);
+        if (quantized) {
+            quantize(&s->xq, s->xb, dim, gs);
+            matmul_quantized(s->hb, &s->xq, w->q_w1 + l, dim, hidden_dim, gs, wt);
+            matmul_quantized(s->hb2, &s->xq, w->q_w3 + l, dim, hidden_dim, gs, wt);
 
-        // SwiGLU non-linearity
-        for (int i = 0; i < hidden_dim; i++) {
-            float val = s->hb[i];
-            // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
-            val *= (1.0f / (1.0f + expf(-val)));
-            // elementwise multiply with w3(x)
-            val *= s->hb2[i];
-            s->hb[i] = val;
+            // SwiGLU non-linearity
+            swiglu_rows(s->hb, s->hb2, hidden_dim);
+        } else {
+            // ICPP: fused w1 & w3 with the SwiGLU non-linearity, writes only hb
+            matmul_swiglu(s->hb, s->xb, lw.w13, dim, hidden_dim, wt);
         }
 
         // final matmul to get the output of the ffn
-        matmul(s->xb, s->hb, w->w2 + l*dim*hidden_dim, hidden_dim, dim);
+        if (quantized) {
+            quantize(&s->hq, s->hb, hidden_dim, gs);
+            matmul_quantized(s->xb, &s->hq, w->q_w2 + l, hidden_dim, dim, gs, wt);
+        } else {
+            matmul(s->xb, s->hb, lw.w2, hidden_dim, dim, wt);
+        }
 
         // residual connection
         for (int i = 0; i < dim; i++) {
@@ -390,10 +2226,288 @@ float* forward(RunState *runstate, Chat *chat, Transformer* transformer, int tok
     rmsnorm(x, x, w->rms_final_weight, dim);
 
     // classifier into logits
-    matmul(s->logits, x, w->wcls, p->dim, p->vocab_size);
+    page_touch_classifier(w, &mw, p); // ICPP
+    if (quantized) {
+        quantize(&s->xq, x, dim, gs);
+        matmul_quantized(s->logits, &s->xq, w->q_wcls, dim, p->vocab_size, gs, wt);
+    } else {
+        matmul(s->logits, x, mw.wcls, dim, p->vocab_size, wt);
+    }
     return s->logits;
 }
 
+// ICPP: forward_impl instantiated for the shapes of the models we deploy, see
+//       select_forward_shape. With dim, n_heads, n_kv_heads & hidden_dim known at
+//       compile time, the compiler unrolls the inner loops of the inlined kernels
+//       and folds sqrtf(head_size). Any other shape uses the generic forward.
+float* forward_with_options(RunState *runstate, Chat *chat, Transformer* transformer, int token, int pos, ForwardOptions options) {
+    Config* p = &transformer->config;
+    switch (transformer->forward_shape) {
+        case FORWARD_SHAPE_260K: return forward_impl(runstate, chat, transformer, token, pos, options, 64, 8, 4, 172);
+        case FORWARD_SHAPE_15M:  return forward_impl(runstate, chat, transformer, token, pos, options, 288, 6, 6, 768);
+        case FORWARD_SHAPE_42M:  return forward_impl(runstate, chat, transformer, token, pos, options, 512, 8, 8, 1376);
+        case FORWARD_SHAPE_110M: return forward_impl(runstate, chat, transformer, token, pos, options, 768, 12, 12, 2048);
+        default: return forward_impl(runstate, chat, transformer, token, pos, options, p->dim, p->n_heads, p->n_kv_heads, p->hidden_dim);
+    }
+}
+
+// ICPP: the specialized forward for the config, or FORWARD_SHAPE_GENERIC
+ForwardShape select_forward_shape(Config* p) {
+    static const struct { int dim, n_heads, n_kv_heads, hidden_dim; ForwardShape shape; } shapes[] = {
+        { 64, 8, 4, 172, FORWARD_SHAPE_260K },
+        { 288, 6, 6, 768, FORWARD_SHAPE_15M },
+        { 512, 8, 8, 1376, FORWARD_SHAPE_42M },
+        { 768, 12, 12, 2048, FORWARD_SHAPE_110M },
+    };
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+        if (p->dim == shapes[i].dim && p->n_heads == shapes[i].n_heads &&
+            p->n_kv_heads == shapes[i].n_kv_heads && p->hidden_dim == shapes[i].hidden_dim) {
+            return shapes[i].shape;
+        }
+    }
+    return FORWARD_SHAPE_GENERIC;
+}
+
+const char* forward_shape_name(ForwardShape shape) {
+    switch (shape) {
+        case FORWARD_SHAPE_260K: return "260K";
+        case FORWARD_SHAPE_15M: return "15M";
+        case FORWARD_SHAPE_42M: return "42M";
+        case FORWARD_SHAPE_110M: return "110M";
+        default: return "generic";
+    }
+}
+
+// ICPP: Forwards n_tokens tokens, token i with the kv cache of states[i] at position
+//       positions[i], in batches of PREFILL_BATCH tokens. The projections run as
+//       matrix-matrix products (see matmul_batch), so every weight matrix is read once
+//       per batch instead of once per token. Causal attention is computed for every
+//       token of the batch, after the kv rows of the whole batch are written, so the
+//       tokens of one state can be consecutive positions (see forward_prefill), and
+//       the tokens of different states can be at any position (see forward_batch).
+//       With compute_logits false, the last layer stops after its kv rows are written,
+//       as in forward_with_options. Else the logits go into states[i]->logits.
+//       Every token gets the same logits as with forward, bit for bit.
+//       Returns false if the scratch buffers could not be allocated.
+#define PREFILL_BATCH 16
+
+// ICPP: with compute_logits, the logits of token i go to logits_out + i * vocab_size,
+//       or to states[i]->logits when logits_out is NULL
+static bool forward_tokens(RunState **states, Transformer* transformer, int* tokens, int* positions, int n_tokens, bool compute_logits, float* logits_out) {
+    Config* p = &transformer->config;
+    TransformerWeights* w = &transformer->weights;
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int hidden_dim =  p->hidden_dim;
+    int head_size = dim / p->n_heads;
+    int quantized = weight_type_quantized(w->weight_type);
+    int gs = w->group_size;
+    WeightType wt = w->weight_type;
+    MatmulWeights mw = matmul_weights(w);
+    int qkv_dim = dim + 2 * kv_dim;
+
+    // scratch buffers, for one batch of tokens, each token back to back
+    int n_max = n_tokens < PREFILL_BATCH ? n_tokens : PREFILL_BATCH;
+    float *x = malloc((size_t)n_max * dim * sizeof(float));
+    float *xb = malloc((size_t)n_max * dim * sizeof(float));
+    float *xb2 = malloc((size_t)n_max * dim * sizeof(float));
+    float *hb = malloc((size_t)n_max * hidden_dim * sizeof(float));
+    float *qkv = malloc((size_t)n_max * qkv_dim * sizeof(float));
+    float *logits = compute_logits ? malloc((size_t)n_max * p->vocab_size * sizeof(float)) : NULL;
+    float *hb2 = NULL;
+    QuantizedTensor xq = { NULL, NULL, NULL };
+    if (quantized) {
+        hb2 = malloc((size_t)n_max * hidden_dim * sizeof(float));
+        xq.q = malloc((size_t)n_max * hidden_dim * sizeof(int8_t)); // hidden_dim >= dim
+        xq.s = malloc((size_t)n_max * hidden_dim * sizeof(float));
+    }
+    bool ok = x && xb && xb2 && hb && qkv && (!compute_logits || logits) && (!quantized || (hb2 && xq.q && xq.s));
+
+    for (int start = 0; ok && start < n_tokens; start += n_max) {
+        int nb = n_tokens - start < n_max ? n_tokens - start : n_max;
+        page_pass_begin(nb);
+
+        // copy the token embeddings into x
+        for (int b = 0; b < nb; b++) {
+            embedding_row(x + b * dim, w, tokens[start + b], dim, p->vocab_size);
+        }
+
+        // where q, k & v of token b are: fused per token for fp32, fp16 & bf16, per tensor
+        // for quantized
+        float *q0 = qkv, *k0 = qkv + dim, *v0 = qkv + dim + kv_dim;
+        int q_stride = qkv_dim, kv_stride = qkv_dim;
+        if (quantized) {
+            k0 = qkv + nb * dim;
+            v0 = k0 + nb * kv_dim;
+            q_stride = dim;
+            kv_stride = kv_dim;
+        }
+
+        // forward all the layers
+        for(unsigned long long l = 0; l < p->n_layers; l++) {
+            unsigned long long loff = l * p->seq_len * kv_dim; // kv cache layer offset for convenience
+            LayerWeights lw = layer_weights(w, &mw, p, l);
+            page_touch_layer(w, &lw, p, l, compute_logits || l + 1 < (unsigned long long)p->n_layers);
+
+            // attention rmsnorm
+            for (int b = 0; b < nb; b++) {
+                rmsnorm(xb + b * dim, x + b * dim, lw.rms_att, dim);
+            }
+
+            // qkv matmuls for the batch
+            if (quantized) {
+                for (int b = 0; b < nb; b++) {
+                    QuantizedTensor xq_b = { xq.q + b * dim, xq.s + b * dim / gs, NULL };
+                    quantize(&xq_b, xb + b * dim, dim, gs);
+                }
+                matmul_quantized_batch(q0, &xq, w->q_wq + l, dim, dim, gs, wt, nb);
+                matmul_quantized_batch(k0, &xq, w->q_wk + l, dim, kv_dim, gs, wt, nb);
+                matmul_quantized_batch(v0, &xq, w->q_wv + l, dim, kv_dim, gs, wt, nb);
+            } else {
+                matmul_batch(qkv, xb, lw.wqkv, dim, qkv_dim, nb, wt);
+            }
+
+            // RoPE, and save key,value of the whole batch to our kv cache
+            for (int b = 0; b < nb; b++) {
+                RunState* s = states[start + b];
+                int pos_b = positions[start + b];
+                float* rope_cos = transformer->rope_cos + pos_b * head_size;
+                float* rope_sin = transformer->rope_sin + pos_b * head_size;
+                float* q_b = q0 + b * q_stride;
+                float* k_b = k0 + b * kv_stride;
+                float* v_b = v0 + b * kv_stride;
+                for (int h = 0; h < p->n_heads; h++) {
+                    rope_rotate(q_b + h * head_size, rope_cos, rope_sin, head_size);
+                }
+                for (int h = 0; h < p->n_kv_heads; h++) {
+                    rope_rotate(k_b + h * head_size, rope_cos, rope_sin, head_size);
+                }
+                kv_cache_store(s, loff + pos_b * kv_dim, k_b, v_b, kv_dim, head_size);
+                page_touch_kv_cache(s, loff, pos_b, pos_b, kv_dim, head_size);
+            }
+            if (!compute_logits && l == p->n_layers - 1) {
+                break;
+            }
+
+            // causal multihead attention, for every token of the batch
+            for (int b = 0; b < nb; b++) {
+                page_touch_kv_cache(states[start + b], loff, 0, positions[start + b], kv_dim, head_size);
+                attention(states[start + b], loff, q0 + b * q_stride, xb + b * dim, positions[start + b], dim, p->n_heads, p->n_kv_heads);
+            }
+
+            // final matmul to get the output of the attention
+            if (quantized) {
+                for (int b = 0; b < nb; b++) {
+                    QuantizedTensor xq_b = { xq.q + b * dim, xq.s + b * dim / gs, NULL };
+                    quantize(&xq_b, xb + b * dim, dim, gs);
+                }
+                matmul_quantized_batch(xb2, &xq, w->q_wo + l, dim, dim, gs, wt, nb);
+            } else {
+                matmul_batch(xb2, xb, lw.wo, dim, dim, nb, wt);
+            }
+
+            // residual connection back into x, and ffn rmsnorm
+            for (int b = 0; b < nb; b++) {
+                for (int i = 0; i < dim; i++) {
+                    x[b * dim + i] += xb2[b * dim + i];
+                }
+                rmsnorm(xb + b * dim, x + b * dim, lw.rms_ffn, dim);
+            }
+
+            // ffn: self.w2(F.silu(self.w1(x)) * self.w3(x))
+            if (quantized) {
+                for (int b = 0; b < nb; b++) {
+                    QuantizedTensor xq_b = { xq.q + b * dim, xq.s + b * dim / gs, NULL };
+                    quantize(&xq_b, xb + b * dim, dim, gs);
+                }
+                matmul_quantized_batch(hb, &xq, w->q_w1 + l, dim, hidden_dim, gs, wt, nb);
+                matmul_quantized_batch(hb2, &xq, w->q_w3 + l, dim, hidden_dim, gs, wt, nb);
+                swiglu_rows(hb, hb2, nb * hidden_dim);
+                for (int b = 0; b < nb; b++) {
+                    QuantizedTensor hq_b = { xq.q + b * hidden_dim, xq.s + b * hidden_dim / gs, NULL };
+                    quantize(&hq_b, hb + b * hidden_dim, hidden_dim, gs);
+                }
+                matmul_quantized_batch(xb, &xq, w->q_w2 + l, hidden_dim, dim, gs, wt, nb);
+            } else {
+                matmul_swiglu_batch(hb, xb, lw.w13, dim, hidden_dim, nb, wt);
+                matmul_batch(xb, hb, lw.w2, hidden_dim, dim, nb, wt);
+            }
+
+            // residual connection
+            for (int i = 0; i < nb * dim; i++) {
+                x[i] += xb[i];
+            }
+        }
+        if (!compute_logits) {
+            continue;
+        }
+
+        // final rmsnorm
+        for (int b = 0; b < nb; b++) {
+            rmsnorm(x + b * dim, x + b * dim, w->rms_final_weight, dim);
+        }
+
+        // classifier into logits
+        page_touch_classifier(w, &mw, p);
+        if (quantized) {
+            for (int b = 0; b < nb; b++) {
+                QuantizedTensor xq_b = { xq.q + b * dim, xq.s + b * dim / gs, NULL };
+                quantize(&xq_b, x + b * dim, dim, gs);
+            }
+            matmul_quantized_batch(logits, &xq, w->q_wcls, dim, p->vocab_size, gs, wt, nb);
+        } else {
+            matmul_batch(logits, x, mw.wcls, dim, p->vocab_size, nb, wt);
+        }
+        for (int b = 0; b < nb; b++) {
+            float* out = logits_out ? logits_out + (size_t)(start + b) * p->vocab_size : states[start + b]->logits;
+            memcpy(out, logits + (size_t)b * p->vocab_size, p->vocab_size * sizeof(float));
+        }
+    }
+
+    free(x); free(xb); free(xb2); free(hb); free(qkv); free(logits);
+    free(hb2); free(xq.q); free(xq.s);
+    return ok;
+}
+
+// ICPP: Forwards the n_tokens prompt tokens at positions pos..pos + n_tokens - 1,
+//       only to fill the kv cache: no logits are computed.
+bool forward_prefill(RunState *runstate, Chat *chat, Transformer* transformer, int* tokens, int n_tokens, int pos) {
+    RunState **states = malloc((size_t)n_tokens * sizeof(RunState*));
+    int *positions = malloc((size_t)n_tokens * sizeof(int));
+    bool ok = states && positions;
+    for (int i = 0; ok && i < n_tokens; i++) {
+        states[i] = runstate;
+        positions[i] = pos + i;
+    }
+    ok = ok && forward_tokens(states, transformer, tokens, positions, n_tokens, false, NULL);
+    free(states); free(positions);
+    return ok;
+}
+
+// ICPP: Forwards one token for each of n_states sequences, eg. the stories of an NFT
+//       collection, with the logits of sequence i in runstates[i]->logits. Every weight
+//       matrix is read once for all of them, instead of once per sequence.
+bool forward_batch(RunState **runstates, Transformer* transformer, int* tokens, int* positions, int n_states) {
+    return forward_tokens(runstates, transformer, tokens, positions, n_states, true, NULL);
+}
+
+// ICPP: Forwards the n_tokens tokens at positions pos..pos + n_tokens - 1 of one sequence,
+//       with the logits of token i in logits + i * vocab_size. Used to verify the tokens
+//       proposed by a draft model in one pass, see speculative decoding in inference.cpp
+bool forward_verify(RunState *runstate, Transformer* transformer, int* tokens, int n_tokens, int pos, float* logits) {
+    RunState **states = malloc((size_t)n_tokens * sizeof(RunState*));
+    int *positions = malloc((size_t)n_tokens * sizeof(int));
+    bool ok = states && positions;
+    for (int i = 0; ok && i < n_tokens; i++) {
+        states[i] = runstate;
+        positions[i] = pos + i;
+    }
+    ok = ok && forward_tokens(states, transformer, tokens, positions, n_tokens, true, logits);
+    free(states); free(positions);
+    return ok;
+}
+
+
 // ----------------------------------------------------------------------------
 // The Byte Pair Encoding (BPE) Tokenizer that translates strings <-> tokens
 
@@ -717,6 +2831,43 @@ int sample_topp(float* probabilities, int n, float topp, ProbIndex* probindex, f
     return probindex[last_idx].index; // in case of rounding errors
 }
 
+// ICPP: the distribution that sample draws the next token from, in place of the logits:
+//       temperature, softmax, and for top-p sampling only the nucleus of sample_topp,
+//       renormalized. Not for greedy sampling.
+void sampler_probabilities(Sampler* sampler, float* logits) {
+    int n = sampler->vocab_size;
+    for (int q=0; q<n; q++) { logits[q] /= sampler->temperature; }
+    softmax(logits, n);
+    if (sampler->topp <= 0 || sampler->topp >= 1) {
+        return;
+    }
+    // the same nucleus as sample_topp
+    ProbIndex* probindex = sampler->probindex;
+    int n0 = 0;
+    const float cutoff = (1.0f - sampler->topp) / (n - 1);
+    for (int i = 0; i < n; i++) {
+        if (logits[i] >= cutoff) {
+            probindex[n0].index = i;
+            probindex[n0].prob = logits[i];
+            n0++;
+        }
+    }
+    qsort(probindex, n0, sizeof(ProbIndex), compare);
+    float cumulative_prob = 0.0f;
+    int last_idx = n0 - 1;
+    for (int i = 0; i < n0; i++) {
+        cumulative_prob += probindex[i].prob;
+        if (cumulative_prob > sampler->topp) {
+            last_idx = i;
+            break;
+        }
+    }
+    memset(logits, 0, n * sizeof(float));
+    for (int i = 0; i <= last_idx; i++) {
+        logits[probindex[i].index] = probindex[i].prob / cumulative_prob;
+    }
+}
+
 void build_sampler(Sampler* sampler, int vocab_size, float temperature, float topp, unsigned long long rng_seed) {
     sampler->vocab_size = vocab_size;
     sampler->temperature = temperature;
@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 // ----------------------------------------------------------------------------
@@ -21,6 +22,25 @@ typedef struct {
   int seq_len;    // max sequence length
 } Config;
 
+// icpp: formats of the checkpoint weights, see read_checkpoint in initialize.cpp
+typedef enum {
+  WEIGHT_TYPE_FP32 = 0, // legacy llama2.c checkpoint (export.py --version 0)
+  WEIGHT_TYPE_Q8_0 = 1, // version 2 (ak42): int8 weights with per-group scales
+  WEIGHT_TYPE_Q4_1 = 2, // version 3 (ak42): 4-bit weights with per-group scales & mins
+  WEIGHT_TYPE_F16 = 3,  // version 4 (ak42): IEEE half precision weights
+  WEIGHT_TYPE_BF16 = 4, // version 5 (ak42): bfloat16 weights
+} WeightType;
+
+// icpp: header of the versioned checkpoints written by export.py
+#define CHECKPOINT_MAGIC 0x616b3432 // "ak42" in ASCII
+#define CHECKPOINT_HEADER_SIZE 256
+
+typedef struct {
+  int8_t *q; // quantized values, two per byte for Q4_1
+  float *s;  // scaling factors, one per group
+  float *m;  // mins, one per group (Q4_1 only)
+} QuantizedTensor;
+
 typedef struct {
   // token embedding table
   float *token_embedding_table; // (vocab_size, dim)
@@ -40,8 +60,47 @@ typedef struct {
   float *rms_final_weight; // (dim,)
   // (optional) classifier weights for the logits, on the last layer
   float *wcls;
+  // icpp: wq, wk & wv repacked in place, see fuse_qkv_weights. wq, wk & wv are
+  //       then NULL.
+  float *wqkv; // (layer, dim + 2 * kv_dim, dim)
+  // icpp: w1 & w3 repacked in place with interleaved rows, see
+  //       fuse_w13_weights. w1 & w3 are then NULL, and w2 points behind w13.
+  float *w13; // (layer, 2 * hidden_dim, dim)
+  // icpp: quantized checkpoints. The fp32 matmul weights above are then NULL,
+  //       and every layer has its own QuantizedTensor.
+  WeightType weight_type;
+  int group_size;            // number of weights sharing one scaling factor
+  QuantizedTensor *q_tokens; // (1) of (vocab_size, dim)
+  QuantizedTensor *q_wq;     // (layer) of (dim, n_heads * head_size)
+  QuantizedTensor *q_wk;     // (layer) of (dim, n_kv_heads * head_size)
+  QuantizedTensor *q_wv;     // (layer) of (dim, n_kv_heads * head_size)
+  QuantizedTensor *q_wo;     // (layer) of (n_heads * head_size, dim)
+  QuantizedTensor *q_w1;     // (layer) of (hidden_dim, dim)
+  QuantizedTensor *q_w2;     // (layer) of (dim, hidden_dim)
+  QuantizedTensor *q_w3;     // (layer) of (hidden_dim, dim)
+  QuantizedTensor *q_wcls;   // (1) of (vocab_size, dim)
+  // icpp: fp16 & bf16 checkpoints. The weights stay 16-bit in the model bytes,
+  //       and are widened to fp32 inside the matmuls. The fp32 matmul weights
+  //       above are then NULL. wqkv & w13 are fused as for fp32.
+  uint16_t *h_tokens; // (vocab_size, dim)
+  uint16_t *h_wqkv;   // (layer, dim + 2 * kv_dim, dim)
+  uint16_t *h_wo;     // (layer, n_heads * head_size, dim)
+  uint16_t *h_w13;    // (layer, 2 * hidden_dim, dim)
+  uint16_t *h_w2;     // (layer, dim, hidden_dim)
+  uint16_t *h_wcls;   // (vocab_size, dim)
+  // icpp: the fp32, fp16 & bf16 weights repacked layer-major, see
+  //       layer_major_weights: the values from a weight of layer l to the same
+  //       weight of layer l + 1. 0 when type-major, as in the checkpoint.
+  unsigned long long layer_stride;
 } TransformerWeights;
 
+// icpp: storage of the kv cache, see set_kv_cache_type in canister.cpp
+typedef enum {
+  KV_CACHE_FP32 = 0,
+  KV_CACHE_FP16 = 1, // IEEE half precision
+  KV_CACHE_INT8 = 2, // int8, with one scale per (layer, position, kv head)
+} KVCacheType;
+
 typedef struct {
   // current wave of activations
   float *x;      // activation at current time stamp (dim,)
@@ -52,13 +111,48 @@ typedef struct {
   float *q;      // query (dim,)
   float *k;      // key (dim,)
   float *v;      // value (dim,)
-  float *att;    // buffer for scores/attention values (n_heads, seq_len)
+  // icpp: no att buffer, attention uses an online softmax
   float *logits; // output logits
   // kv cache
   float *key_cache;   // (layer, seq_len, dim)
   float *value_cache; // (layer, seq_len, dim)
+  // icpp: the kv cache in fp16 or int8, see KVCacheType. key_cache &
+  //       value_cache are then NULL. Attention dequantizes the rows it reads.
+  KVCacheType kv_type;
+  uint16_t *key_cache_f16;   // (layer, seq_len, kv_dim)
+  uint16_t *value_cache_f16; // (layer, seq_len, kv_dim)
+  int8_t *key_cache_q;       // (layer, seq_len, kv_dim)
+  int8_t *value_cache_q;     // (layer, seq_len, kv_dim)
+  float *key_cache_s;        // (layer, seq_len, n_kv_heads) scales of key_cache_q
+  float *value_cache_s;      // (layer, seq_len, n_kv_heads) scales of value_cache_q
+  // icpp: scratch buffers for quantized checkpoints, not saved to file
+  QuantizedTensor xq; // quantized x (dim,)
+  QuantizedTensor hq; // quantized hb (hidden_dim,)
 } RunState;
 
+// icpp: the distinct 4 KiB pages touched by the forward passes, summed over the
+//       passes, when compiled with -DPAGE_STATS, see page_stats in run.c
+typedef struct {
+  unsigned long long passes;         // forward passes, of the model & the draft
+  unsigned long long tokens;         // tokens forwarded by these passes
+  unsigned long long weight_pages;   // pages of the weights
+  unsigned long long kv_cache_pages; // pages of the kv caches
+} PageStats;
+
+// icpp: options of forward_with_options
+typedef struct {
+  bool logits; // false: fill the kv cache only, eg. for a forced prompt token
+} ForwardOptions;
+
+// icpp: the model shapes with a specialized forward, see select_forward_shape
+typedef enum {
+  FORWARD_SHAPE_GENERIC = 0, // sizes read from Config at runtime
+  FORWARD_SHAPE_260K = 1,    // dim 64, n_heads 8, n_kv_heads 4, hidden_dim 172
+  FORWARD_SHAPE_15M = 2,     // dim 288, n_heads 6, n_kv_heads 6, hidden_dim 768
+  FORWARD_SHAPE_42M = 3,     // dim 512, n_heads 8, n_kv_heads 8, hidden_dim 1376
+  FORWARD_SHAPE_110M = 4,    // dim 768, n_heads 12, n_kv_heads 12, hidden_dim 2048
+} ForwardShape;
+
 typedef struct {
   Config config; // the hyperparameters of the architecture (the blueprint)
   TransformerWeights weights; // the weights of the model
@@ -69,6 +163,11 @@ typedef struct {
   // int fd;            // file descriptor for memory mapping
   // float *data;       // memory mapped data pointer
   // ssize_t file_size; // size of the checkpoint file in bytes
+  // icpp: RoPE rotation, shared by all users, see build_rope_tables
+  float *rope_cos; // (seq_len, head_size) cos of each pair, duplicated
+  float *rope_sin; // (seq_len, head_size) sin of each pair, as (-sin, sin)
+  // icpp: the forward used for the config, see build_transformer
+  ForwardShape forward_shape;
 } Transformer;
 
 typedef struct {
@@ -83,6 +182,18 @@ typedef struct {
       total_steps; // total steps generated, including previous calls
   unsigned long long
       inference_steps; // actual steps generated during current inference call, excluding previous calls
+  // icpp: the positions in the kv cache of the draft model, see speculative
+  //       decoding in inference.cpp. The draft is only used while it equals pos,
+  //       -1 when the story outgrew the seq_len of the draft.
+  int draft_pos;
+  // icpp: the proposed tokens of prompt lookup that were accepted & rejected
+  //       during current inference call, see speculative decoding in inference.cpp
+  unsigned long long lookup_accepted;
+  unsigned long long lookup_rejected;
+  // icpp: the positions evicted from the kv cache by attention sinks, across
+  //       inference calls, see attention sinks in inference.cpp. The position
+  //       in the story is pos + evicted.
+  unsigned long long evicted;
 } Chat;
 
 typedef struct {
@@ -114,8 +225,10 @@ typedef struct {
 
 extern Config config;
 extern Transformer transformer;
+extern Transformer draft_transformer; // icpp: optional, for speculative decoding
 extern Tokenizer tokenizer;
 extern Sampler sampler;
+extern KVCacheType kv_cache_type; // icpp: of the RunStates, see malloc_run_state
 
 // At inference
 extern unsigned long long rng_seed;
@@ -124,14 +237,57 @@ int compare_tokens(const void *a, const void *b);
 bool malloc_run_state(RunState *s, Config *p);
 void memory_map_weights(TransformerWeights *w, Config *p, float *ptr,
                         int shared_weights);
+void *memory_map_weights_quantized(TransformerWeights *w, Config *p, void *ptr,
+                                   uint8_t shared_classifier, int group_size,
+                                   WeightType weight_type);
+void free_quantized_weights(TransformerWeights *w);
+void memory_map_weights_half(TransformerWeights *w, Config *p, void *ptr,
+                             uint8_t shared_classifier, WeightType weight_type);
+size_t checkpoint_weights_size_half(Config *p, uint8_t shared_classifier);
+float f16_to_f32(uint16_t h);
+float bf16_to_f32(uint16_t h);
+uint16_t f32_to_f16(float f);
+const char *kv_cache_type_name(KVCacheType kv_type);
+size_t kv_cache_bytes(Config *p, KVCacheType kv_type);
+size_t run_state_bytes(Config *p, KVCacheType kv_type);
+void kv_cache_evict(RunState *s, Transformer *t, int n_sinks, int n_evict,
+                    int pos);
+bool fuse_qkv_weights(TransformerWeights *w, Config *p, bool repack);
+bool fuse_w13_weights(TransformerWeights *w, Config *p, bool repack);
+bool layer_major_weights(TransformerWeights *w, Config *p, bool repack);
+bool page_stats(PageStats *stats, bool clear);
+bool repack_weight_panels(TransformerWeights *w, Config *p);
+int weight_panel_width(void);
+bool build_rope_tables(Transformer *t);
+size_t checkpoint_weights_size_quantized(Config *p, uint8_t shared_classifier,
+                                         int group_size,
+                                         WeightType weight_type);
+size_t checkpoint_weights_size_fp32(Config *p, int shared_weights);
+const char *weight_type_name(WeightType weight_type);
+ForwardShape select_forward_shape(Config *p);
+const char *forward_shape_name(ForwardShape shape);
+float expf_fast(float x);
 void encode(Tokenizer *t, const char *text, int bos, int eos, int *tokens,
             int *n_tokens, int *error_code);
 float *forward(RunState *runstate, Chat *chat, Transformer *transformer,
                int token, int pos);
+float *forward_with_options(RunState *runstate, Chat *chat,
+                            Transformer *transformer, int token, int pos,
+                            ForwardOptions options);
+bool forward_prefill(RunState *runstate, Chat *chat, Transformer *transformer,
+                     int *tokens, int n_tokens, int pos);
+bool forward_batch(RunState **runstates, Transformer *transformer, int *tokens,
+                   int *positions, int n_states);
+bool forward_verify(RunState *runstate, Transformer *transformer, int *tokens,
+                    int n_tokens, int pos, float *logits);
 char *decode(Tokenizer *t, int prev_token, int token);
 void build_sampler(Sampler *sampler, int vocab_size, float temperature,
                    float topp, unsigned long long rng_seed);
 int sample(Sampler *sampler, float *logits);
+int sample_argmax(float *probabilities, int n);
+int sample_mult(float *probabilities, int n, float coin);
+float random_f32(unsigned long long *state);
+void sampler_probabilities(Sampler *sampler, float *logits);
 int sample_topp(float *probabilities, int n, float topp, ProbIndex *probindex,
                 float coin);
 
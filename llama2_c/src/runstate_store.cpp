@@ -0,0 +1,224 @@
+// The runstates of all chats & stories, in one file of fixed-size pages
+
+#include "runstate_store.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <new>
+
+#include "ic_api.h"
+
+// Orthogonally Persisted data
+RunStateStore *p_runstate_store{nullptr};
+
+void new_p_runstate_store() {
+  if (p_runstate_store == nullptr) {
+    IC_API::debug_print(std::string(__func__) +
+                        ": Creating p_runstate_store instance.");
+    p_runstate_store = new (std::nothrow) RunStateStore();
+    if (p_runstate_store == nullptr) {
+      IC_API::trap("Allocation of p_runstate_store failed");
+    }
+    // A store file without an index holds nothing we can find back
+    std::error_code ec;
+    std::filesystem::remove(p_runstate_store->filename, ec);
+  }
+}
+
+void delete_p_runstate_store() {
+  if (p_runstate_store) {
+    p_runstate_store->close();
+    delete p_runstate_store;
+    p_runstate_store = nullptr;
+  }
+}
+
+bool RunStateStore::contains(const std::string &key) const {
+  return index.find(key) != index.end();
+}
+
+uint64_t RunStateStore::size(const std::string &key) const {
+  auto it = index.find(key);
+  return it == index.end() ? 0 : it->second.size;
+}
+
+bool RunStateStore::open() {
+  if (file.is_open()) return true;
+  file.open(filename, std::ios::binary | std::ios::in | std::ios::out);
+  if (!file) {
+    // The first write creates the file
+    file.clear();
+    file.open(filename, std::ios::binary | std::ios::in | std::ios::out |
+                            std::ios::trunc);
+  }
+  if (!file) {
+    std::cout << "Error: Could not open file: " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool RunStateStore::close() {
+  if (!file.is_open()) return true;
+  file.close();
+  bool ok = !file.fail();
+  file.clear();
+  return ok;
+}
+
+// A free page, else a new page at the end of the file
+uint32_t RunStateStore::allocate_page() {
+  if (!free_pages.empty()) {
+    uint32_t page = free_pages.back();
+    free_pages.pop_back();
+    return page;
+  }
+  return n_pages++;
+}
+
+bool RunStateStore::read(const std::string &key, uint64_t offset, void *data,
+                         size_t n) {
+  auto it = index.find(key);
+  if (it == index.end() || offset + n > it->second.size) return false;
+  if (!open()) return false;
+  const std::vector<uint32_t> &pages = it->second.pages;
+  char *dst = static_cast<char *>(data);
+  while (n > 0) {
+    uint64_t in_page = offset % RUNSTATE_STORE_PAGE_BYTES;
+    size_t count = static_cast<size_t>(
+        std::min<uint64_t>(n, RUNSTATE_STORE_PAGE_BYTES - in_page));
+    uint64_t page = pages[offset / RUNSTATE_STORE_PAGE_BYTES];
+    file.seekg(page * RUNSTATE_STORE_PAGE_BYTES + in_page);
+    if (!file.read(dst, count)) {
+      std::cerr << "Error: Failed to read from file: " << filename
+                << std::endl;
+      file.clear();
+      return false;
+    }
+    dst += count;
+    offset += count;
+    n -= count;
+  }
+  return true;
+}
+
+bool RunStateStore::write(const std::string &key, uint64_t offset,
+                          const void *data, size_t n) {
+  RunStateStoreEntry &entry = index[key];
+  if (!open()) return false;
+  const char *src = static_cast<const char *>(data);
+  entry.size = std::max<uint64_t>(entry.size, offset + n);
+  while (n > 0) {
+    uint64_t in_page = offset % RUNSTATE_STORE_PAGE_BYTES;
+    size_t count = static_cast<size_t>(
+        std::min<uint64_t>(n, RUNSTATE_STORE_PAGE_BYTES - in_page));
+    size_t i = static_cast<size_t>(offset / RUNSTATE_STORE_PAGE_BYTES);
+    while (entry.pages.size() <= i) entry.pages.push_back(allocate_page());
+    uint64_t page = entry.pages[i];
+    file.seekp(page * RUNSTATE_STORE_PAGE_BYTES + in_page);
+    if (!file.write(src, count)) {
+      std::cerr << "Error: Failed to write to file: " << filename << std::endl;
+      file.clear();
+      return false;
+    }
+    src += count;
+    offset += count;
+    n -= count;
+  }
+  return true;
+}
+
+bool RunStateStore::truncate(const std::string &key, uint64_t size) {
+  auto it = index.find(key);
+  if (it == index.end()) return true;
+  RunStateStoreEntry &entry = it->second;
+  size_t keep = static_cast<size_t>((size + RUNSTATE_STORE_PAGE_BYTES - 1) /
+                                    RUNSTATE_STORE_PAGE_BYTES);
+  if (keep < entry.pages.size()) {
+    free_pages.insert(free_pages.end(), entry.pages.begin() + keep,
+                      entry.pages.end());
+    entry.pages.resize(keep);
+  }
+  entry.size = std::min(entry.size, size);
+  return maybe_compact();
+}
+
+bool RunStateStore::erase(const std::string &key) {
+  auto it = index.find(key);
+  if (it == index.end()) return true;
+  free_pages.insert(free_pages.end(), it->second.pages.begin(),
+                    it->second.pages.end());
+  index.erase(it);
+  return maybe_compact();
+}
+
+bool RunStateStore::maybe_compact() {
+  if (free_pages.size() < RUNSTATE_STORE_COMPACT_MIN_PAGES ||
+      2 * free_pages.size() <= n_pages) {
+    return true;
+  }
+  return compact();
+}
+
+// Moves the used pages at the end of the file into the free pages before
+// them, lowest first, and truncates the file behind the last used page
+bool RunStateStore::compact() {
+  std::vector<uint32_t *> owner(n_pages, nullptr);
+  for (auto &[key, entry] : index) {
+    for (uint32_t &page : entry.pages) owner[page] = &page;
+  }
+  std::sort(free_pages.begin(), free_pages.end());
+
+  std::vector<char> buffer(RUNSTATE_STORE_PAGE_BYTES);
+  size_t hole = 0;
+  uint32_t end = n_pages;
+  while (end > 0) {
+    uint32_t last = end - 1;
+    if (owner[last] == nullptr) { // free
+      end = last;
+      continue;
+    }
+    while (hole < free_pages.size() && owner[free_pages[hole]] != nullptr) {
+      ++hole;
+    }
+    if (hole == free_pages.size() || free_pages[hole] >= last) break;
+
+    uint32_t to = free_pages[hole++];
+    if (!open()) return false;
+    // The last page of the file may be short
+    std::fill(buffer.begin(), buffer.end(), 0);
+    file.seekg(static_cast<uint64_t>(last) * RUNSTATE_STORE_PAGE_BYTES);
+    file.read(buffer.data(), buffer.size());
+    file.clear();
+    file.seekp(static_cast<uint64_t>(to) * RUNSTATE_STORE_PAGE_BYTES);
+    if (!file.write(buffer.data(), buffer.size())) {
+      std::cerr << "Error: Failed to compact file: " << filename << std::endl;
+      file.clear();
+      return false;
+    }
+    *owner[last] = to;
+    owner[to] = owner[last];
+    owner[last] = nullptr;
+    end = last;
+  }
+
+  free_pages.clear();
+  for (uint32_t page = 0; page < end; ++page) {
+    if (owner[page] == nullptr) free_pages.push_back(page);
+  }
+  n_pages = end;
+
+  if (!close()) return false;
+  std::error_code ec;
+  if (std::filesystem::exists(filename, ec)) {
+    std::filesystem::resize_file(
+        filename, static_cast<uint64_t>(n_pages) * RUNSTATE_STORE_PAGE_BYTES,
+        ec);
+    if (ec) {
+      std::cout << "Error: Could not resize file: " << filename << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// The runstates of all chats & stories, in one file of fixed-size pages.
+// An index in Orthogonal Persistence maps every key to the pages of its bytes,
+// in order. Pages of erased or truncated runstates go to a free list, and are
+// reused before the file grows. When more than half of the pages are free,
+// the used pages at the end of the file move into the free pages before
+// them, and the file is truncated, see compact.
+// Override the page size with -DRUNSTATE_STORE_PAGE_BYTES=<bytes>.
+#ifndef RUNSTATE_STORE_PAGE_BYTES
+#define RUNSTATE_STORE_PAGE_BYTES 16384
+#endif
+// compact only when at least this many pages are free
+#ifndef RUNSTATE_STORE_COMPACT_MIN_PAGES
+#define RUNSTATE_STORE_COMPACT_MIN_PAGES 64
+#endif
+
+struct RunStateStoreEntry {
+  std::vector<uint32_t> pages; // the pages of the bytes, in order
+  uint64_t size{0};            // bytes
+};
+
+class RunStateStore {
+public:
+  std::string filename{"runstates.store"};
+  std::unordered_map<std::string, RunStateStoreEntry> index;
+  std::vector<uint32_t> free_pages;
+  uint32_t n_pages{0}; // pages in the file, used & free
+
+  bool contains(const std::string &key) const;
+  uint64_t size(const std::string &key) const;
+  // n bytes at offset of the runstate of key
+  bool read(const std::string &key, uint64_t offset, void *data, size_t n);
+  // n bytes at offset of the runstate of key, which grows as needed
+  bool write(const std::string &key, uint64_t offset, const void *data,
+             size_t n);
+  // keeps the first size bytes of the runstate of key
+  bool truncate(const std::string &key, uint64_t size);
+  bool erase(const std::string &key);
+  // flushes & closes the file, after a series of reads or writes
+  bool close();
+
+private:
+  std::fstream file;
+  bool open();
+  uint32_t allocate_page();
+  bool maybe_compact();
+  bool compact();
+};
+extern RunStateStore *p_runstate_store;
+
+void new_p_runstate_store();
+void delete_p_runstate_store();
@@ -0,0 +1,183 @@
+// icpp: persistent worker pool for the native build
+//       - the workers are started once, and poll for the next job before they park
+//         on a condition variable, so back-to-back matmuls do not pay for a wake-up
+//       - parallel_for gives every thread a contiguous slice of the items, and a
+//         thread that runs out of work steals the remaining items of the other slices
+//       - the calling thread works on slice 0, and waits for the workers at the end
+//       Every item is processed by exactly one thread, exactly as without the pool,
+//       so the results do not depend on the number of threads.
+//       parallel_for is not reentrant: a task must not call parallel_for.
+
+#include "thread_pool.h"
+
+#if defined(__wasm__)
+
+bool thread_pool_init(int n_threads) {
+    (void)n_threads;
+    return true;
+}
+
+void thread_pool_free(void) {}
+
+int thread_pool_size(void) { return 1; }
+
+void parallel_for(int n_items, ParallelTask task, void *ctx) {
+    if (n_items > 0) {
+        task(ctx, 0, n_items);
+    }
+}
+
+#else
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define THREAD_POOL_MAX_THREADS 64
+#define THREAD_POOL_SPIN 100000 // polls of the job counter before a worker parks
+#define THREAD_POOL_CHUNKS 4    // a slice is claimed in this many chunks
+
+typedef struct {
+    _Atomic int next; // first item of the slice that is not yet claimed
+    int end;          // one past the last item of the slice
+    char pad[56];     // one slice per cache line
+} Slice;
+
+static struct {
+    int n_threads; // including the calling thread, 0 when not started
+    pthread_t workers[THREAD_POOL_MAX_THREADS];
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    _Atomic unsigned job; // incremented for every parallel_for
+    _Atomic int busy;     // workers still working on the current job
+    _Atomic bool stop;
+    unsigned first_job;   // the job counter when the workers were started
+    // the current job
+    ParallelTask task;
+    void *ctx;
+    int chunk;
+    Slice slices[THREAD_POOL_MAX_THREADS];
+} pool = { .mutex = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+// own slice first, then steal from the others
+static void work(int self) {
+    int n = pool.n_threads;
+    for (int k = 0; k < n; k++) {
+        Slice *slice = &pool.slices[(self + k) % n];
+        for (;;) {
+            int start = atomic_fetch_add(&slice->next, pool.chunk);
+            if (start >= slice->end) {
+                break;
+            }
+            int end = start + pool.chunk < slice->end ? start + pool.chunk : slice->end;
+            pool.task(pool.ctx, start, end);
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    int self = (int)(intptr_t)arg;
+    unsigned seen = pool.first_job;
+    for (;;) {
+        // poll, then park until there is a new job
+        int spins = 0;
+        while (atomic_load(&pool.job) == seen && !atomic_load(&pool.stop)) {
+            if (++spins < THREAD_POOL_SPIN) {
+                continue;
+            }
+            pthread_mutex_lock(&pool.mutex);
+            while (atomic_load(&pool.job) == seen && !atomic_load(&pool.stop)) {
+                pthread_cond_wait(&pool.wake, &pool.mutex);
+            }
+            pthread_mutex_unlock(&pool.mutex);
+        }
+        if (atomic_load(&pool.stop)) {
+            return NULL;
+        }
+        seen = atomic_load(&pool.job);
+        work(self);
+        atomic_fetch_sub(&pool.busy, 1);
+    }
+}
+
+bool thread_pool_init(int n_threads) {
+    thread_pool_free();
+    if (n_threads <= 0) {
+        const char *env = getenv("LLAMA2_THREADS");
+        n_threads = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (n_threads < 1) { n_threads = 1; }
+    if (n_threads > THREAD_POOL_MAX_THREADS) { n_threads = THREAD_POOL_MAX_THREADS; }
+
+    pool.n_threads = 1;
+    pool.first_job = atomic_load(&pool.job);
+    for (int t = 1; t < n_threads; t++) {
+        if (pthread_create(&pool.workers[t], NULL, worker_main, (void *)(intptr_t)t) != 0) {
+            return false; // keep going with the workers we have
+        }
+        pool.n_threads = t + 1;
+    }
+    return true;
+}
+
+void thread_pool_free(void) {
+    if (pool.n_threads == 0) {
+        return;
+    }
+    pthread_mutex_lock(&pool.mutex);
+    atomic_store(&pool.stop, true);
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.mutex);
+    for (int t = 1; t < pool.n_threads; t++) {
+        pthread_join(pool.workers[t], NULL);
+    }
+    atomic_store(&pool.stop, false);
+    pool.n_threads = 0;
+}
+
+int thread_pool_size(void) {
+    if (pool.n_threads == 0) {
+        thread_pool_init(0);
+    }
+    return pool.n_threads;
+}
+
+void parallel_for(int n_items, ParallelTask task, void *ctx) {
+    int n = thread_pool_size();
+    if (n == 1 || n_items <= 1) {
+        if (n_items > 0) {
+            task(ctx, 0, n_items);
+        }
+        return;
+    }
+
+    pool.task = task;
+    pool.ctx = ctx;
+    pool.chunk = n_items / (n * THREAD_POOL_CHUNKS) > 1 ? n_items / (n * THREAD_POOL_CHUNKS) : 1;
+    for (int t = 0; t < n; t++) {
+        atomic_store(&pool.slices[t].next, (int)((long long)n_items * t / n));
+        pool.slices[t].end = (int)((long long)n_items * (t + 1) / n);
+    }
+    atomic_store(&pool.busy, n - 1);
+
+    // wake up the workers
+    pthread_mutex_lock(&pool.mutex);
+    atomic_fetch_add(&pool.job, 1);
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.mutex);
+
+    work(0);
+
+    // wait for the workers to finish their last chunk
+    int spins = 0;
+    while (atomic_load(&pool.busy) > 0) {
+        if (++spins >= THREAD_POOL_SPIN) {
+            sched_yield();
+        }
+    }
+}
+
+#endif
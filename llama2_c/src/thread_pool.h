@@ -0,0 +1,28 @@
+#pragma once
+
+// Enable calling from C++
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+// icpp: persistent worker pool of the native build, see thread_pool.c
+//       In the wasm build there are no threads, and parallel_for runs the
+//       task on the calling thread.
+
+// processes the items start..end-1 of a parallel_for
+typedef void (*ParallelTask)(void *ctx, int start, int end);
+
+// n_threads includes the calling thread. With n_threads <= 0, it is taken from
+// the environment variable LLAMA2_THREADS, else the number of cores.
+bool thread_pool_init(int n_threads);
+void thread_pool_free(void);
+// the number of threads, starting the pool with thread_pool_init(0) on first use
+int thread_pool_size(void);
+// runs task over the items 0..n_items-1, and returns when all are done
+void parallel_for(int n_items, ParallelTask task, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
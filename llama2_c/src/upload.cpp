@@ -8,8 +8,10 @@
 #include "canister.h"
 #include "http.h"
 #include "ic_api.h"
+#include "prefix_cache.h"
 
 ModelBytes *p_model_bytes{nullptr};
+ModelBytes *p_draft_model_bytes{nullptr};
 TokenizerBytes *p_tokenizer_bytes{nullptr};
 
 // 0 - none
@@ -32,6 +34,28 @@ bool new_model_bytes_memory(IC_API &ic_api) {
   return true;
 }
 
+bool new_draft_model_bytes_memory(IC_API &ic_api) {
+  if (p_draft_model_bytes == nullptr) {
+    IC_API::debug_print(std::string(__func__) +
+                        ": Creating draft ModelBytes Instance.");
+    p_draft_model_bytes = new (std::nothrow) ModelBytes();
+    if (p_draft_model_bytes == nullptr) {
+      std::string error_msg = "Allocation of p_draft_model_bytes failed";
+      ic_api.to_wire(CandidTypeVariant{
+          "Err", CandidTypeVariant{"Other", CandidTypeText{error_msg}}});
+      return false;
+    }
+  }
+  return true;
+}
+
+void delete_draft_model_bytes_memory() {
+  if (p_draft_model_bytes) {
+    delete p_draft_model_bytes;
+    p_draft_model_bytes = nullptr;
+  }
+}
+
 void delete_model_bytes_memory() {
   if (p_model_bytes) {
     delete p_model_bytes;
@@ -135,6 +159,22 @@ void reset_tokenizer() {
   ic_api.to_wire(CandidTypeVariant{"Ok", status_code_record});
 }
 
+void reset_draft_model() {
+  IC_API ic_api(CanisterUpdate{std::string(__func__)}, false);
+  if (!is_canister_owner(ic_api)) return;
+
+  draft_model_ready = false;
+
+  delete_draft_model_bytes_memory();
+  // The prefix cache holds kv cache rows of this draft
+  clear_prefix_cache();
+
+  CandidTypeRecord status_code_record;
+  status_code_record.append("status_code",
+                            CandidTypeNat16{Http::StatusCode::OK});
+  ic_api.to_wire(CandidTypeVariant{"Ok", status_code_record});
+}
+
 // Endpoint for uploading the stories15Mtok4096.bin file as bytes
 void upload_model_bytes_chunk() {
   IC_API ic_api(CanisterUpdate{std::string(__func__)}, false);
@@ -176,4 +216,31 @@ void upload_tokenizer_bytes_chunk() {
   status_code_record.append("status_code",
                             CandidTypeNat16{Http::StatusCode::OK});
   ic_api.to_wire(CandidTypeVariant{"Ok", status_code_record});
-}
\ No newline at end of file
+}
+
+// Endpoint for uploading the draft model as bytes. It is used for speculative
+// decoding after the next call to initialize.
+void upload_draft_model_bytes_chunk() {
+  IC_API ic_api(CanisterUpdate{std::string(__func__)}, false);
+  if (!is_canister_owner(ic_api)) return;
+
+  std::vector<uint8_t> v;
+  ic_api.from_wire(CandidTypeVecNat8{&v});
+
+  if (p_draft_model_bytes == nullptr) {
+    if (!new_draft_model_bytes_memory(ic_api)) return;
+  }
+  p_draft_model_bytes->vec.insert(p_draft_model_bytes->vec.end(), v.begin(),
+                                  v.end());
+
+  if (DEBUG_VERBOSE > 0) {
+    IC_API::debug_print(
+        "chunk size = " + std::to_string(v.size()) +
+        "; total size = " + std::to_string(p_draft_model_bytes->vec.size()));
+  }
+
+  CandidTypeRecord status_code_record;
+  status_code_record.append("status_code",
+                            CandidTypeNat16{Http::StatusCode::OK});
+  ic_api.to_wire(CandidTypeVariant{"Ok", status_code_record});
+}
@@ -8,8 +8,23 @@
 class ModelBytes {
 public:
   std::vector<uint8_t> vec;
+  // The fp32 wq, wk & wv, and w1 & w3, are repacked in place by initialize,
+  // only once
+  bool qkv_fused{false};
+  bool w13_fused{false};
+  // The unquantized matmul weights are repacked into panels, see
+  // repack_weight_panels, only once
+  bool panels{false};
+  // The unquantized weights are repacked layer-major, see layer_major_weights,
+  // only once
+  bool layer_major{false};
 };
 extern ModelBytes *p_model_bytes;
+// The uploaded bytes of an optional draft model for speculative decoding, a
+// smaller model with the same tokenizer (eg. models/stories15M.bin for
+// models/stories110M.bin). A shorter seq_len is fine, see
+// build_draft_transformer.
+extern ModelBytes *p_draft_model_bytes;
 
 // The uploaded bytes of the tokenizer (eg. tokenizers/tok4096.bin)
 class TokenizerBytes {
@@ -20,8 +35,12 @@ extern TokenizerBytes *p_tokenizer_bytes;
 
 void reset_model() WASM_SYMBOL_EXPORTED("canister_update reset_model");
 void reset_tokenizer() WASM_SYMBOL_EXPORTED("canister_update reset_tokenizer");
+void reset_draft_model()
+    WASM_SYMBOL_EXPORTED("canister_update reset_draft_model");
 
 void upload_model_bytes_chunk()
     WASM_SYMBOL_EXPORTED("canister_update upload_model_bytes_chunk");
 void upload_tokenizer_bytes_chunk()
-    WASM_SYMBOL_EXPORTED("canister_update upload_tokenizer_bytes_chunk");
\ No newline at end of file
+    WASM_SYMBOL_EXPORTED("canister_update upload_tokenizer_bytes_chunk");
+void upload_draft_model_bytes_chunk()
+    WASM_SYMBOL_EXPORTED("canister_update upload_draft_model_bytes_chunk");
\ No newline at end of file
@@ -60,6 +60,8 @@ void get_user_metadata() {
 
   std::vector<uint64_t> chats_start_time;
   std::vector<uint64_t> chats_total_steps;
+  std::vector<uint64_t> chats_lookup_accepted;
+  std::vector<uint64_t> chats_lookup_rejected;
 
   auto it = p_metadata_users->umap.find(in_principal);
   if (it != p_metadata_users->umap.end()) {
@@ -67,6 +69,8 @@ void get_user_metadata() {
     for (const MetadataChat &chat : it->second.metadata_chats) {
       chats_start_time.push_back(chat.start_time);
       chats_total_steps.push_back(chat.total_steps);
+      chats_lookup_accepted.push_back(chat.lookup_accepted);
+      chats_lookup_rejected.push_back(chat.lookup_rejected);
     }
   }
 
@@ -75,5 +79,9 @@ void get_user_metadata() {
                               CandidTypeVecNat64{chats_start_time});
   user_metadata_record.append("chats_total_steps",
                               CandidTypeVecNat64{chats_total_steps});
+  user_metadata_record.append("chats_lookup_accepted",
+                              CandidTypeVecNat64{chats_lookup_accepted});
+  user_metadata_record.append("chats_lookup_rejected",
+                              CandidTypeVecNat64{chats_lookup_rejected});
   ic_api.to_wire(CandidTypeVariant{"Ok", user_metadata_record});
 }
\ No newline at end of file